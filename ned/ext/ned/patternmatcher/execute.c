@@ -64,6 +64,7 @@ struct _ExecutionContext {
         VALUE input;
         VALUE str;
         char *p;
+        bool ascii;
         unichar prev;
         off_t pos;
         Reach *reach;
@@ -83,6 +84,8 @@ string read from \C{input}.  This will either be equal to \C{input}, if it
 itself was a string, or will be the result of invoking the read method on
 \C{input}.  Finally, \C{p} is a pointer into the contents of \C{str}, i.e., it
 can be thought of as the input cursor that we have been discussing earlier.
+If \C{ascii} is set, every byte of \C{str} is an \ASCII\ character, so that
+we may skip decoding them, see \C{eat_input}.
 The \C{prev} and \C{pos} members are the current (well, depends on how you look
 at it) input symbol and current position in the input.  Note that \C{pos} can’t
 be a calculated value, as \C{input} may give us many \C{str}s, thus there’s no
@@ -113,10 +116,17 @@ update_input(ExecutionContext *context, VALUE input)
 
         context->str = input;
         context->p = RSTRING(input)->ptr;
+        context->ascii = (input != context->input &&
+                          rb_respond_to(context->input, g_id_ascii_p) &&
+                          RTEST(rb_funcall(context->input, g_id_ascii_p, 0)));
 }
 
 /*¶ This function simply checks that the new input is valid and then updates
-the appropriate members. */
+the appropriate members.  An input source that hands us its input through the
+read method may also tell us, by responding to \type{ascii?}, that the string
+that it last gave us consists of \ASCII\ characters only, each of which is
+one byte long.  A buffer can tell this for whole runs of its pieces without
+looking at them, see \C{PieceTree#ascii?}. */
 
 
 /*¶ This next function instead deals with retrieving more input from our input
@@ -545,11 +555,18 @@ members of the execution context: */
 static inline void
 eat_input(ExecutionContext *context)
 {
-        context->prev = utf_char(context->p);
-        context->p = utf_next(context->p);
+        if (context->ascii) {
+                context->prev = (unsigned char)*context->p++;
+        } else {
+                context->prev = utf_char(context->p);
+                context->p = utf_next(context->p);
+        }
         context->pos++;
 }
 
+/*¶ Most of the text that we search is plain \ASCII, so we don’t decode input
+that we have been told consists of such characters only. */
+
 
 /*¶ This is the main loop of our matching.  We check if we have to add the
 initial states or whether we have found a match.  Next, we check if we have
@@ -47,6 +47,7 @@ static ID s_cPatternMatcher;
 
 HIDDEN ID g_ePatternError;
 HIDDEN ID g_id_read;
+HIDDEN ID g_id_ascii_p;
 
 /*¶ The \C{source} field of the pattern||matcher data structure is simply the
 textual representation of the regular expression used as an input pattern. */
@@ -336,6 +337,7 @@ void Init_patternmatcher(void);
 void Init_patternmatcher(void)
 {
         g_id_read = rb_intern("read");
+        g_id_ascii_p = rb_intern("ascii?");
 
         s_cPatternMatcher = rb_define_class("PatternMatcher", rb_cObject);
         rb_define_alloc_func(s_cPatternMatcher, pattern_matcher_s_allocate);
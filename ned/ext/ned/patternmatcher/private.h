@@ -74,13 +74,15 @@ the Ruby interface will have a few of these, as it gives us some arguments that
 we don’t actually need. */
 
 
-/*¶ Finally, we declare two external symbols that are part of the Ruby
+/*¶ Finally, we declare three external symbols that are part of the Ruby
 interface that will be used at various places in the code: */
 
 extern ID g_ePatternError;
 extern ID g_id_read;
+extern ID g_id_ascii_p;
 
 /*¶ The first identifies a Ruby error class that we will define and use for
 errors that relate to our library.  The second identifies the method named
-\type{read}, which will be used for certain arguments to the pattern||matcher.
-*/
+\type{read}, which will be used for certain arguments to the pattern||matcher,
+and the third the method named \type{ascii?}, which such arguments may respond
+to as well. */
@@ -0,0 +1,275 @@
+/*
+ * contents: PieceTree::Added class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#include <ruby.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "source.h"
+#include "added.h"
+#include "private.h"
+
+
+#define ADDED2VALUE(added)                                      \
+        Data_Wrap_Struct(g_cAdded, NULL, added_free, (added))
+
+
+HIDDEN VALUE g_cAdded;
+
+
+/*¶ Chunks are the same size as the blocks that we read the original file in,
+so that reading from the add||file hands out blocks of the same size as
+reading from the original file does: */
+
+#define ADDED_CHUNK_SIZE        SOURCE_BLOCK_SIZE
+
+/*¶ The add||file itself is a table of chunks, of which all but the last one
+are full, and the number of bytes that have been appended to it: */
+
+struct _Added {
+        char **chunks;
+        size_t n_chunks;
+        size_t allocated;
+        off_t size;
+};
+
+/*¶ The \C{allocated} field says how many entries the table has room for. */
+
+
+static void
+added_free(Added *added)
+{
+        for (size_t i = 0; i < added->n_chunks; i++)
+                free(added->chunks[i]);
+        free(added->chunks);
+        free(added);
+}
+
+
+static VALUE
+added_s_allocate(UNUSED(VALUE class))
+{
+        Added *added = ALLOC(Added);
+
+        added->chunks = NULL;
+        added->n_chunks = 0;
+        added->allocated = 0;
+        added->size = 0;
+
+        return ADDED2VALUE(added);
+}
+
+
+/*¶ Appending to the add||file fills up the last chunk and then allocates as
+many new ones as are needed to hold the rest.  The table of chunks is doubled
+in size whenever it fills up, so appending takes amortized time linear in the
+length of what is appended, and nothing that has already been appended is
+ever moved: */
+
+static void
+append(Added *added, char const *p, off_t len)
+{
+        while (len > 0) {
+                off_t used = added->size % ADDED_CHUNK_SIZE;
+                if (used == 0) {
+                        if (added->n_chunks == added->allocated) {
+                                added->allocated = (added->allocated == 0) ?
+                                        16 : 2 * added->allocated;
+                                REALLOC_N(added->chunks, char *,
+                                          added->allocated);
+                        }
+                        added->chunks[added->n_chunks++] =
+                                ALLOC_N(char, ADDED_CHUNK_SIZE);
+                }
+
+                off_t n = ADDED_CHUNK_SIZE - used;
+                if (n > len)
+                        n = len;
+
+                MEMCPY(added->chunks[added->n_chunks - 1] + used, p, char, n);
+                added->size += n;
+                p += n;
+                len -= n;
+        }
+}
+
+
+/*
+ * call-seq:
+ *      added << string → added
+ *
+ * Appends _string_ to the end of _added_.
+ *
+ *      added << "abc"          ⇒ <PieceTree::Added:0xdeadbeef …>
+ */
+static VALUE
+added_append(VALUE self, VALUE str)
+{
+        Added *added;
+
+        VALUE2ADDED(self, added);
+        StringValue(str);
+
+        append(added, RSTRING(str)->ptr, RSTRING(str)->len);
+
+        return self;
+}
+
+
+/*¶ Reading a span of the add||file hands out a pointer into each of the
+chunks that the span covers, so the contents are never copied: */
+
+HIDDEN void
+added_read(Added const *added, off_t offset, off_t len, SourceFunc func,
+           void *closure)
+{
+        if (offset < 0 || len < 0 || offset + len > added->size)
+                rb_raise(rb_eIndexError,
+                         "piece extends beyond end of add-file");
+
+        while (len > 0) {
+                off_t skip = offset % ADDED_CHUNK_SIZE;
+                off_t n = ADDED_CHUNK_SIZE - skip;
+                if (n > len)
+                        n = len;
+
+                if (!func(added->chunks[offset / ADDED_CHUNK_SIZE] + skip, n,
+                          closure))
+                        return;
+
+                offset += n;
+                len -= n;
+        }
+}
+
+
+HIDDEN off_t
+added_size(Added const *added)
+{
+        return added->size;
+}
+
+
+/*¶ The buffer needs to read parts of the add||file as strings of its own: */
+
+static bool
+append_block(char const *p, size_t len, void *closure)
+{
+        rb_str_cat(*(VALUE *)closure, p, len);
+
+        return true;
+}
+
+
+/*
+ * call-seq:
+ *      added[pos, len = 1] → string
+ *
+ * Returns the _len_ bytes beginning at offset _pos_ of _added_.  If _len_
+ * reaches beyond the end of _added_, the String will be shorter than _len_.
+ *
+ * Raises an IndexError if _pos_ is outside of _added_.
+ *
+ *      added[0, 3]             ⇒ "abc"
+ */
+static VALUE
+added_aref(int argc, VALUE *argv, VALUE self)
+{
+        Added *added;
+        VALUE rbpos, rblen;
+
+        VALUE2ADDED(self, added);
+
+        off_t len = 1;
+        if (rb_scan_args(argc, argv, "11", &rbpos, &rblen) == 2)
+                len = NUM2OFFT(rblen);
+
+        off_t pos = NUM2OFFT(rbpos);
+        if (pos < 0 || pos > added->size)
+                rb_raise(rb_eIndexError, "offset %jd outside of add-file",
+                         (intmax_t)pos);
+        if (len < 0)
+                rb_raise(rb_eArgError, "negative length %jd", (intmax_t)len);
+        if (len > added->size - pos)
+                len = added->size - pos;
+
+        VALUE ret = rb_str_buf_new(len);
+        added_read(added, pos, len, append_block, &ret);
+
+        return ret;
+}
+
+
+/*
+ * call-seq:
+ *      added.size → bignum
+ *
+ * Returns the number of bytes that have been appended to _added_.
+ *
+ *      added.size              ⇒ 3
+ */
+static VALUE
+added_get_size(VALUE self)
+{
+        Added *added;
+
+        VALUE2ADDED(self, added);
+
+        return OFFT2NUM(added->size);
+}
+
+
+/*
+ * call-seq:
+ *      added.inspect → string
+ *
+ * Returns a textual representation of _added_.  This method is generally
+ * called by the Kernel::p method and is used mainly for debugging purposes.
+ *
+ *      added.inspect           ⇒ "<PieceTree::Added:0xdeadbeef …>"
+ */
+static VALUE
+added_inspect(VALUE self)
+{
+        Added *added;
+
+        VALUE2ADDED(self, added);
+
+        char buf[INSPECT_BUFFER_SIZE];
+        int len = snprintf(buf, INSPECT_BUFFER_SIZE,
+                           "#<PieceTree::Added:%p size=%jd chunks=%zu>",
+                           added,
+                           (intmax_t)added->size,
+                           added->n_chunks);
+        return rb_str_new(buf, len);
+}
+
+
+/*
+ * Document-class: PieceTree::Added
+ *
+ * A PieceTree::Added is the add-file of a PieceTree, i.e., the file that its
+ * :added pieces point into.  It can only be appended to.
+ */
+void HIDDEN
+Init_Added(void)
+{
+        g_cAdded = rb_define_class_under(g_cPieceTree, "Added", rb_cData);
+        rb_define_alloc_func(g_cAdded, added_s_allocate);
+
+        rb_define_method(g_cAdded, "<<", added_append, 1);
+        rb_define_method(g_cAdded, "[]", added_aref, -1);
+        rb_define_method(g_cAdded, "size", added_get_size, 0);
+        rb_define_alias(g_cAdded, "length", "size");
+        rb_define_method(g_cAdded, "inspect", added_inspect, 0);
+}
@@ -0,0 +1,33 @@
+/*
+ * contents: PieceTree::Added class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:added]{The add||file.}
+
+Everything that is inserted into a buffer is appended to its add||file and
+never removed from it again, as pieces may point into any part of it for as
+long as the buffer is around.  Keeping it in a Ruby string would mean that
+appending to it every now and then moves all of it to a larger block of memory,
+which gets more and more expensive as the file grows.  Instead, we keep it in
+chunks of a fixed size that never move once they have been allocated.  Only
+the table of chunks needs to grow, and it’s a lot smaller. */
+
+typedef struct _Added Added;
+
+extern VALUE g_cAdded;
+
+#define VALUE2ADDED(value, added)       \
+        Data_Get_Struct((value), Added, (added))
+
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+off_t added_size(Added const *added);
+void added_read(Added const *added, off_t offset, off_t len, SourceFunc func,
+                void *closure);
+void Init_Added(void);
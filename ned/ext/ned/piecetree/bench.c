@@ -0,0 +1,380 @@
+/*
+ * contents: Measuring the performance of a PieceTree.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#ifndef _POSIX_C_SOURCE
+#  define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*¶ \subsection[piecetree:benchmarks]{Measuring the tree.}
+
+We have been claiming that the operations on our tree take $\Ordo{\lg n}$
+time, and that walking it from one piece to the next takes $\Ordo{1}$ time on
+average, but claims are no substitute for numbers.  This file is a program of
+its own, built by running \type{make bench} in the directory of the extension,
+that drives the tree the way that a buffer does, but without going through
+Ruby’s method dispatch.  Many of the functions that we want to measure are
+static to \C{iterator.c}, so we simply include it: */
+
+#include "iterator.c"
+
+void Init_piecetree(void);
+
+/*¶ We still need a Ruby interpreter, as trees, iterators, and pieces are Ruby
+objects, and the extension needs to be initialized, but we call our functions
+directly rather than through their methods. */
+
+
+/*¶ The program measures how the tree fares under a couple of patterns of
+edits.  Random edits are spread out all over the tree, sequential ones are all
+made at its end, like when a file is being read in or typed, and clustered ones
+are made close to a cursor that every now and then jumps somewhere else, which
+is how most editing is done: */
+
+typedef enum {
+        PATTERN_RANDOM,
+        PATTERN_SEQUENTIAL,
+        PATTERN_CLUSTERED
+} Pattern;
+
+static char const * const s_pattern_names[] = {
+        "random", "sequential", "clustered"
+};
+
+/*¶ Clustered edits jump on average once every \C{CLUSTER_JUMP} edits and
+otherwise stay within \C{CLUSTER_SPAN} bytes of the cursor: */
+
+#define CLUSTER_JUMP    64
+#define CLUSTER_SPAN    64
+
+
+/*¶ We want the same edits every time that we run with the same seed, so we use
+a generator of our own rather than whatever \C{random} the system gives us: */
+
+static uint64_t s_seed = 0x9e3779b97f4a7c15;
+
+static uint64_t
+bench_random(void)
+{
+        s_seed ^= s_seed << 13;
+        s_seed ^= s_seed >> 7;
+        s_seed ^= s_seed << 17;
+
+        return s_seed;
+}
+
+
+static off_t
+bench_random_below(off_t n)
+{
+        return (n > 0) ? (off_t)(bench_random() % (uint64_t)n) : 0;
+}
+
+
+static double
+bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*¶ The pieces all point into an add||file of random text, one line of which is
+about forty bytes long.  They are between one and \C{PIECE_MAX} bytes long,
+which is what typing and small edits give us: */
+
+#define ADDED_SIZE      (1 << 16)
+#define PIECE_MAX       16
+
+static VALUE
+bench_added(void)
+{
+        VALUE added = rb_str_new(NULL, ADDED_SIZE);
+        char *p = RSTRING(added)->ptr;
+
+        for (long i = 0; i < ADDED_SIZE; i++)
+                p[i] = (bench_random_below(40) == 0)
+                        ? '\n'
+                        : 'a' + bench_random_below(26);
+
+        return added;
+}
+
+
+/*¶ Where the next edit takes place depends on the pattern, the size of the
+tree, and, for clustered edits, on the cursor: */
+
+static off_t
+bench_pos(Pattern pattern, off_t size, off_t *cursor)
+{
+        switch (pattern) {
+        case PATTERN_RANDOM:
+                return bench_random_below(size + 1);
+        case PATTERN_SEQUENTIAL:
+                return size;
+        case PATTERN_CLUSTERED:
+                if (*cursor > size || bench_random_below(CLUSTER_JUMP) == 0)
+                        *cursor = bench_random_below(size + 1);
+                off_t pos = *cursor + bench_random_below(CLUSTER_SPAN);
+                return (pos < size) ? pos : size;
+        default:
+                abort();
+        }
+}
+
+
+/*¶ A piece is inserted before the piece that contains the position of the
+edit, or after the last piece if the edit is made at the end of the tree, just
+as the buffer does it.  Doing so never requires splitting a piece, but
+\C{iterator_insert} still counts the newlines and characters of the piece, so
+the time of an insert includes reading its at most \C{PIECE_MAX} bytes from
+the add||file, just as it does when the buffer inserts some text: */
+
+static void
+bench_insert(VALUE rbtree, PieceTree *tree, VALUE rbpiece, Piece *piece,
+             off_t pos)
+{
+        static VALUE before = Qnil, after = Qnil;
+
+        if (NIL_P(before)) {
+                before = ID2SYM(rb_intern("before"));
+                after = ID2SYM(rb_intern("after"));
+        }
+
+        piece->size = 1 + bench_random_below(PIECE_MAX);
+        piece->offset = bench_random_below(ADDED_SIZE - piece->size);
+
+        if (tree->size == 0 || pos < tree->size)
+                iterator_insert(piece_tree_new_iter(rbtree, OFFT2NUM(pos)),
+                                rbpiece, before);
+        else
+                iterator_insert(piece_tree_new_iter(rbtree,
+                                                    OFFT2NUM(tree->size - 1)),
+                                rbpiece, after);
+}
+
+
+/*¶ The depth of the tree tells us how well balanced it is.  A red||black tree
+of $n$ nodes is never deeper than $2\lg(n + 1)$: */
+
+static void
+bench_depth(Node const *node, int depth, int *max, double *sum)
+{
+        if (node == pt_null)
+                return;
+
+        depth++;
+        if (depth > *max)
+                *max = depth;
+        *sum += depth;
+
+        bench_depth(node->left, depth, max, sum);
+        bench_depth(node->right, depth, max, sum);
+}
+
+
+/*¶ Allocations are counted by asking Ruby how many objects it knows of
+before and after a sample of \C{OBJECTS_SAMPLE} operations, with the garbage
+collector turned off so that none of them go away in between.  The count also
+includes the handful of objects that asking for it creates, but spread over the
+sample they don’t make a difference: */
+
+#define OBJECTS_SAMPLE  1000
+
+static long
+bench_objects(void)
+{
+        return NUM2LONG(rb_eval_string("ObjectSpace.each_object { }"));
+}
+
+
+/*¶ A run builds a tree of $n$ pieces by inserting them one at a time, then
+measures looking pieces up by offset, walking the tree from one piece to the
+next, and fixing up the sizes of the tree after a piece has grown or shrunk,
+before deleting all the pieces again, one at a time.  Each row of output
+gives the time per operation of each of these, in nanoseconds, along with the
+depth of the tree, the memory that its nodes take up once it has been built,
+how many of those nodes are waiting to be reused once all pieces have been
+deleted, and how many Ruby objects an insert, a lookup, and a delete
+allocate: */
+
+typedef struct _BenchResult BenchResult;
+
+struct _BenchResult {
+        double insert;
+        double lookup;
+        double next;
+        double fix_size;
+        double delete;
+        int max_depth;
+        double average_depth;
+        size_t blocks;
+        size_t block_size;
+        size_t released;
+        double insert_objects;
+        double lookup_objects;
+        double delete_objects;
+};
+
+
+static void
+bench_run(Pattern pattern, long n, BenchResult *result)
+{
+        VALUE rbtree = rb_class_new_instance(2, (VALUE []){
+                                                     rb_str_new2(""),
+                                                     bench_added()
+                                             }, g_cPieceTree);
+        PieceTree *tree;
+        VALUE2PIECETREE(rbtree, tree);
+
+        Piece *piece = ALLOC(Piece);
+        *piece = (Piece){ .origin = ADDED };
+        VALUE rbpiece = OWNEDPIECE2VALUE(piece);
+
+        off_t cursor = 0;
+        double start = bench_now();
+        for (long i = 0; i < n; i++)
+                bench_insert(rbtree, tree, rbpiece, piece,
+                             bench_pos(pattern, tree->size, &cursor));
+        result->insert = (bench_now() - start) / n;
+
+        result->max_depth = 0;
+        result->average_depth = 0;
+        bench_depth(tree->root, 0, &result->max_depth, &result->average_depth);
+        result->average_depth /= n;
+        result->blocks = node_pool_blocks(tree->pool, &result->block_size);
+
+        start = bench_now();
+        for (long i = 0; i < n; i++)
+                piece_tree_new_iter(rbtree,
+                                    OFFT2NUM(bench_pos(pattern,
+                                                       tree->size - 1,
+                                                       &cursor)));
+        result->lookup = (bench_now() - start) / n;
+
+        Node **nodes = ALLOC_N(Node *, n);
+        Node *first = tree->root;
+        while (first->left != pt_null)
+                first = first->left;
+        long i = 0;
+        start = bench_now();
+        for (Node *x = first; x != NULL; x = node_next(x))
+                nodes[i++] = x;
+        result->next = (bench_now() - start) / n;
+        assert(i == n);
+
+        start = bench_now();
+        for (i = 0; i < n; i++) {
+                Node *x = nodes[bench_random_below(n)];
+                x->piece.size++;
+                fix_size(x, tree->root);
+                x->piece.size--;
+                fix_size(x, tree->root);
+        }
+        result->fix_size = (bench_now() - start) / (2 * n);
+        free(nodes);
+
+        start = bench_now();
+        while (tree->size > 0)
+                iterator_delete(piece_tree_new_iter(rbtree,
+                        OFFT2NUM(bench_pos(pattern, tree->size - 1,
+                                           &cursor))));
+        result->delete = (bench_now() - start) / n;
+
+        assert(tree->root == pt_null);
+        rb_gc();
+        rb_gc_disable();
+        long objects = bench_objects();
+        result->released = node_pool_released(tree->pool);
+
+        for (i = 0; i < OBJECTS_SAMPLE; i++)
+                bench_insert(rbtree, tree, rbpiece, piece,
+                             bench_pos(pattern, tree->size, &cursor));
+        long inserted = bench_objects();
+        for (i = 0; i < OBJECTS_SAMPLE; i++)
+                piece_tree_new_iter(rbtree,
+                                    OFFT2NUM(bench_pos(pattern,
+                                                       tree->size - 1,
+                                                       &cursor)));
+        long found = bench_objects();
+        while (tree->size > 0)
+                iterator_delete(piece_tree_new_iter(rbtree,
+                        OFFT2NUM(bench_pos(pattern, tree->size - 1,
+                                           &cursor))));
+        long deleted = bench_objects();
+        rb_gc_enable();
+
+        result->insert_objects = (inserted - objects) / (double)OBJECTS_SAMPLE;
+        result->lookup_objects = (found - inserted) / (double)OBJECTS_SAMPLE;
+        result->delete_objects = (deleted - found) / (double)OBJECTS_SAMPLE;
+}
+
+/*¶ The walk records the nodes that it visits, so that we can pick nodes at
+random to fix up the sizes after, which is what every change to the size of a
+piece must do.  We grow a piece and then shrink it back, so that the tree is
+the same after as before.  All of these operations allocate iterators, just
+as they do when they are called from Ruby, so the numbers include the time
+spent collecting them.  The allocations are counted after the timed part of the
+run, once the tree is empty again, as the collector mustn’t run while we count
+them.  Iterators hold on to the nodes that they point to, so we collect the
+ones that are left before counting the nodes that are waiting to be reused. */
+
+
+/*¶ The program takes the largest number of pieces to build trees of, going
+from a thousand up to it in steps of a factor of ten, and the seed to begin
+with.  Trees of ten million pieces take up a couple of gigabytes of memory,
+so the default is a million: */
+
+int
+main(int argc, char **argv)
+{
+        long max = (argc > 1) ? strtol(argv[1], NULL, 10) : 1000000;
+        if (argc > 2)
+                s_seed = strtoull(argv[2], NULL, 0) | 1;
+
+#ifdef RUBY_INIT_STACK
+        RUBY_INIT_STACK;
+#endif
+        ruby_init();
+        Init_piecetree();
+
+        printf("%-10s %9s %8s %8s %8s %8s %8s %9s %9s %6s %9s %13s\n",
+               "pattern", "pieces", "insert", "lookup", "next", "fix_size",
+               "delete", "depth", "KiB", "blocks", "released", "objects");
+
+        for (int p = PATTERN_RANDOM; p <= PATTERN_CLUSTERED; p++) {
+                for (long n = 1000; n <= max; n *= 10) {
+                        BenchResult r;
+
+                        bench_run(p, n, &r);
+
+                        printf("%-10s %9ld %8.1f %8.1f %8.1f %8.1f %8.1f "
+                               "%3d/%5.1f %9zu %6zu %9zu %3.1f/%3.1f/%3.1f\n",
+                               s_pattern_names[p], n, r.insert, r.lookup,
+                               r.next, r.fix_size, r.delete, r.max_depth,
+                               r.average_depth,
+                               r.blocks * r.block_size / 1024, r.blocks,
+                               r.released, r.insert_objects, r.lookup_objects,
+                               r.delete_objects);
+                        fflush(stdout);
+
+                        rb_gc();
+                }
+        }
+
+        return 0;
+}
+
+/*¶ The times are all in nanoseconds per operation, the depth is the maximum
+and the average depth of a node, the memory is that of the blocks that the
+nodes were allocated from, and the objects are the number of Ruby objects
+allocated per insert, lookup, and delete. */
@@ -30,6 +30,14 @@ have_header('ruby.h')
 have_header('stdbool.h')
 have_header('stdint.h')
 have_header('sys/types.h')
+have_header('sys/mman.h')
+have_header('sys/uio.h')
+have_header('sys/sendfile.h')
+have_func('sendfile')
+have_func('copy_file_range')
+have_var('rb_thread_critical')
+
+$objs = (Dir['*.c'] - ['bench.c']).map { |f| f.sub(/\.c\z/, ".#$OBJEXT") }
 
 create_makefile('ned/piecetree')
 
@@ -64,6 +72,15 @@ condocs: $(TEX_SOURCES)
 	  echo "\\stopcomponent"; \\
 	} > $@
 
-.PHONY: tags docs condocs
+BENCH_OBJS := $(filter-out iterator.$(OBJEXT),$(OBJS))
+
+bench: piecetree-bench
+	./piecetree-bench $(BENCH_ARGS)
+
+piecetree-bench: bench.c iterator.c $(BENCH_OBJS)
+	$(CC) $(INCFLAGS) $(CPPFLAGS) $(CFLAGS) $(LDFLAGS) -o $@ bench.c \\
+	  $(BENCH_OBJS) $(LIBPATH) $(LIBRUBYARG) $(LIBS)
+
+.PHONY: tags docs condocs bench
 EOF
 end
@@ -0,0 +1,427 @@
+/*
+ * contents: Hashing the contents of a PieceTree.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#include <ruby.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "source.h"
+#include "hash.h"
+#include "private.h"
+
+
+/*¶ The base is picked at random every time that we start, see
+\C{Init_Hash}.  The hashes are never saved anywhere, so nothing depends on it
+staying the same between runs, and a base that nobody knows in advance means
+that nobody can construct two contents that hash to the same value: */
+
+#define HASH_PRIME      ((UINT64_C(1) << 61) - 1)
+
+static uint64_t s_base;
+
+
+/*¶ Reducing a number modulo a Mersenne prime doesn’t take a division, as
+$2^{61} \equiv 1$, so the bits above the 61st may simply be added to those
+below it.  This function reduces any 64||bit number: */
+
+static uint64_t
+hash_reduce(uint64_t x)
+{
+        x = (x & HASH_PRIME) + (x >> 61);
+
+        return (x >= HASH_PRIME) ? x - HASH_PRIME : x;
+}
+
+
+/*¶ Multiplying two numbers below the prime gives us a product of up to 122
+bits.  Most compilers that we care about give us a 128||bit integer type to
+hold it in, and otherwise we split the factors into 32||bit halves and add up
+the partial products ourselves, using $2^{64} \equiv 8$: */
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 uint128;
+
+static uint64_t
+hash_reduce128(uint128 x)
+{
+        return hash_reduce((uint64_t)(x & HASH_PRIME) + (uint64_t)(x >> 61));
+}
+
+
+static uint64_t
+hash_mul(uint64_t a, uint64_t b)
+{
+        return hash_reduce128((uint128)a * b);
+}
+#else
+static uint64_t
+hash_mul(uint64_t a, uint64_t b)
+{
+        uint64_t a1 = a >> 32, a0 = a & UINT32_MAX;
+        uint64_t b1 = b >> 32, b0 = b & UINT32_MAX;
+        uint64_t high = a1 * b1;
+        uint64_t middle = a1 * b0 + a0 * b1;
+        uint64_t low = a0 * b0;
+
+        return hash_reduce((high << 3) + (middle >> 29) +
+                           ((middle & ((UINT64_C(1) << 29) - 1)) << 32) +
+                           (low >> 61) + (low & HASH_PRIME));
+}
+#endif
+
+/*¶ The partial products are small enough that their sum doesn’t overflow, as
+$a_1, b_1 < 2^{29}$. */
+
+
+/*¶ We need $B^n$ both for the scale of a hash and for hashing eight bytes at
+a time, see below.  The first few powers are computed once and for all, as is
+the inverse of $B$, which, as $P$ is a prime, is $B^{P-2}$: */
+
+#define HASH_UNROLL     8
+
+static uint64_t s_powers[HASH_UNROLL + 1];
+static uint64_t s_inverse;
+
+
+static uint64_t
+hash_power(uint64_t base, uint64_t n)
+{
+        uint64_t result = 1;
+
+        for ( ; n > 0; n >>= 1) {
+                if (n & 1)
+                        result = hash_mul(result, base);
+                base = hash_mul(base, base);
+        }
+
+        return result;
+}
+
+
+static uint64_t
+hash_pow(off_t n)
+{
+        return hash_power(s_base, n);
+}
+
+
+static uint64_t
+hash_sub(uint64_t a, uint64_t b)
+{
+        return hash_reduce(a + HASH_PRIME - b);
+}
+
+
+HIDDEN void
+hash_concat(Hash const *a, Hash const *b, Hash *result)
+{
+        uint64_t value = hash_reduce(hash_mul(a->value, b->scale) + b->value);
+        uint64_t scale = hash_mul(a->scale, b->scale);
+
+        result->value = value;
+        result->scale = scale;
+}
+
+
+HIDDEN bool
+hash_equal(Hash const *a, Hash const *b)
+{
+        return a->value == b->value && a->scale == b->scale;
+}
+
+/*¶ Hashes are passed around by reference, as we don’t return structures from
+functions, and the result of a concatenation may be stored in either of its
+parts. */
+
+
+/*¶ Hashing a block of bytes is a matter of evaluating the polynomial by
+Horner’s rule.  Doing so one byte at a time makes every multiplication wait
+for the one before it, so where we have 128||bit integers, we instead
+multiply the hash so far by $B^8$ and add the next eight bytes times their
+powers of $B$, which the processor may compute side by side, reducing the sum
+only once.  The sum stays well below $2^{128}$: */
+
+static bool
+hash_block(char const *p, size_t len, void *closure)
+{
+        uint64_t *value = closure;
+        uint64_t h = *value;
+        unsigned char const *s = (unsigned char const *)p;
+
+#ifdef __SIZEOF_INT128__
+        for ( ; len >= HASH_UNROLL; s += HASH_UNROLL, len -= HASH_UNROLL) {
+                uint128 x = (uint128)h * s_powers[HASH_UNROLL];
+                for (int i = 0; i < HASH_UNROLL; i++)
+                        x += (uint128)(s[i] + 1) *
+                                s_powers[HASH_UNROLL - 1 - i];
+                h = hash_reduce128(x);
+        }
+#endif
+        for ( ; len > 0; s++, len--)
+                h = hash_reduce(hash_mul(h, s_base) + s[0] + 1);
+
+        *value = h;
+
+        return true;
+}
+
+
+/*¶ The hash of the contents of a piece: */
+
+HIDDEN void
+hash_span(PieceTree const *tree, Piece const *piece, Hash *hash)
+{
+        uint64_t value = 0;
+
+        source_read(tree, piece, 0, piece->size, hash_block, &value);
+
+        hash->value = value;
+        hash->scale = hash_pow(piece->size);
+}
+
+
+static uint64_t
+hash_extent(PieceTree const *tree, PieceOrigin origin, off_t from, off_t to)
+{
+        if (to <= from)
+                return 0;
+
+        Piece piece = { .origin = origin, .offset = from, .size = to - from };
+        Hash hash;
+        hash_span(tree, &piece, &hash);
+
+        return hash.value;
+}
+
+
+/*¶ Most edits only shave a little off of either end of a piece, or cut it in
+two, and the node keeps the hash of the extent that the piece used to have
+until it is asked for a new one.  If the old extent $[a, b)$ and the new one
+$[c, d)$ overlap in $[x, y)$, the hash of the overlap is that of the old
+extent, minus the hashes of $[a, x)$ and $[y, b)$, suitably scaled, divided
+by $B^{b-y}$, and the hash of the new extent is that of $[c, x)$, the
+overlap, and $[y, d)$.  We thus only read what has been removed from and added
+to the piece, which, when a large piece is cut in two, is a lot less than the
+piece itself.  If that isn’t the case, we simply hash the new extent: */
+
+static bool
+hash_derive(PieceTree const *tree, PieceHash const *known, Piece const *piece,
+            uint64_t *value)
+{
+        off_t a = known->offset, b = known->offset + known->size;
+        off_t c = piece->offset, d = piece->offset + piece->size;
+        off_t x = (a > c) ? a : c;
+        off_t y = (b < d) ? b : d;
+
+        if (known->origin != piece->origin || x >= y ||
+            (x - a) + (b - y) + (x - c) + (d - y) >= piece->size)
+                return false;
+
+        PieceOrigin origin = piece->origin;
+        uint64_t overlap = known->value;
+        overlap = hash_sub(overlap, hash_mul(hash_extent(tree, origin, a, x),
+                                             hash_pow(b - x)));
+        overlap = hash_sub(overlap, hash_extent(tree, origin, y, b));
+        overlap = hash_mul(overlap, hash_power(s_inverse, b - y));
+
+        uint64_t result = hash_mul(hash_extent(tree, origin, c, x),
+                                   hash_pow(d - x));
+        result = hash_reduce(result + hash_mul(overlap, hash_pow(d - y)));
+        *value = hash_reduce(result + hash_extent(tree, origin, y, d));
+
+        return true;
+}
+
+
+/*¶ The hash of the piece of a node is thus only computed from scratch if the
+node doesn’t already have one for the piece’s current extent, or one that it
+can be derived from: */
+
+static void
+hash_piece(PieceTree const *tree, Node const *node, PieceHash *cached,
+           Hash *hash)
+{
+        Piece const *piece = &node->piece;
+
+        if (cached->origin != piece->origin ||
+            cached->offset != piece->offset || cached->size != piece->size) {
+                uint64_t value;
+                if (!hash_derive(tree, cached, piece, &value))
+                        value = hash_extent(tree, piece->origin,
+                                            piece->offset,
+                                            piece->offset + piece->size);
+                *cached = (PieceHash){
+                        piece->origin, piece->offset, piece->size, value
+                };
+        }
+
+        hash->value = cached->value;
+        hash->scale = hash_pow(piece->size);
+}
+
+/*¶ The scale is cheap enough to compute, taking $\Ordo{\lg n}$
+multiplications, that we don’t bother storing it for the piece.  A node that
+is split off of another one, see \C{iterator_split}, is given the hash of the
+piece that it was split off of, so that both halves may be derived from it.
+Trees that are built anew, e.g., by \C{compact} or \C{apply_edits}, start
+over from scratch, though. */
+
+
+/*¶ The hash of a sub||tree is then that of its left sub||tree, its piece, and
+its right sub||tree, in that order.  Only nodes that have been modified since
+they were last asked are visited, so after an edit this takes time
+proportional to the height of the tree, plus the time it takes to read the
+pieces that the edit changed: */
+
+HIDDEN void
+hash_node(PieceTree const *tree, Node *node, Hash *hash)
+{
+        if (node == pt_null) {
+                hash->value = 0;
+                hash->scale = 1;
+                return;
+        }
+
+        NodeHash *cached = node_hash(node);
+        if (!node->hashed) {
+                Hash left, piece, right;
+                hash_node(tree, node->left, &left);
+                hash_piece(tree, node, &cached->piece, &piece);
+                hash_node(tree, node->right, &right);
+                hash_concat(&left, &piece, &left);
+                hash_concat(&left, &right, &cached->subtree);
+                node->hashed = true;
+        }
+
+        *hash = cached->subtree;
+}
+
+/*¶ The nodes of a snapshot cache their hashes just like any other nodes.  A
+snapshot never changes, so neither do they, and the tree that it was taken of
+shares them, and their hashes, until it modifies them.  Reading a piece may
+call back into Ruby, though, so, as for \C{extract}, another thread must stick
+to hashing snapshots of a tree that is being edited. */
+
+
+/*
+ * call-seq:
+ *      tree.content_hash → integer
+ *
+ * Returns a hash of the contents of _tree_, which is the same for any two
+ * trees with the same contents, however they are split up into pieces.  The
+ * hash is cached, so asking for it again after an edit only rereads the
+ * pieces that the edit changed.  The hash is computed with a base that is
+ * picked at random when Ned starts, so it differs between runs.
+ *
+ *      tree.content_hash       ⇒ 1234567890123456789
+ */
+static VALUE
+piece_tree_content_hash(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        Hash hash;
+        hash_node(tree, tree->root, &hash);
+
+        return ULL2NUM(hash.value);
+}
+
+
+/*
+ * call-seq:
+ *      tree.same_contents?(other) → bool
+ *
+ * Returns +true+ if _tree_ and _other_, which must be a PieceTree as well,
+ * have the same contents.  This compares their sizes, newlines, characters,
+ * ASCII characters, and hashes, see #content_hash, so it takes constant time
+ * once their hashes are known, which is usually the case for a tree and its
+ * snapshots.  Two trees with different contents of _n_ bytes are taken to be
+ * the same with a probability of at most about _n_/2^61.
+ *
+ *      tree.same_contents?(tree.snapshot)
+ *                              ⇒ true
+ */
+static VALUE
+piece_tree_same_contents_p(VALUE self, VALUE rbother)
+{
+        if (!RTEST(rb_obj_is_kind_of(rbother, g_cPieceTree)))
+                rb_raise(rb_eTypeError, "not a PieceTree");
+
+        PieceTree *tree, *other;
+
+        VALUE2PIECETREE(self, tree);
+        VALUE2PIECETREE(rbother, other);
+
+        if (tree->root == other->root)
+                return Qtrue;
+        if (tree->size != other->size || tree->lines != other->lines ||
+            tree->chars != other->chars || tree->ascii != other->ascii)
+                return Qfalse;
+
+        Hash a, b;
+        hash_node(tree, tree->root, &a);
+        hash_node(other, other->root, &b);
+
+        return BOOL2VALUE(hash_equal(&a, &b));
+}
+
+/*¶ Two different contents of $n$ bytes hash to the same value only if $B$
+is a root of the difference of their polynomials, which, being of degree at
+most $n$, has at most $n$ of them.  With $B$ picked at random, that happens
+with a probability of at most about $n / 2^{61}$.  That’s small enough to tell
+trees apart, but not small enough to replace comparing them, so anything that
+would lose data if two trees were wrongly taken to be the same, like
+\C{same_as_original}, see \insection[piecetree:writing], compares their bytes
+before trusting their hashes. */
+
+
+/*¶ The base is read from \type{/dev/urandom}, if we can, and taken from
+\C{Kernel#rand} otherwise.  It must not be 0 or 1, nor $P - 1$, as their
+powers repeat after at most two steps: */
+
+static uint64_t
+hash_random_base(void)
+{
+        uint64_t seed = 0;
+
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd != -1) {
+                if (read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed))
+                        seed = 0;
+                close(fd);
+        }
+        if (seed == 0)
+                seed = NUM2ULL(rb_funcall(rb_mKernel, rb_intern("rand"), 1,
+                                          ULL2NUM(HASH_PRIME)));
+
+        return 2 + seed % (HASH_PRIME - 3);
+}
+
+
+HIDDEN void
+Init_Hash(void)
+{
+        s_base = hash_random_base();
+        s_powers[0] = 1;
+        for (int i = 1; i <= HASH_UNROLL; i++)
+                s_powers[i] = hash_mul(s_powers[i - 1], s_base);
+        s_inverse = hash_power(s_base, HASH_PRIME - 2);
+
+        rb_define_method(g_cPieceTree, "content_hash", piece_tree_content_hash,
+                         0);
+        rb_define_method(g_cPieceTree, "same_contents?",
+                         piece_tree_same_contents_p, 1);
+}
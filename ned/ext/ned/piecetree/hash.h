@@ -0,0 +1,50 @@
+/*
+ * contents: Hashing the contents of a PieceTree.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:hashing]{Hashing the contents of a tree.}
+
+Telling whether two versions of a buffer have the same contents, e.g., to find
+out if a script that we have run has changed anything at all, used to mean
+extracting both of them and comparing the strings.  Instead, every node of a
+tree can give us a hash of the contents of its sub||tree, which it caches, so
+that comparing two trees only takes looking at their roots, once their hashes
+are known.
+
+The hash has to be the same for the same contents, however they are split up
+into pieces, so we can’t simply combine the hashes of the pieces in some
+arbitrary way.  We use a polynomial hash, treating a string $s_0 s_1 \dots
+s_{n-1}$ as the polynomial $\sum_i (s_i + 1) B^{n-1-i}$ evaluated modulo the
+prime $P = 2^{61} - 1$ at some base $B$.  The hash of the concatenation of
+two strings $a$ and $b$ is then the hash of $a$ times $B^{|b|}$ plus the hash
+of $b$, so each \C{Hash} also remembers $B$ raised to the length of what it
+hashes, which we call its \C{scale}.
+
+A node’s cached hash is only valid while its \C{hashed} bit is set.  Anything
+that modifies a node clears it for that node and all the nodes above it, see
+\C{node_unhash}, so that it will be recomputed from the hashes of its children
+and its piece when it is next asked for.  The hash of the piece itself is kept
+along with the extent of the piece that it was computed for, as recomputing it
+means reading the whole piece.  The contents of a given extent of a source
+never change, so it remains valid for as long as the extent does, and once it
+doesn’t, we can often derive the hash of the new extent from it, see
+\C{hash_derive}.
+
+Only the \C{hashed} bit is kept in the node itself.  The hashes are kept by
+the block that the node was allocated from, see \C{node_hash}, which doesn’t
+make room for them until they are first asked for, so a tree that is never
+hashed doesn’t pay for them. */
+
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+void hash_concat(Hash const *a, Hash const *b, Hash *result);
+bool hash_equal(Hash const *a, Hash const *b);
+void hash_span(PieceTree const *tree, Piece const *piece, Hash *hash);
+void hash_node(PieceTree const *tree, Node *node, Hash *hash);
+void Init_Hash(void);
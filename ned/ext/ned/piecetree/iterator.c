@@ -13,16 +13,17 @@
 
 #include "piece.h"
 #include "node.h"
+#include "mark.h"
 #include "piecetree.h"
 #include "iterator.h"
+#include "source.h"
 #include "private.h"
 
 /*¶ In the internal functions of an iterator we often need to extract an
 iterator from a Ruby value and then verify that it’s valid, thus */
 
 #define SETUP_VALID_ITERATOR(self, iter) \
-        Iterator *iter;                  \
-        VALUE2ITERATOR(self, iter);      \
+        Iterator *iter = iterator_get(self); \
         if (!iterator_is_valid(iter))   \
                 rb_raise(rb_eScriptError, "iterator has moved outside of tree");
 
@@ -39,9 +40,21 @@ the left or right child of its parent, assuming it has one: */
 
 struct _Iterator {
         VALUE tree;
+        NodePool *pool;
         Node *node;
+        unsigned int restored;
+        off_t pos;
+        unsigned int modifications;
 };
 
+/*¶ An iterator holds a reference to the node that it points to, so that the
+node stays around for as long as the iterator does, even if it is removed from
+the tree.  As the node may outlive the tree, the iterator must also hold on to
+the pool that the node was allocated from.  The \C{restored} field says what
+generation the tree was last restored in when the iterator was created.  The
+last two fields cache the position of the node in the tree, see
+\C{iterator_pos} below.  A negative \C{pos} means that we don’t know it. */
+
 
 HIDDEN VALUE g_cIterator;
 
@@ -53,12 +66,19 @@ tree, and we don’t want ruby to free that tree before our user’s finished wi
 all iterators pointing to that tree. */
 
 HIDDEN Iterator *
-iterator_new(VALUE tree, Node *node)
+iterator_new(VALUE tree, Node *node, off_t pos)
 {
         Iterator *iter = ALLOC(Iterator);
+        PieceTree *t;
+
+        VALUE2PIECETREE(tree, t);
 
         iter->tree = tree;
-        iter->node = node;
+        iter->pool = node_pool_ref(t->pool);
+        iter->node = node_ref(node);
+        iter->restored = t->restored;
+        iter->pos = pos;
+        iter->modifications = t->modifications;
 
         return iter;
 }
@@ -74,10 +94,60 @@ iterator_mark(Iterator *iter)
 HIDDEN void
 iterator_free(Iterator *iter)
 {
+        node_unref(iter->pool, iter->node);
+        node_pool_unref(iter->pool);
         free(iter);
 }
 
 
+/*¶ Whenever an iterator is moved, it must let go of the node that it pointed
+to and take a reference to the new one.  Moving an iterator doesn’t change the
+position that it has cached, so whoever moves it must also take care of
+that: */
+
+static void
+iterator_set_node(Iterator *iter, Node *node)
+{
+        node_ref(node);
+        node_unref(iter->pool, iter->node);
+        iter->node = node;
+}
+
+
+/*¶ The node that an iterator points to may have been copied since the iterator
+was last used, see \insection[piecetree:snapshots], in which case we follow
+the \C{forward} pointers to the copy that is part of the tree.  Only pointers
+set up since the tree was last restored lead into the tree, as any earlier ones
+lead into edits that were thrown away.  For the same reason, an iterator
+created before the tree was last restored is no longer valid.  All this is
+done whenever an iterator is extracted from its Ruby value: */
+
+static Iterator *
+iterator_get(VALUE self)
+{
+        Iterator *iter;
+        PieceTree *tree;
+
+        VALUE2ITERATOR(self, iter);
+        VALUE2PIECETREE(iter->tree, tree);
+
+        if (iter->restored != tree->restored) {
+                iterator_set_node(iter, NULL);
+                iter->restored = tree->restored;
+        }
+
+        Node *node = iter->node;
+        while (node != NULL && node->forward != NULL &&
+               node->forward->generation >= tree->restored)
+                node = node->forward;
+
+        if (node != iter->node)
+                iterator_set_node(iter, node);
+
+        return iter;
+}
+
+
 /*¶ A related function is one that duplicates a given iterator: */
 
 /*
@@ -92,11 +162,9 @@ iterator_free(Iterator *iter)
 static VALUE
 iterator_dup(VALUE self)
 {
-        Iterator *iter;
+        Iterator *iter = iterator_get(self);
 
-        VALUE2ITERATOR(self, iter);
-
-        return ITERATOR2VALUE(iterator_new(iter->tree, iter->node));
+        return ITERATOR2VALUE(iterator_new(iter->tree, iter->node, iter->pos));
 }
 
 /*¶ Duplication is rather straightforward, as you can see. */
@@ -121,9 +189,7 @@ check for moving an iterator forward in the tree: */
 static VALUE
 iterator_has_next_p(VALUE self)
 {
-        Iterator *iter;
-
-        VALUE2ITERATOR(self, iter);
+        Iterator *iter = iterator_get(self);
 
         return BOOL2VALUE(iter->node != pt_null && node_next(iter->node) != NULL);
 }
@@ -147,10 +213,12 @@ it: */
 static VALUE
 iterator_next(VALUE self)
 {
-        Iterator *iter;
+        Iterator *iter = iterator_get(self);
+        Node *next = node_next(iter->node);
 
-        VALUE2ITERATOR(self, iter);
-        iter->node = node_next(iter->node);
+        if (next != NULL && iter->pos >= 0)
+                iter->pos += iter->node->piece.size;
+        iterator_set_node(iter, next);
 
         return self;
 }
@@ -173,9 +241,7 @@ previous two, but in the other direction: */
 static VALUE
 iterator_has_prev_p(VALUE self)
 {
-        Iterator *iter;
-
-        VALUE2ITERATOR(self, iter);
+        Iterator *iter = iterator_get(self);
         
         return BOOL2VALUE(iter->node != pt_null && node_prev(iter->node) != NULL);
 }
@@ -197,10 +263,12 @@ iterator_has_prev_p(VALUE self)
 static VALUE
 iterator_prev(VALUE self)
 {
-        Iterator *iter;
+        Iterator *iter = iterator_get(self);
+        Node *prev = node_prev(iter->node);
 
-        VALUE2ITERATOR(self, iter);
-        iter->node = node_prev(iter->node);
+        if (prev != NULL && iter->pos >= 0)
+                iter->pos -= prev->piece.size;
+        iterator_set_node(iter, prev);
 
         return self;
 }
@@ -235,9 +303,7 @@ here’s a wrapper for the above function: */
 static VALUE
 iterator_valid_p(VALUE self)
 {
-        Iterator *iter;
-
-        VALUE2ITERATOR(self, iter);
+        Iterator *iter = iterator_get(self);
 
         return BOOL2VALUE(iterator_is_valid(iter));
 }
@@ -250,7 +316,10 @@ to houses: */
  * call-seq:
  *      iter.piece → piece
  *
- * Returns the piece that the iterator is currently on.
+ * Returns the piece that the iterator is currently on.  The piece is a view
+ * into the PieceTree, so use #resize or #split rather than altering it
+ * directly, as direct changes won’t be kept out of any PieceTree#snapshot’s
+ * that share it.
  *
  *      iter.piece              ⇒ <PieceTree::Piece:0xdeadbeef …>
  */
@@ -259,21 +328,62 @@ iterator_get_piece(VALUE self)
 {
         SETUP_VALID_ITERATOR(self, iter);
 
-        return PIECE2VALUE(iter->node->piece);
+        return PIECE2VALUE(&iter->node->piece);
 }
 
 
 /*¶ We would also like a way to tell the position of a node within a buffer,
 i.e., the offset within the buffer at which this iterator’s node begins.  This
-is a calculated value, taking $\Ordo{\lg n} $ time, so it should be used
-sparingly. */
+is a calculated value, taking $\Ordo{\lg n} $ time, as we have to walk up to
+the root to find it.  Callers tend to ask for it over and over again, though,
+often without modifying the tree in between, so we remember what we found,
+along with the number of modifications that had been made to the tree at the
+time.  As long as that number hasn’t changed, neither has our position: */
+
+static off_t
+iterator_pos(Iterator *iter, PieceTree const * const tree)
+{
+        if (iter->pos >= 0 && iter->modifications == tree->modifications)
+                return iter->pos;
+
+        off_t pos = iter->node->piece.size_left;
+
+        for (Node *p = iter->node; p != tree->root && p->parent != NULL;
+             p = p->parent)
+                if (is_right_child(p))
+                        pos += p->parent->piece.size_left +
+                                p->parent->piece.size;
+
+        iter->pos = pos;
+        iter->modifications = tree->modifications;
+
+        return pos;
+}
+
+/*¶ Moving an iterator to the next or previous node keeps the position up to
+date by adding or subtracting the size of the piece that it moves past, so
+walking the tree with an iterator never has to go up to the root. */
+
+
+/*¶ An iterator that modifies the tree without moving its own node around
+knows that its own position is still the same, even though the positions of
+all other iterators may have changed, so it may keep it: */
+
+static void
+iterator_keep_pos(Iterator *iter, PieceTree const * const tree, off_t pos)
+{
+        iter->pos = pos;
+        iter->modifications = tree->modifications;
+}
+
 
 /*
  * call-seq:
  *      iter.pos → bignum
  *
  * Returns the position/offset of the iterator in the PieceTree to which it
- * belongs.  This is an O(lg _n_) operation, so use it sparingly.
+ * belongs.  This is an O(lg _n_) operation, unless the position is already
+ * known and the PieceTree hasn’t been modified since, in which case it’s O(1).
  *
  *      iter.pos                ⇒ 0
  *      iter.next; iter.pos     ⇒ 12345678
@@ -286,14 +396,7 @@ iterator_get_pos(VALUE self)
         PieceTree *tree;
         VALUE2PIECETREE(iter->tree, tree);
 
-        off_t pos = iter->node->piece->size_left;
-
-        for (Node *p = iter->node; p != tree->root; p = p->parent)
-                if (is_right_child(p))
-                        pos += p->parent->piece->size_left +
-                                p->parent->piece->size;
-
-        return OFFT2NUM(pos);
+        return OFFT2NUM(iterator_pos(iter, tree));
 }
 
 
@@ -311,7 +414,7 @@ iterator_get_pos(VALUE self)
  * trees.
  *
  * This operation is O(lg _n_), as the position of both iterators in the tree
- * must be calculated (see #pos for details), so use it sparingly.
+ * must be calculated, unless they are already known (see #pos for details).
  *
  *      tree[12345678] <=> tree[0]
  *                              ⇒ 12345678
@@ -322,10 +425,8 @@ iterator_get_pos(VALUE self)
 static VALUE
 iterator_cmp(VALUE self, VALUE other)
 {
-        Iterator *a, *b;
-
-        VALUE2ITERATOR(self, a);
-        VALUE2ITERATOR(other, b);
+        Iterator *a = iterator_get(self);
+        Iterator *b = iterator_get(other);
 
         if (a->tree != b->tree)
                 rb_raise(rb_eArgError, "iterators must be from same tree");
@@ -338,42 +439,125 @@ iterator_cmp(VALUE self, VALUE other)
 it doesn’t hurt anyone to do it either. */
 
 
-/*¶ The next couple of functions are related to fixing up the structure of a
-red||black tree and the sizes of the nodes within it.  We begin with a simple
-function that calculates the total size of a (sub||)tree: */
+/*¶ Before we modify a node, we must make sure that it isn’t shared with a
+snapshot, see \insection[piecetree:snapshots].  If it is, we copy it, and as
+its parent must then be modified to point to the copy, we must first make sure
+that the parent isn’t shared either.  The copy shares the children of the
+original and takes its place in the tree, and the original is left to the
+snapshots that still refer to it: */
 
-static off_t
-calculate_size(Node const * const node)
+static Node *
+thaw(PieceTree *tree, Node *node)
+{
+        if (node == pt_null || node->generation == tree->generation)
+                return node;
+
+        Node *parent = (node->parent != NULL) ? thaw(tree, node->parent) : NULL;
+
+        if (node->refs == 1) {
+                node->generation = tree->generation;
+                return node;
+        }
+
+        Node *copy = node_new(tree->pool, node_ref(node->left),
+                              node_ref(node->right), parent, node->color,
+                              &node->piece, tree->generation);
+        node_copy_hash(copy, node);
+
+        if (copy->left != pt_null)
+                copy->left->parent = copy;
+        if (copy->right != pt_null)
+                copy->right->parent = copy;
+
+        if (parent == NULL)
+                tree->root = copy;
+        else if (parent->left == node)
+                parent->left = copy;
+        else
+                parent->right = copy;
+
+        node_unref(tree->pool, node->forward);
+        node->forward = node_ref(copy);
+        node_unref(tree->pool, node);
+
+        return copy;
+}
+
+/*¶ Once the parent has been taken care of, a node that nobody but its parent
+refers to can’t be part of a snapshot, e.g., because the snapshots that it was
+part of have since been garbage collected, so we can simply adopt it into our
+generation instead of copying it. */
+
+
+/*¶ Iterators that are about to modify the node that they point to must make
+sure that they point to a copy that they may modify: */
+
+static void
+iterator_thaw(Iterator *iter, PieceTree *tree)
 {
-        off_t size = 0;
+        Node *node = thaw(tree, iter->node);
+
+        if (node != iter->node)
+                iterator_set_node(iter, node);
+}
+
 
-        for (Node const *p = node; p != pt_null; p = p->right)
-                size += p->piece->size_left + p->piece->size;
+/*¶ The next couple of functions are related to fixing up the structure of a
+red||black tree and the sizes of the nodes within it.  We begin with a simple
+function that calculates the total size, and the total number of newlines,
+characters, and \ASCII\ characters, of a (sub||)tree: */
 
-        return size;
+static void
+calculate_size(Node const * const node, off_t *size, Measure *measure)
+{
+        *size = 0;
+        measure->lines = 0;
+        measure->chars = 0;
+        measure->ascii = 0;
+
+        for (Node const *p = node; p != pt_null; p = p->right) {
+                *size += p->piece.size_left + p->piece.size;
+                measure->lines += p->piece.lines_left + p->piece.lines;
+                measure->chars += p->piece.chars_left + p->piece.chars;
+                measure->ascii += p->piece.ascii_left + p->piece.ascii;
+        }
 }
 
 
 /*¶ Whenever we alter the size of a piece, all pieces in parent nodes to the
 node containing that piece will need their \C{size_left} field updated to agree
-with the new size.  This is a rather straightforward procedure, but still needs
-a bit of fiddling to get it right: */
+with the new size.  The same goes for their \C{lines_left}, \C{chars_left},
+and \C{ascii_left} fields and the number of newlines, characters, and \ASCII\
+characters in the piece.  The contents
+of the sub||trees of all of those nodes change as well, so they must let go of
+their hashes, see \insection[piecetree:hashing].  This is a rather
+straightforward procedure, but still needs a bit of fiddling to get it
+right: */
 
 static void
 fix_size(Node *node, Node *root)
 {
+        node_unhash(node);
         if (node == root)
                 return;
 
         off_t delta = 0;
+        Measure measure_delta = { 0, 0, 0 };
         if (node->parent->left == node->parent->right &&
-            node->parent->piece != NULL) {
+            node->parent != pt_null) {
                 node = node->parent;
-                delta = -node->piece->size_left;
-                node->piece->size_left = 0;
+                delta = -node->piece.size_left;
+                measure_delta.lines = -node->piece.lines_left;
+                measure_delta.chars = -node->piece.chars_left;
+                measure_delta.ascii = -node->piece.ascii_left;
+                node->piece.size_left = 0;
+                node->piece.lines_left = 0;
+                node->piece.chars_left = 0;
+                node->piece.ascii_left = 0;
         }
 
-        if (delta == 0) {
+        if (delta == 0 && measure_delta.lines == 0 &&
+            measure_delta.chars == 0 && measure_delta.ascii == 0) {
                 while (node != root && is_right_child(node))
                         node = node->parent;
 
@@ -381,14 +565,31 @@ fix_size(Node *node, Node *root)
                         return;
 
                 node = node->parent;
-                delta = calculate_size(node->left) - node->piece->size_left;
-                node->piece->size_left += delta;
+
+                off_t size;
+                Measure measure;
+                calculate_size(node->left, &size, &measure);
+                delta = size - node->piece.size_left;
+                measure_delta.lines = measure.lines - node->piece.lines_left;
+                measure_delta.chars = measure.chars - node->piece.chars_left;
+                measure_delta.ascii = measure.ascii - node->piece.ascii_left;
+                node->piece.size_left = size;
+                node->piece.lines_left = measure.lines;
+                node->piece.chars_left = measure.chars;
+                node->piece.ascii_left = measure.ascii;
         }
 
-        if (delta != 0)
+        if (delta != 0 || measure_delta.lines != 0 ||
+            measure_delta.chars != 0 || measure_delta.ascii != 0)
                 for ( ; node != root; node = node->parent)
-                        if (is_left_child(node))
-                                node->parent->piece->size_left += delta;
+                        if (is_left_child(node)) {
+                                Piece *p = &node->parent->piece;
+
+                                p->size_left += delta;
+                                p->lines_left += measure_delta.lines;
+                                p->chars_left += measure_delta.chars;
+                                p->ascii_left += measure_delta.ascii;
+                        }
 }
 
 
@@ -399,7 +600,9 @@ fix_size(Node *node, Node *root)
  *      iter.fix_size → self
  *
  * If the size of _iter_’s #piece has changed we must update the PieceTree that
- * it’s stored in.  Otherwise, the tree will be in an undefined state.
+ * it’s stored in.  Otherwise, the tree will be in an undefined state.  Note
+ * that the number of lines and characters of the piece aren’t updated, so
+ * prefer #resize when changing the extent of a piece.
  *
  * Raises a ScriptError if _iter_ isn't #valid?.
  *
@@ -413,7 +616,9 @@ iterator_fix_size(VALUE self)
         PieceTree *tree;
         VALUE2PIECETREE(iter->tree, tree);
 
+        iterator_thaw(iter, tree);
         fix_size(iter->node, tree->root);
+        tree->modifications++;
 
         return self;
 }
@@ -448,9 +653,14 @@ rotating a tree leftwards. */
 static void
 rotate_left(PieceTree *tree, Node *x)
 {
-        Node *y = x->right;
+        assert(x->generation == tree->generation);
 
-        y->piece->size_left += x->piece->size + x->piece->size_left;
+        Node *y = thaw(tree, x->right);
+
+        y->piece.size_left += x->piece.size + x->piece.size_left;
+        y->piece.lines_left += x->piece.lines + x->piece.lines_left;
+        y->piece.chars_left += x->piece.chars + x->piece.chars_left;
+        y->piece.ascii_left += x->piece.ascii + x->piece.ascii_left;
 
         x->right = y->left;
 
@@ -461,6 +671,7 @@ rotate_left(PieceTree *tree, Node *x)
 
         y->left = x;
         x->parent = y;
+        node_unhash(x);
 }
 
 /*¶ \infigure[figure:piecetree:rotate left]\ gives a graphical representation
@@ -503,9 +714,14 @@ rotating to the left.
 static void
 rotate_right(PieceTree *tree, Node *x)
 {
-        Node *y = x->left;
+        assert(x->generation == tree->generation);
+
+        Node *y = thaw(tree, x->left);
 
-        x->piece->size_left -= y->piece->size + y->piece->size_left;
+        x->piece.size_left -= y->piece.size + y->piece.size_left;
+        x->piece.lines_left -= y->piece.lines + y->piece.lines_left;
+        x->piece.chars_left -= y->piece.chars + y->piece.chars_left;
+        x->piece.ascii_left -= y->piece.ascii + y->piece.ascii_left;
         
         x->left = y->right;
 
@@ -516,9 +732,12 @@ rotate_right(PieceTree *tree, Node *x)
 
         y->right = x;
         x->parent = y;
+        node_unhash(x);
 }
 
-/*¶ The node $x$ is the node labeled $N_4$ in the figure. */
+/*¶ The node $x$ is the node labeled $N_4$ in the figure.  Note that, in both
+directions, $x$ must already be ours to modify, and that $y$ is made ours
+before we modify it. */
 
 /*¶ Now that we have our two rotating functions, we define the type of such
 functions so that we can use them as values in the next function. */
@@ -543,7 +762,7 @@ insert_fixup_node(PieceTree *tree, Node *x)
 
         if (y != NULL && y->color == RED) {
                 x->parent->color = BLACK;
-                y->color = BLACK;
+                thaw(tree, y)->color = BLACK;
                 x->parent->parent->color = RED;
                 x = x->parent->parent;
         } else {
@@ -573,7 +792,7 @@ insert_fixup(PieceTree *tree, Node *x)
         while (x != tree->root && x->parent->color == RED)
                 x = insert_fixup_node(tree, x);
 
-        tree->root->color = BLACK;
+        thaw(tree, tree->root)->color = BLACK;
 }
 
 
@@ -606,13 +825,72 @@ where_to_is_left(VALUE where)
 }
 
 
-/*¶ Now, then, here’s how we insert a new piece through an iterator: */
+/*¶ Now, then, here’s how we insert a new piece next to a node, returning the
+node that an iterator pointing to the given one should point to afterwards: */
+
+HIDDEN Node *
+tree_insert_piece(PieceTree *tree, Node *node, Piece const *piece, bool left)
+{
+        tree->size += piece->size;
+        tree->lines += piece->lines;
+        tree->chars += piece->chars;
+        tree->ascii += piece->ascii;
+        tree->modifications++;
+        tree->fragments++;
+
+        Node *new_node = node_new(tree->pool, pt_null, pt_null, NULL, RED,
+                                  piece, tree->generation);
+        new_node->piece.size_left = 0;
+        new_node->piece.lines_left = 0;
+        new_node->piece.chars_left = 0;
+        new_node->piece.ascii_left = 0;
+        Node **child = NULL;
+        if (node == NULL) {
+                node = tree->root = new_node;
+        } else if (left ? node->left == pt_null : node->right == pt_null) {
+                node = thaw(tree, node);
+                child = left ? &node->left : &node->right;
+        } else {
+                node = left ? node_prev(node) : node_next(node);
+                assert(node != NULL);
+                assert(left ? node->right == pt_null : node->left == pt_null);
+
+                node = thaw(tree, node);
+                child = left ? &node->right : &node->left;
+        }
+
+        if (child != NULL) {
+                *child = new_node;
+                new_node->parent = node;
+        }
+        node_unhash(new_node);
+
+        insert_fixup(tree, new_node); 
+
+        return node;
+}
+
+/*¶ If our tree is empty, the iterator will in fact be invalid.  This is fine,
+though, and we will set the root of the tree to point to the new node
+containing the given piece.  We also update the iterator to point to the new
+node so that it becomes valid.  Otherwise, we check if the iterator’s node’s
+left or right child (depending on where our user wants to enter the new piece)
+is empty.  If so, we’ll enter our new node there.  Otherwise, we find the 
+the iterator’s previous or next neighbor and will insert it there instead.
+Either way, the node that we link the new node into is made ours to modify
+first. */
+
+
+/*¶ The Ruby binding for inserting pieces must also count the newlines and
+characters of the piece that it is given, as this isn’t something that we
+trust our users to do for us: */
 
 /*
  * call-seq:
  *      iter.insert(piece, { :before, :after}) → self
  *
- * Insert _piece_ before or after the piece that _iter_ points to.
+ * Insert _piece_ before or after the piece that _iter_ points to.  The tree
+ * stores a copy of _piece_, so later changes to _piece_ won’t affect it.
  *
  * Raises a ScriptError if _iter_ isn't #valid? and the PieceTree into which it
  * points isn't empty.
@@ -623,11 +901,10 @@ where_to_is_left(VALUE where)
 static VALUE
 iterator_insert(VALUE self, VALUE rbpiece, VALUE where)
 {
-        Iterator *iter;
+        Iterator *iter = iterator_get(self);
         Piece *piece;
         PieceTree *tree;
 
-        VALUE2ITERATOR(self, iter);
         VALUE2PIECE(rbpiece, piece);
         VALUE2PIECETREE(iter->tree, tree);
 
@@ -636,44 +913,240 @@ iterator_insert(VALUE self, VALUE rbpiece, VALUE where)
 
         bool left = where_to_is_left(where);
 
-        piece->size_left = 0;
+        Piece copy = *piece;
+        Measure measure;
+        source_measure(tree, &copy, 0, copy.size, &measure);
+        copy.lines = measure.lines;
+        copy.chars = measure.chars;
+        copy.ascii = measure.ascii;
+
+        if (marks_any(tree->marks)) {
+                off_t at = 0;
+                if (tree->root != pt_null)
+                        at = iterator_pos(iter, tree) +
+                                (left ? 0 : iter->node->piece.size);
+                marks_replace(tree->marks, at, 0, copy.size);
+        }
 
-        tree->size += piece->size;
+        iterator_set_node(iter,
+                          tree_insert_piece(tree, iter->node, &copy, left));
 
-        Node *new_node = node_new(pt_null, pt_null, NULL, RED, piece);
-        Node *node = iter->node;
-        Node **child = NULL;
-        if (!iterator_is_valid(iter)) {
-                iter->node = tree->root = new_node;
-        } else if (left ? node->left == pt_null : node->right == pt_null) {
-                child = left ? &node->left : &node->right;
+        return self;
+}
+
+/*¶ Any marks after the new piece are moved along, see
+\insection[piecetree:marks].  Finding out where the piece goes takes
+$\Ordo{\lg n}$ time, unless the iterator already knows where it is, so we only
+do so if there are any marks to move. */
+
+
+/*¶ Pieces often need to be split in two, e.g., when an edit takes place in the
+middle of one of them.  This could be done by shrinking the piece and inserting
+a new one from the Ruby side, but then we would have to measure both halves.
+As we already know how many newlines, characters, and \ASCII\ characters the
+whole piece contains, it’s enough to measure the smaller half: */
+
+HIDDEN Node *
+tree_split_node(PieceTree *tree, Node *node, off_t offset)
+{
+        node = thaw(tree, node);
+
+        Piece *piece = &node->piece;
+        Piece right = *piece;
+        right.offset += offset;
+        right.size -= offset;
+        Measure measure;
+        if (offset < right.size) {
+                source_measure(tree, piece, 0, offset, &measure);
+                right.lines = piece->lines - measure.lines;
+                right.chars = piece->chars - measure.chars;
+                right.ascii = piece->ascii - measure.ascii;
         } else {
-                iter->node = left ? node_prev(node) : node_next(node);
-                assert(iterator_is_valid(iter));
+                source_measure(tree, piece, offset, right.size, &measure);
+                right.lines = measure.lines;
+                right.chars = measure.chars;
+                right.ascii = measure.ascii;
+        }
 
-                node = iter->node;
-                assert(left ? node->right == pt_null : node->left == pt_null);
+        piece->size = offset;
+        piece->lines -= right.lines;
+        piece->chars -= right.chars;
+        piece->ascii -= right.ascii;
+        tree->size -= right.size;
+        tree->lines -= right.lines;
+        tree->chars -= right.chars;
+        tree->ascii -= right.ascii;
+        fix_size(node, tree->root);
 
-                child = left ? &node->right : &node->left;
+        tree_insert_piece(tree, node, &right, false);
+        node_share_piece_hash(node_next(node), node);
+
+        return node;
+}
+
+/*¶ The splitting itself is done on nodes rather than iterators, as the
+piece||tree’s own editing methods need it as well, see \C{PieceTree#insert}.
+The same goes for resizing and deleting pieces below. */
+
+/*
+ * call-seq:
+ *      iter.split(offset) → self
+ *
+ * Split the piece that _iter_ points to in two, the first half containing the
+ * first _offset_ symbols of the piece and the second half containing the rest.
+ * The second half is inserted right after the first and _iter_ keeps pointing
+ * to the first.
+ *
+ * If _offset_ equals the size of the piece, the second half will be empty.
+ *
+ * Raises a RangeError unless 0 < _offset_ <= <tt>iter.piece.size</tt>.
+ *
+ *      iter.split(5)           ⇒ <PieceTree::Iterator:0xdeadbeef …>
+ */
+static VALUE
+iterator_split(VALUE self, VALUE rboffset)
+{
+        SETUP_VALID_ITERATOR(self, iter);
+
+        PieceTree *tree;
+        VALUE2PIECETREE(iter->tree, tree);
+
+        iterator_thaw(iter, tree);
+
+        off_t pos = iterator_pos(iter, tree);
+        off_t offset = NUM2OFFT(rboffset);
+        if (offset <= 0 || offset > iter->node->piece.size)
+                rb_raise(rb_eRangeError, "split offset %jd outside of piece",
+                         (intmax_t)offset);
+
+        tree_split_node(tree, iter->node, offset);
+        iterator_keep_pos(iter, tree, pos);
+
+        return self;
+}
+
+
+/*¶ Growing or shrinking a piece at either end is also quite common.  Again,
+we only have to measure the parts of the file that are added to or removed from
+the piece: */
+
+static void
+measure_span(PieceTree const *tree, PieceOrigin origin, off_t offset,
+             off_t len, int sign, Measure *measure)
+{
+        if (len <= 0)
+                return;
+
+        Piece span = { .origin = origin, .offset = offset, .size = len };
+        Measure m;
+        source_measure(tree, &span, 0, len, &m);
+
+        measure->lines += sign * m.lines;
+        measure->chars += sign * m.chars;
+        measure->ascii += sign * m.ascii;
+}
+
+
+HIDDEN Node *
+tree_resize_node(PieceTree *tree, Node *node, off_t offset, off_t size)
+{
+        node = thaw(tree, node);
+
+        Piece *piece = &node->piece;
+        off_t end = offset + size;
+        off_t old_end = piece->offset + piece->size;
+        Measure measure = { 0, 0, 0 };
+        if (end <= piece->offset || offset >= old_end) {
+                measure_span(tree, piece->origin, offset, size, 1, &measure);
+        } else {
+                measure.lines = piece->lines;
+                measure.chars = piece->chars;
+                measure.ascii = piece->ascii;
+                if (offset < piece->offset)
+                        measure_span(tree, piece->origin, offset,
+                                     piece->offset - offset, 1, &measure);
+                else
+                        measure_span(tree, piece->origin, piece->offset,
+                                     offset - piece->offset, -1, &measure);
+                if (end > old_end)
+                        measure_span(tree, piece->origin, old_end,
+                                     end - old_end, 1, &measure);
+                else
+                        measure_span(tree, piece->origin, end,
+                                     old_end - end, -1, &measure);
         }
 
-        if (child != NULL) {
-                *child = new_node;
-                new_node->parent = node;
+        tree->size += size - piece->size;
+        tree->lines += measure.lines - piece->lines;
+        tree->chars += measure.chars - piece->chars;
+        tree->ascii += measure.ascii - piece->ascii;
+        piece->offset = offset;
+        piece->size = size;
+        piece->lines = measure.lines;
+        piece->chars = measure.chars;
+        piece->ascii = measure.ascii;
+        fix_size(node, tree->root);
+        tree->modifications++;
+
+        return node;
+}
+
+
+/*
+ * call-seq:
+ *      iter.resize(offset, size) → self
+ *
+ * Change the piece that _iter_ points to so that it covers the _size_ symbols
+ * beginning at _offset_ in its file and update the PieceTree that it’s stored
+ * in accordingly.
+ *
+ * Raises a ScriptError if _iter_ isn't #valid?.
+ *
+ *      iter.resize(iter.piece.offset + 1, iter.piece.size - 1)
+ *                              ⇒ <PieceTree::Iterator:0xdeadbeef …>
+ */
+static VALUE
+iterator_resize(VALUE self, VALUE rboffset, VALUE rbsize)
+{
+        SETUP_VALID_ITERATOR(self, iter);
+
+        PieceTree *tree;
+        VALUE2PIECETREE(iter->tree, tree);
+
+        iterator_thaw(iter, tree);
+
+        off_t pos = iterator_pos(iter, tree);
+        Piece const *piece = &iter->node->piece;
+        off_t offset = NUM2OFFT(rboffset);
+        off_t size = NUM2OFFT(rbsize);
+        if (offset < 0 || size < 0)
+                rb_raise(rb_eArgError, "negative offset or size");
+
+        if (marks_any(tree->marks)) {
+                off_t end = offset + size;
+                off_t old_end = piece->offset + piece->size;
+                off_t start = (offset > piece->offset) ? offset : piece->offset;
+                off_t stop = (end < old_end) ? end : old_end;
+                if (start >= stop) {
+                        marks_replace(tree->marks, pos, piece->size, size);
+                } else {
+                        marks_replace(tree->marks, pos, start - piece->offset,
+                                      start - offset);
+                        marks_replace(tree->marks, pos + stop - offset,
+                                      old_end - stop, end - stop);
+                }
         }
 
-        insert_fixup(tree, new_node); 
+        tree_resize_node(tree, iter->node, offset, size);
+        iterator_keep_pos(iter, tree, pos);
 
         return self;
 }
 
-/*¶ If our tree is empty, the iterator will in fact be invalid.  This is fine,
-though, and we will set the root of the tree to point to the new node
-containing the given piece.  We also update the iterator to point to the new
-node so that it becomes valid.  Otherwise, we check if the iterator’s node’s
-left or right child (depending on where our user wants to enter the new piece)
-is empty.  If so, we’ll enter our new node there.  Otherwise, we find the 
-the iterator’s previous or next neighbor and will insert it there instead. */
+/*¶ If the new extent doesn’t overlap the old one, we simply measure the new
+one.  The marks within the piece see the same thing happen: if the extents
+overlap, what is added to or removed from either end of the piece is inserted
+or deleted there, and otherwise the whole piece is replaced. */
 
 
 /*¶ When deleting pieces from the piece tree, we must do more or less the same
@@ -689,13 +1162,13 @@ delete_fixup_node(PieceTree *tree, Node *x)
         RotateFunc rotate_parent = left ? rotate_left : rotate_right;
         RotateFunc rotate_y = left ? rotate_right : rotate_left;
 
-        Node *y = left ? x->parent->right : x->parent->left;
+        Node *y = thaw(tree, left ? x->parent->right : x->parent->left);
 
         if (y->color == RED) {
                 y->color = BLACK;
                 x->parent->color = RED;
                 rotate_parent(tree, x->parent);
-                y = left ? x->parent->right : x->parent->left;
+                y = thaw(tree, left ? x->parent->right : x->parent->left);
         }
 
         if (y->left->color == BLACK && y->right->color == BLACK) {
@@ -704,20 +1177,21 @@ delete_fixup_node(PieceTree *tree, Node *x)
         } else {
                 if ((left ? y->right->color : y->left->color) == BLACK) {
                         if (left)
-                                y->left->color = BLACK;
+                                thaw(tree, y->left)->color = BLACK;
                         else
-                                y->right->color = BLACK;
+                                thaw(tree, y->right)->color = BLACK;
                         y->color = RED;
                         rotate_y(tree, y);
-                        y = left ? x->parent->right : x->parent->left;
+                        y = thaw(tree, left ? x->parent->right :
+                                              x->parent->left);
                 }
 
                 y->color = x->parent->color;
                 x->parent->color = BLACK;
                 if (left)
-                        y->right->color = BLACK;
+                        thaw(tree, y->right)->color = BLACK;
                 else
-                        y->left->color = BLACK;
+                        thaw(tree, y->left)->color = BLACK;
                 rotate_parent(tree, x->parent);
                 x = tree->root;
         }
@@ -734,13 +1208,51 @@ delete_fixup(PieceTree *tree, Node *x)
         while (x != tree->root && x->color == BLACK)
                 x = delete_fixup_node(tree, x);
 
-        x->color = BLACK;
+        thaw(tree, x)->color = BLACK;
 }
 
 
 /*¶ Deleting the node itself is quite a complex procedure actually, and quite
 some code is needed to get it right: */
 
+HIDDEN void
+tree_delete_node(PieceTree *tree, Node *node)
+{
+        node = thaw(tree, node);
+
+        tree->modifications++;
+        tree->fragments++;
+        tree->size -= node->piece.size;
+        tree->lines -= node->piece.lines;
+        tree->chars -= node->piece.chars;
+        tree->ascii -= node->piece.ascii;
+
+        Node *y = (node->left == pt_null || node->right == pt_null)
+                ? node : thaw(tree, node_prev(node));
+        assert(y->left == pt_null || y->right == pt_null);
+
+        Node *son = (y->left != pt_null) ? y->left : y->right;
+        assert(son != NULL);
+
+        set_new_child(tree, y, son);
+
+        if (y != node) {
+                node->piece = y->piece;
+                fix_size(node, tree->root);
+        }
+
+        if (son->parent != NULL)
+                fix_size(son, tree->root);
+
+        if (y->color == BLACK)
+                delete_fixup(tree, son);
+
+        y->left = y->right = pt_null;
+        y->parent = NULL;
+        node_unref(tree->pool, y);
+}
+
+
 /*
  * call-seq:
  *      iter.delete → self
@@ -749,14 +1261,11 @@ some code is needed to get it right: */
  *
  *      iter.delete             ⇒ <PieceTree::Iterator:0xdeadbeef>
  */
-/* TODO: should we throw an error on invalid iterators?  Should this stuff be
- * reference counted? */
+/* TODO: should we throw an error on invalid iterators? */
 static VALUE
 iterator_delete(VALUE self)
 {
-        Iterator *iter;
-
-        VALUE2ITERATOR(self, iter);
+        Iterator *iter = iterator_get(self);
 
         if (!iterator_is_valid(iter))
                 return self;
@@ -764,34 +1273,21 @@ iterator_delete(VALUE self)
         PieceTree *tree;
         VALUE2PIECETREE(iter->tree, tree);
 
-        tree->size -= iter->node->piece->size;
+        iterator_thaw(iter, tree);
 
-        Node *y = (iter->node->left == pt_null || iter->node->right == pt_null)
-                ? iter->node : node_prev(iter->node);
-        assert(y->left == pt_null || y->right == pt_null);
+        if (marks_any(tree->marks))
+                marks_replace(tree->marks, iterator_pos(iter, tree),
+                              iter->node->piece.size, 0);
 
-        Node *son = (y->left != pt_null) ? y->left : y->right;
-        assert(son != NULL);
-
-        set_new_child(tree, y, son);
-
-        if (y != iter->node) {
-                free(iter->node->piece);
-                iter->node->piece = y->piece;
-                fix_size(iter->node, tree->root);
-        }
-
-        if (son->parent != NULL)
-                fix_size(son, tree->root);
-
-        if (y->color == BLACK)
-                delete_fixup(tree, son);
-
-        node_free(y, false);
+        tree_delete_node(tree, iter->node);
 
         return self;
 }
 
+/*¶ The node that is removed from the tree is detached from it before we let go
+of it, as any iterators that still point to it will keep it around.  Moving
+such an iterator will make it invalid. */
+
 
 /*¶ The last part of the iterator||related code is an inspect method and a
 function for setting up the iterator class.  There’s really nothing interesting to say
@@ -809,10 +1305,9 @@ about it actually, so let’s just leave it be: */
 static VALUE
 iterator_inspect(VALUE self)
 {
-        Iterator *iter;
+        Iterator *iter = iterator_get(self);
         PieceTree *tree;
 
-        VALUE2ITERATOR(self, iter);
         VALUE2PIECETREE(iter->tree, tree);
 
         char buf[INSPECT_BUFFER_SIZE];
@@ -823,7 +1318,7 @@ iterator_inspect(VALUE self)
                                "piece=%p pos=%jd>",
                                iter,
                                tree,
-                               iter->node->piece,
+                               &iter->node->piece,
                                (intmax_t)NUM2OFFT(iterator_get_pos(self)));
         } else {
                 len = snprintf(buf, INSPECT_BUFFER_SIZE,
@@ -871,6 +1366,8 @@ Init_Iterator(void)
         rb_define_method(g_cIterator, "<=>", iterator_cmp, 1);
         rb_define_method(g_cIterator, "fix_size", iterator_fix_size, 0);
         rb_define_method(g_cIterator, "insert", iterator_insert, 2);
+        rb_define_method(g_cIterator, "split", iterator_split, 1);
+        rb_define_method(g_cIterator, "resize", iterator_resize, 2);
         rb_define_method(g_cIterator, "delete", iterator_delete, 0);
         rb_define_method(g_cIterator, "inspect", iterator_inspect, 0);
 }
@@ -34,6 +34,11 @@ extern VALUE g_cIterator;
 
 void Init_Iterator(void);
 
-Iterator *iterator_new(VALUE tree, Node *node);
+Iterator *iterator_new(VALUE tree, Node *node, off_t pos);
 void iterator_mark(Iterator *iter);
 void iterator_free(Iterator *iter);
+Node *tree_insert_piece(PieceTree *tree, Node *node, Piece const *piece,
+                        bool left);
+Node *tree_split_node(PieceTree *tree, Node *node, off_t offset);
+Node *tree_resize_node(PieceTree *tree, Node *node, off_t offset, off_t size);
+void tree_delete_node(PieceTree *tree, Node *node);
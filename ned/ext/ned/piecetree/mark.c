@@ -0,0 +1,370 @@
+/*
+ * contents: PieceTree::Mark class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#include <ruby.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "private.h"
+
+
+#define MARK2VALUE(mark)                                        \
+        Data_Wrap_Struct(g_cMark, mark_mark, mark_free, (mark))
+
+#define VALUE2MARK(value, mark)         \
+        Data_Get_Struct((value), Mark, (mark))
+
+
+HIDDEN VALUE g_cMark;
+
+
+/*¶ A mark knows the tree that it belongs to, the table that it is kept in and
+where in it, its offset, and its gravity: */
+
+struct _Mark {
+        VALUE tree;
+        MarkTable *table;
+        size_t index;
+        off_t pos;
+        bool right;
+};
+
+
+/*¶ The table is simply an array of marks that is doubled in size whenever it
+fills up.  The order of the marks within it doesn’t matter, so a mark that
+goes away is replaced by the last one: */
+
+struct _MarkTable {
+        Mark **marks;
+        size_t n_marks;
+        size_t allocated;
+        unsigned int refs;
+};
+
+
+HIDDEN MarkTable *
+mark_table_new(void)
+{
+        MarkTable *table = ALLOC(MarkTable);
+
+        table->marks = NULL;
+        table->n_marks = 0;
+        table->allocated = 0;
+        table->refs = 1;
+
+        return table;
+}
+
+
+HIDDEN void
+mark_table_unref(MarkTable *table)
+{
+        if (table == NULL || --table->refs > 0)
+                return;
+
+        free(table->marks);
+        free(table);
+}
+
+
+HIDDEN bool
+marks_any(MarkTable const *table)
+{
+        return table != NULL && table->n_marks > 0;
+}
+
+/*¶ Snapshots have no table, as nothing is ever inserted into or deleted from
+them. */
+
+
+static void
+mark_mark(Mark *mark)
+{
+        rb_gc_mark(mark->tree);
+}
+
+
+static void
+mark_free(Mark *mark)
+{
+        MarkTable *table = mark->table;
+        Mark *last = table->marks[--table->n_marks];
+
+        table->marks[mark->index] = last;
+        last->index = mark->index;
+        mark_table_unref(table);
+        free(mark);
+}
+
+
+/*¶ The gravity of a mark is given as one of two symbols: */
+
+static ID s_id_left;
+static ID s_id_right;
+
+static bool
+gravity_is_right(VALUE gravity)
+{
+        if (!SYMBOL_P(gravity))
+                rb_raise(rb_eTypeError, "not a symbol");
+
+        ID id = SYM2ID(gravity);
+        if (id == s_id_left)
+                return false;
+        else if (id == s_id_right)
+                return true;
+        else
+                rb_raise(rb_eArgError, "unknown gravity");
+}
+
+
+/*¶ New marks are created by the tree, see \C{PieceTree#mark}, which makes
+sure that the offset is within it and that it isn’t a snapshot: */
+
+HIDDEN VALUE
+mark_new(VALUE tree, off_t pos, VALUE gravity)
+{
+        PieceTree *t;
+        VALUE2PIECETREE(tree, t);
+        assert(t->marks != NULL);
+
+        bool right = gravity_is_right(gravity);
+
+        MarkTable *table = t->marks;
+        if (table->n_marks == table->allocated) {
+                table->allocated = (table->allocated == 0) ?
+                        16 : 2 * table->allocated;
+                REALLOC_N(table->marks, Mark *, table->allocated);
+        }
+
+        Mark *mark = ALLOC(Mark);
+        mark->tree = tree;
+        mark->table = table;
+        mark->index = table->n_marks;
+        mark->pos = pos;
+        mark->right = right;
+
+        table->marks[table->n_marks++] = mark;
+        table->refs++;
+
+        return MARK2VALUE(mark);
+}
+
+
+/*¶ Everything that the tree does to its contents can be described in terms of
+replacing the symbols in a range by some number of new ones.  The symbols are
+deleted first, which moves the marks within the range to its beginning, and
+the new ones are then inserted at the beginning, which moves the marks after
+it, and those right at it that have right gravity, past them: */
+
+HIDDEN void
+marks_replace(MarkTable *table, off_t pos, off_t deleted, off_t added)
+{
+        if (table == NULL)
+                return;
+
+        for (size_t i = 0; i < table->n_marks; i++) {
+                Mark *mark = table->marks[i];
+
+                if (mark->pos >= pos + deleted)
+                        mark->pos -= deleted;
+                else if (mark->pos > pos)
+                        mark->pos = pos;
+
+                if (mark->pos > pos || (mark->pos == pos && mark->right))
+                        mark->pos += added;
+        }
+}
+
+/*¶ This takes time linear in the number of marks, which is fine, as there are
+usually only a handful of them. */
+
+
+/*¶ Some insertions are meant to push certain marks right at them along,
+whatever their gravity, e.g., text that is inserted before point, which should
+end up before all of it.  Once the insertion has moved the marks of the tree,
+those that were right at it and haven’t moved are moved past it: */
+
+HIDDEN void
+mark_push(VALUE self, VALUE tree, off_t pos, off_t added)
+{
+        Mark *mark;
+
+        VALUE2MARK(self, mark);
+
+        if (mark->tree == tree && mark->pos == pos)
+                mark->pos += added;
+}
+
+
+/*¶ Moving the symbols from \C{begin} up to \C{end} to \C{pos} moves the marks
+within them along with them.  The marks between the range and \C{pos} make
+room for them, and the marks right at \C{pos} end up on either side of them
+depending on their gravity: */
+
+HIDDEN void
+marks_move(MarkTable *table, off_t begin, off_t end, off_t pos)
+{
+        if (table == NULL)
+                return;
+
+        off_t len = end - begin;
+        for (size_t i = 0; i < table->n_marks; i++) {
+                Mark *mark = table->marks[i];
+                off_t p = mark->pos;
+
+                if (p >= begin && p < end)
+                        mark->pos += (pos < begin) ? pos - begin : pos - end;
+                else if (pos < begin && p < begin &&
+                         (p > pos || (p == pos && mark->right)))
+                        mark->pos += len;
+                else if (pos > end && p >= end &&
+                         (p < pos || (p == pos && !mark->right)))
+                        mark->pos -= len;
+        }
+}
+
+
+/*¶ Restoring a tree from a snapshot replaces all of its contents, so all we
+can do is make sure that its marks remain within it: */
+
+HIDDEN void
+marks_clamp(MarkTable *table, off_t size)
+{
+        if (table == NULL)
+                return;
+
+        for (size_t i = 0; i < table->n_marks; i++)
+                if (table->marks[i]->pos > size)
+                        table->marks[i]->pos = size;
+}
+
+
+/*¶ The Ruby interface lets our users read and set the offset of a mark: */
+
+/*
+ * call-seq:
+ *      mark.pos → bignum
+ *
+ * Returns the offset of _mark_ in the PieceTree to which it belongs.
+ *
+ *      tree.mark(10).pos       ⇒ 10
+ */
+static VALUE
+mark_get_pos(VALUE self)
+{
+        Mark *mark;
+
+        VALUE2MARK(self, mark);
+
+        return OFFT2NUM(mark->pos);
+}
+
+
+/*
+ * call-seq:
+ *      mark.pos = bignum
+ *
+ * Move _mark_ to offset _bignum_ in the PieceTree to which it belongs.
+ * Negative offsets are counted from the end of the tree.
+ *
+ * Raises a RangeError if _bignum_ is outside of the tree.
+ *
+ *      mark.pos = 20           ⇒ 20
+ */
+static VALUE
+mark_set_pos(VALUE self, VALUE rbpos)
+{
+        Mark *mark;
+        PieceTree *tree;
+
+        VALUE2MARK(self, mark);
+        VALUE2PIECETREE(mark->tree, tree);
+
+        off_t pos = NUM2OFFT(rbpos);
+        if (pos < 0)
+                pos += tree->size + 1;
+        if (pos < 0 || pos > tree->size)
+                rb_raise(rb_eRangeError, "position %jd beyond end of buffer",
+                         (intmax_t)NUM2OFFT(rbpos));
+        mark->pos = pos;
+
+        return rbpos;
+}
+
+
+/*
+ * call-seq:
+ *      mark.gravity → :left or :right
+ *
+ * Returns :right if something that is inserted right at _mark_ ends up before
+ * it, and :left if it ends up after it.
+ *
+ *      tree.mark(10).gravity   ⇒ :left
+ */
+static VALUE
+mark_gravity(VALUE self)
+{
+        Mark *mark;
+
+        VALUE2MARK(self, mark);
+
+        return ID2SYM(mark->right ? s_id_right : s_id_left);
+}
+
+
+/*
+ * call-seq:
+ *      mark.inspect → string
+ *
+ * Returns a textual representation of _mark_.  This method is generally called
+ * by the Kernel::p method and is used mainly for debugging purposes.
+ *
+ *      mark.inspect            ⇒ "#<PieceTree::Mark:0xdeadbeef pos=10 …>"
+ */
+static VALUE
+mark_inspect(VALUE self)
+{
+        Mark *mark;
+
+        VALUE2MARK(self, mark);
+
+        char buf[INSPECT_BUFFER_SIZE];
+        int len = snprintf(buf, INSPECT_BUFFER_SIZE,
+                           "#<PieceTree::Mark:%p pos=%jd gravity=%s>",
+                           mark, (intmax_t)mark->pos,
+                           mark->right ? "right" : "left");
+        return rb_str_new(buf, len);
+}
+
+
+/*
+ * Document-class: PieceTree::Mark
+ *
+ * A PieceTree::Mark is an offset in a PieceTree that follows along with the
+ * edits that are made to it.  Marks are created by PieceTree#mark.
+ */
+HIDDEN void
+Init_Mark(void)
+{
+        g_cMark = rb_define_class_under(g_cPieceTree, "Mark", rb_cData);
+        rb_undef_method(CLASS_OF(g_cMark), "new");
+
+        s_id_left = rb_intern("left");
+        s_id_right = rb_intern("right");
+
+        rb_define_method(g_cMark, "pos", mark_get_pos, 0);
+        rb_define_method(g_cMark, "pos=", mark_set_pos, 1);
+        rb_define_method(g_cMark, "gravity", mark_gravity, 0);
+        rb_define_method(g_cMark, "inspect", mark_inspect, 0);
+}
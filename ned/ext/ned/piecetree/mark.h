@@ -0,0 +1,44 @@
+/*
+ * contents: PieceTree::Mark class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:marks]{Marks.}
+
+An iterator points to a node, so the only way of keeping track of a position
+in the middle of a piece with one is to split the piece in two at that
+position.  Positions that come and go, such as point and the positions of
+addresses, would then leave a trail of pieces behind them that do nothing but
+make the tree deeper.  A mark instead remembers an offset in the sequence and
+is kept up to date by the tree whenever something is inserted or deleted
+before it, so it never splits a piece.  Something that is inserted right at a
+mark ends up after it, unless the mark has right gravity, in which case it
+ends up before it.  A mark within a range that is deleted ends up where the
+range began.
+
+The marks of a tree are kept in a table of their own.  A mark that is garbage
+collected removes itself from the table, but as the tree may be collected
+before its marks are, the table is reference counted, much like a node pool,
+and belongs to the tree and all its marks alike. */
+
+typedef struct _Mark Mark;
+typedef struct _MarkTable MarkTable;
+
+extern VALUE g_cMark;
+
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+MarkTable *mark_table_new(void);
+void mark_table_unref(MarkTable *table);
+bool marks_any(MarkTable const *table);
+void marks_replace(MarkTable *table, off_t pos, off_t deleted, off_t added);
+void marks_move(MarkTable *table, off_t begin, off_t end, off_t pos);
+void marks_clamp(MarkTable *table, off_t size);
+VALUE mark_new(VALUE tree, off_t pos, VALUE gravity);
+void mark_push(VALUE self, VALUE tree, off_t pos, off_t added);
+void Init_Mark(void);
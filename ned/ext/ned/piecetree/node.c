@@ -4,9 +4,15 @@
  * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
  */
 
+#ifndef _POSIX_C_SOURCE
+#  define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <ruby.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
 #include "piece.h"
@@ -15,47 +21,282 @@
 
 
 HIDDEN Node g_null_node = {
-        &g_null_node, &g_null_node, &g_null_node, BLACK, NULL
+        &g_null_node, &g_null_node, &g_null_node, NULL, BLACK, false, 0, 0,
+        { .origin = ORIGINAL }
+};
+
+
+/*¶ Nodes are allocated in blocks of the following number of bytes: */
+
+#define NODE_BLOCK_SIZE         (1 << 16)
+
+/*¶ With nodes taking up a couple of cache||lines at most, this gives us a few
+hundred nodes per block, and a block is a reasonable unit to ask the system
+for. */
+
+
+/*¶ As in the memory pools of our pattern||matcher, a node pool is a linked
+list of blocks, with a count of the nodes that are still unused in the
+top||most one.  Unlike those pools, however, nodes are also given back to the
+pool one at a time, so we keep a list of released nodes as well.  A released
+node isn’t part of any tree, so we can use its \C{left} field to link it into
+this list.
+
+Most trees are never hashed, see \insection[piecetree:hashing], so rather
+than making every node carry its hashes, each block keeps them for its nodes in
+an array of its own, which isn’t allocated until one of its nodes is first
+hashed.  Blocks are aligned to their size, so the block that a node belongs to,
+and thus its hashes, is found by clearing the lower bits of its address: */
+
+typedef struct _NodeBlock NodeBlock;
+
+#define NODE_POOL_BLOCK_NODES \
+        ((NODE_BLOCK_SIZE - 2 * sizeof(void *)) / sizeof(Node))
+
+struct _NodeBlock {
+        NodeBlock *next;
+        NodeHash *hashes;
+        Node nodes[NODE_POOL_BLOCK_NODES];
+};
+
+#define node_block(node) \
+        ((NodeBlock *)((uintptr_t)(node) & ~(uintptr_t)(NODE_BLOCK_SIZE - 1)))
+
+
+struct _NodePool {
+        NodeBlock *blocks;
+        size_t unused;
+        Node *released;
+        unsigned int refs;
 };
 
 
-/*¶ We need functions that create and destroy nodes for us: */
+/*¶ Creating a pool is simple enough, as we don’t allocate any blocks until we
+need them: */
+
+HIDDEN NodePool *
+node_pool_new(void)
+{
+        NodePool *pool = ALLOC(NodePool);
+
+        pool->blocks = NULL;
+        pool->unused = 0;
+        pool->released = NULL;
+        pool->refs = 1;
+
+        return pool;
+}
+
+
+/*¶ Letting go of the last reference to a pool releases all the nodes that
+have been allocated from it in one fell swoop, which is exactly what we want
+once a tree and everything that was derived from it is gone: */
+
+HIDDEN NodePool *
+node_pool_ref(NodePool *pool)
+{
+        pool->refs++;
+
+        return pool;
+}
+
+
+HIDDEN void
+node_pool_unref(NodePool *pool)
+{
+        if (--pool->refs > 0)
+                return;
+
+        for (NodeBlock *p = pool->blocks, *t; p != NULL; p = t) {
+                t = p->next;
+                free(p->hashes);
+                free(p);
+        }
+
+        free(pool);
+}
+
+
+/*¶ How many blocks a pool has asked the system for is interesting when
+measuring how much memory a tree uses, see
+\insection[piecetree:benchmarks], and so is how many of the nodes in them are
+waiting to be reused: */
+
+HIDDEN size_t
+node_pool_blocks(NodePool const *pool, size_t *block_size)
+{
+        size_t n = 0;
+
+        for (NodeBlock const *p = pool->blocks; p != NULL; p = p->next)
+                n++;
+
+        if (block_size != NULL)
+                *block_size = NODE_BLOCK_SIZE;
+
+        return n;
+}
+
+
+HIDDEN size_t
+node_pool_released(NodePool const *pool)
+{
+        size_t n = 0;
+
+        for (Node const *p = pool->released; p != NULL; p = p->left)
+                n++;
+
+        return n;
+}
+
+
+/*¶ We need functions that create and destroy nodes for us.  A new node is
+taken from the list of released nodes if possible and from the top||most block
+otherwise, allocating a new block if that one has run out: */
 
 HIDDEN Node *
-node_new(Node *left, Node *right, Node *parent, NodeColor color, Piece *piece)
+node_new(NodePool *pool, Node *left, Node *right, Node *parent,
+         NodeColor color, Piece const *piece, unsigned int generation)
 {
-        Node *node = ALLOC(Node);
+        Node *node;
+
+        if (pool->released != NULL) {
+                node = pool->released;
+                pool->released = node->left;
+        } else {
+                if (pool->unused == 0) {
+                        void *p;
+                        if (posix_memalign(&p, NODE_BLOCK_SIZE,
+                                           NODE_BLOCK_SIZE) != 0)
+                                rb_memerror();
+                        NodeBlock *block = p;
+                        block->next = pool->blocks;
+                        block->hashes = NULL;
+                        pool->blocks = block;
+                        pool->unused = NODE_POOL_BLOCK_NODES;
+                }
+
+                node = &pool->blocks->nodes[--pool->unused];
+        }
 
         node->left = left;
         node->right = right;
         node->parent = parent;
+        node->forward = NULL;
         node->color = color;
-        node->piece = piece;
+        node->hashed = false;
+        node->refs = 1;
+        node->generation = generation;
+        node->piece = *piece;
+        if (node_block(node)->hashes != NULL)
+                node_hash(node)->piece = (PieceHash){ ORIGINAL, 0, 0, 0 };
 
         return node;
 }
 
+/*¶ Note that the piece is copied into the node, so the caller remains the
+owner of the piece that it passes us.  The new node has one reference, which
+belongs to whatever the caller links the node into.  The caller is also
+responsible for the references to the children that it passes us. */
+
+
+/*¶ Nodes are never destroyed directly.  Instead, references to them are taken
+and released, and once the last reference to a node is released, the node
+releases its own references and is put on the list of released nodes: */
+
+HIDDEN Node *
+node_ref(Node *node)
+{
+        if (node != NULL && node != pt_null)
+                node->refs++;
+
+        return node;
+}
 
-/*¶ The \C{node_free} function is a bit more interesting.  We need to decide
-whether we want to free only this node, or this node and the piece it holds
-plus its children: */
 
 HIDDEN void
-node_free(Node *node, bool deep)
+node_unref(NodePool *pool, Node *node)
 {
-        if (node == pt_null)
+        if (node == NULL || node == pt_null || --node->refs > 0)
                 return;
 
-        if (deep) {
-                node_free(node->right, true);
-                node_free(node->left, true);
+        node_unref(pool, node->left);
+        node_unref(pool, node->right);
+        node_unref(pool, node->forward);
+
+        node->left = pool->released;
+        pool->released = node;
+}
+
+/*¶ The recursion only goes as deep as the tree is high, as the children of a
+node are shared rather than copied along with it. */
+
+
+/*¶ The hashes of a node, see \insection[piecetree:hashing], are kept by its
+block, which allocates room for the hashes of all of its nodes the first time
+that one of them asks for its own.  The hashes of the piece start out with an
+empty extent, whose hash is zero, and those of the sub||tree are only looked
+at once the \C{hashed} bit of the node says that they are valid: */
+
+HIDDEN NodeHash *
+node_hash(Node const *node)
+{
+        assert(node != pt_null);
 
-                free(node->piece);
+        NodeBlock *block = node_block(node);
+        if (block->hashes == NULL) {
+                block->hashes = ALLOC_N(NodeHash, NODE_POOL_BLOCK_NODES);
+                for (size_t i = 0; i < NODE_POOL_BLOCK_NODES; i++)
+                        block->hashes[i].piece =
+                                (PieceHash){ ORIGINAL, 0, 0, 0 };
         }
 
-        free(node);
+        return &block->hashes[node - block->nodes];
+}
+
+
+/*¶ The hashes that a node caches describe the contents of its sub||tree, so a
+copy of a node, which shares its children, may keep them until it is
+modified.  A node that is modified, on the other hand, must let go of its
+hash, as must all of the nodes above it, as their sub||trees contain it.  The
+hash of the piece itself is keyed by the piece’s extent, so it takes care of
+itself.  A node whose block has never been hashed has nothing to hand over: */
+
+HIDDEN void
+node_copy_hash(Node *copy, Node const *node)
+{
+        copy->hashed = node->hashed;
+        if (node_block(node)->hashes != NULL)
+                *node_hash(copy) = *node_hash(node);
+}
+
+
+/*¶ A node whose piece has been split off of the piece of another node may
+derive the hash of its piece from that of the other one, see
+\C{hash_derive}, so we let it have a copy: */
+
+HIDDEN void
+node_share_piece_hash(Node *node, Node const *other)
+{
+        if (node_block(other)->hashes != NULL)
+                node_hash(node)->piece = node_hash(other)->piece;
+}
+
+
+HIDDEN void
+node_unhash(Node *node)
+{
+        if (node == pt_null)
+                node = node->parent;
+        for ( ; node != NULL && node != pt_null; node = node->parent)
+                node->hashed = false;
 }
 
+/*¶ We can’t stop at the first node that has already let go of its hash, as a
+node that has been copied, see \C{thaw}, may have let go of it while its
+parent still holds on to one.  The parent of the null node is set up
+temporarily when a node is removed from the tree, so that we may start from
+it as well. */
+
 
 /*¶ The final two functions that operate directly on nodes figure out what node
 is right before or right after a given node in the tree. */
@@ -116,3 +357,111 @@ node_next(Node *node)
                 return NULL;
         }
 }
+
+
+/*¶ Walking a snapshot can’t make use of parent pointers, so we keep the path
+from the root to the current node around instead.  The next node is then found
+much as above, except that going up the tree is a matter of popping nodes off
+the path: */
+
+HIDDEN Node *
+node_path_next(NodePath *path)
+{
+        assert(path->depth > 0);
+
+        Node *node = path->nodes[path->depth - 1];
+
+        if (node->right != pt_null) {
+                for (node = node->right; node != pt_null; node = node->left) {
+                        assert(path->depth < (int)NODE_PATH_MAX);
+                        path->nodes[path->depth++] = node;
+                }
+        } else {
+                while (--path->depth > 0 &&
+                       path->nodes[path->depth - 1]->right == node)
+                        node = path->nodes[path->depth - 1];
+        }
+
+        return (path->depth > 0) ? path->nodes[path->depth - 1] : NULL;
+}
+
+
+/*¶ Walking the whole tree along a path begins at its left||most node: */
+
+HIDDEN Node *
+node_path_first(NodePath *path, Node *root)
+{
+        path->depth = 0;
+        for (Node *node = root; node != pt_null; node = node->left) {
+                assert(path->depth < (int)NODE_PATH_MAX);
+                path->nodes[path->depth++] = node;
+        }
+
+        return (path->depth > 0) ? path->nodes[path->depth - 1] : NULL;
+}
+
+
+/*¶ Sometimes we have a whole sequence of pieces that we want to turn into a
+tree.  Inserting them one at a time would take $\Ordo{n \lg n}$ time and
+rebalance the tree over and over again.  Instead, we make the middle piece the
+root and build its sub||trees out of the pieces on either side of it in the
+same manner, which takes linear time.  The sizes of the two sub||trees of a
+node then never differ by more than one, so every level of the tree is full,
+except perhaps the deepest one.  Coloring the nodes on that level red and all
+the others black thus gives us a valid red||black tree.  While we’re at it, we
+sum up the sizes, newlines, characters, and \ASCII\ characters of each
+sub||tree, so that we can fill in the \C{size_left}, \C{lines_left},
+\C{chars_left}, and \C{ascii_left} fields of its root: */
+
+static Node *
+build(NodePool *pool, Piece const *pieces, size_t n, int depth, int red,
+      unsigned int generation, Piece *sum)
+{
+        sum->size = sum->lines = sum->chars = sum->ascii = 0;
+        if (n == 0)
+                return pt_null;
+
+        size_t mid = n / 2;
+        Piece left, right;
+        Node *l = build(pool, pieces, mid, depth + 1, red, generation, &left);
+        Node *r = build(pool, pieces + mid + 1, n - mid - 1, depth + 1, red,
+                        generation, &right);
+
+        Node *node = node_new(pool, l, r, NULL, (depth == red) ? RED : BLACK,
+                              &pieces[mid], generation);
+        node->piece.size_left = left.size;
+        node->piece.lines_left = left.lines;
+        node->piece.chars_left = left.chars;
+        node->piece.ascii_left = left.ascii;
+        if (l != pt_null)
+                l->parent = node;
+        if (r != pt_null)
+                r->parent = node;
+
+        sum->size = left.size + node->piece.size + right.size;
+        sum->lines = left.lines + node->piece.lines + right.lines;
+        sum->chars = left.chars + node->piece.chars + right.chars;
+        sum->ascii = left.ascii + node->piece.ascii + right.ascii;
+
+        return node;
+}
+
+
+HIDDEN Node *
+node_build(NodePool *pool, Piece const *pieces, size_t n,
+           unsigned int generation, Piece *sum)
+{
+        int red = 0;
+        for (size_t m = n + 1; m > 1; m >>= 1)
+                red++;
+
+        return build(pool, pieces, n, 0, red, generation, sum);
+}
+
+/*¶ A tree of $n$ nodes built this way has $\lfloor\lg(n + 1)\rfloor$ full
+levels, so that’s the depth of the red ones.  If $n + 1$ is a power of two,
+there are no nodes at that depth and the tree is all black.  The \C{lines},
+\C{chars}, \C{ascii}, and \C{size} fields of the pieces must be correct, as
+we have no way of reading their contents, but their left||fields are ignored.
+The root of the new tree has no parent, and \C{sum} receives the totals of the
+whole tree. */
@@ -12,10 +12,15 @@ Now that we have our pieces, let’s define the nodes of the red||black trees
 that will house them. */
 
 /*¶ A red||black tree node in our piece||tree will have a left, right, and
-parent node, a color (red or black), and a piece associated with it.  The left
-and right nodes are the children of the node and may point to a special “null”
-value.  The parent is the node that this node is a child of, or \C{NULL} if
-this node is the root of the tree.  The rest of the fields should be obvious. */
+parent node, a color (red or black), and the piece associated with it.  The
+left and right nodes are the children of the node and may point to a special
+“null” value.  The parent is the node that this node is a child of, or
+\C{NULL} if this node is the root of the tree.  The piece is stored directly
+in the node, so that walking down the tree doesn’t have to follow yet another
+pointer to get at the \C{size_left} field of every node that it passes.  The
+\C{forward}, \C{refs}, and \C{generation} fields will be explained in
+\insection[piecetree:snapshots], and the \C{hashed} bit in
+\insection[piecetree:hashing]. */
 
 typedef enum {
         BLACK,
@@ -23,14 +28,42 @@ typedef enum {
 } NodeColor;
 
 
+typedef struct _Hash Hash;
+
+struct _Hash {
+        uint64_t value;
+        uint64_t scale;
+};
+
+typedef struct _PieceHash PieceHash;
+
+struct _PieceHash {
+        PieceOrigin origin;
+        off_t offset;
+        off_t size;
+        uint64_t value;
+};
+
+typedef struct _NodeHash NodeHash;
+
+struct _NodeHash {
+        Hash subtree;
+        PieceHash piece;
+};
+
+
 typedef struct _Node Node;
 
 struct _Node {
         Node *left;
         Node *right;
         Node *parent;
+        Node *forward;
         unsigned int color : 1;
-        Piece *piece;
+        unsigned int hashed : 1;
+        unsigned int refs : 30;
+        unsigned int generation;
+        Piece piece;
 };
 
 
@@ -41,10 +74,73 @@ sentinel for our data structure: */
 extern Node g_null_node;
 #define pt_null (&g_null_node)
 
+/*¶ A piece||tree of a heavily edited buffer will contain a lot of nodes, and
+nodes are created and destroyed all the time.  Rather than going to
+\C{malloc} for every single one of them, each tree allocates its nodes from a
+pool of its own.  The pool hands out nodes from large blocks and keeps a list
+of nodes that have been released, so that they may be reused: */
+
+typedef struct _NodePool NodePool;
+
+/*¶ As the nodes of a tree may be shared with its snapshots, and snapshots may
+outlive the tree that they were taken of, a pool is reference counted and only
+goes away once the tree and all its snapshots and iterators have let go of
+it. */
+
+
+/*¶ \subsection[piecetree:snapshots]{Snapshots.}
+
+A snapshot of a piece||tree is an immutable copy of it, taken in $\Ordo{1}$
+time by letting the snapshot share the root of the tree.  To keep the snapshot
+intact, the tree must then copy any node that it wants to modify, and as the
+parent of a copied node must be modified to point to the copy, the whole path
+from the root down to the node is copied.  This is $\Ordo{\lg n}$ extra work
+per edit, which is paid only while there are snapshots around.
+
+Every tree has a \C{generation} that is incremented whenever a snapshot is
+taken, and every node remembers the generation that it was created in.  A node
+from an earlier generation may be shared, so it is copied before it is
+modified.  Nodes are reference counted: each parent, root, iterator, and
+forward pointer that points to a node counts as a reference.  A node that has
+been copied points \C{forward} to its copy, so that iterators that still point
+to the original may find their way back into the tree.
+
+Snapshots never look at the \C{parent} or \C{forward} fields of their nodes,
+as these always describe the node’s place in the tree that is being edited.
+Instead, when walking a snapshot, we keep the path from its root in a
+\C{NodePath}: */
+
+#define NODE_PATH_MAX   (2 * 8 * sizeof(off_t))
+
+typedef struct _NodePath NodePath;
+
+struct _NodePath {
+        int depth;
+        Node *nodes[NODE_PATH_MAX];
+};
+
+/*¶ A red||black tree of $n$ nodes is never more than $2\lg(n + 1)$ levels
+deep, so this is more than enough. */
+
 /*¶ ————————————————————————————————— EOD —————————————————————————————————— */
 
 
-Node *node_new(Node *left, Node *right, Node *parent, NodeColor color, Piece *piece);
-void node_free(Node *node, bool deep);
+NodePool *node_pool_new(void);
+NodePool *node_pool_ref(NodePool *pool);
+void node_pool_unref(NodePool *pool);
+size_t node_pool_blocks(NodePool const *pool, size_t *block_size);
+size_t node_pool_released(NodePool const *pool);
+Node *node_new(NodePool *pool, Node *left, Node *right, Node *parent,
+               NodeColor color, Piece const *piece, unsigned int generation);
+Node *node_ref(Node *node);
+void node_unref(NodePool *pool, Node *node);
 Node *node_prev(Node *node);
 Node *node_next(Node *node);
+Node *node_path_next(NodePath *path);
+Node *node_path_first(NodePath *path, Node *root);
+Node *node_build(NodePool *pool, Piece const *pieces, size_t n,
+                 unsigned int generation, Piece *sum);
+NodeHash *node_hash(Node const *node);
+void node_copy_hash(Node *copy, Node const *node);
+void node_share_piece_hash(Node *node, Node const *other);
+void node_unhash(Node *node);
@@ -0,0 +1,483 @@
+/*
+ * contents: PieceTree::Original class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#include <ruby.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "source.h"
+#include "original.h"
+#include "private.h"
+
+
+#define ORIGINAL2VALUE(original)                                        \
+        Data_Wrap_Struct(g_cOriginal, original_mark, original_free,     \
+                         (original))
+
+
+HIDDEN VALUE g_cOriginal;
+
+
+/*¶ An original file knows the IO object that it reads from, how large it
+is, and where it has been mapped, if it has.  If it hasn’t, the last block
+that we read from the IO object is kept around, along with the offset at which
+it begins, as reads tend to come in runs within the same part of the file: */
+
+struct _Original {
+        VALUE io;
+        off_t size;
+        char *map;
+        VALUE block;
+        off_t block_offset;
+};
+
+
+static void
+original_mark(Original *original)
+{
+        rb_gc_mark(original->io);
+        rb_gc_mark(original->block);
+}
+
+
+static void
+original_free(Original *original)
+{
+#ifdef HAVE_SYS_MMAN_H
+        if (original->map != NULL)
+                munmap(original->map, (size_t)original->size);
+#endif
+        free(original);
+}
+
+
+static VALUE
+original_s_allocate(UNUSED(VALUE class))
+{
+        Original *original = ALLOC(Original);
+
+        original->io = Qnil;
+        original->size = 0;
+        original->map = NULL;
+        original->block = Qnil;
+        original->block_offset = 0;
+
+        return ORIGINAL2VALUE(original);
+}
+
+
+/*¶ The size of the file is found by seeking to its end, which works for
+anything that acts like an IO object: */
+
+static off_t
+io_size(VALUE io)
+{
+        static ID id_seek = 0;
+        static ID id_pos = 0;
+
+        if (id_seek == 0)
+                id_seek = rb_intern("seek");
+        if (id_pos == 0)
+                id_pos = rb_intern("pos");
+
+        rb_funcall(io, id_seek, 2, INT2FIX(0), INT2FIX(SEEK_END));
+
+        return NUM2OFFT(rb_funcall(io, id_pos, 0));
+}
+
+
+/*¶ Some things can only be done to regular files, so we need a way to find
+the file descriptor of an IO object that is open on one.  Anything else, e.g.,
+a closed IO object or a StringIO, has none: */
+
+static int
+regular_fd(VALUE io)
+{
+        static ID id_fileno = 0;
+        static ID id_closed_p = 0;
+
+        if (id_fileno == 0)
+                id_fileno = rb_intern("fileno");
+        if (id_closed_p == 0)
+                id_closed_p = rb_intern("closed?");
+
+        if (!rb_respond_to(io, id_fileno) ||
+            (rb_respond_to(io, id_closed_p) &&
+             RTEST(rb_funcall(io, id_closed_p, 0))))
+                return -1;
+
+        VALUE rbfd = rb_funcall(io, id_fileno, 0);
+        if (NIL_P(rbfd))
+                return -1;
+
+        int fd = NUM2INT(rbfd);
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+                return -1;
+
+        return fd;
+}
+
+
+/*¶ Only regular files can be mapped, and only if they fit in our address
+space.  An empty file can’t be mapped either, but then there’s nothing to read
+from it anyway: */
+
+static char *
+map_io(VALUE io, off_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+        if (size == 0 || (off_t)(size_t)size != size)
+                return NULL;
+
+        int fd = regular_fd(io);
+        if (fd == -1)
+                return NULL;
+
+        void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        return (map != MAP_FAILED) ? map : NULL;
+#else
+        return NULL;
+#endif
+}
+
+/*¶ If the mapping fails for any reason, we simply fall back to reading
+blocks.  Note that the file mustn’t be truncated by someone else while it’s
+mapped, as touching the part of the mapping that no longer has a file behind
+it kills the editor.  That’s a risk that every editor that maps its files
+takes, and one that we’ll have to deal with once we watch the files that we
+edit for changes. */
+
+
+/*
+ * call-seq:
+ *      PieceTree::Original.new(io) → original
+ *
+ * Create a new PieceTree::Original that reads from _io_.  If _io_ is a
+ * regular file, it is mapped into memory.  Otherwise, it is read from in
+ * blocks, using <tt>io.pread</tt>, if _io_ has it, or <tt>io.seek</tt> and
+ * <tt>io.read</tt>.
+ *
+ *      PieceTree::Original.new(File.open('README'))
+ *                              ⇒ <PieceTree::Original:0xdeadbeef …>
+ */
+static VALUE
+original_initialize(VALUE self, VALUE io)
+{
+        Original *original;
+
+        VALUE2ORIGINAL(self, original);
+
+        original->io = io;
+        original->size = io_size(io);
+        original->map = map_io(io, original->size);
+
+        return self;
+}
+
+
+/*¶ Reading a block through Ruby is done the same way as it was done before we
+had mappings, with a seek followed by a read.  Another thread may be reading
+the same file at the same time, however, e.g., while searching a snapshot of
+the tree, see \insection[piecetree:snapshots], and if it gets to seek in
+between the two, we read the wrong block.  If the IO object can read at a
+given offset by itself, we thus let it do so, and otherwise we keep other
+threads from running until we’re done: */
+
+typedef struct _BlockRead BlockRead;
+
+struct _BlockRead {
+        VALUE io;
+        off_t offset;
+};
+
+
+static VALUE
+seek_and_read(VALUE arg)
+{
+        static ID id_seek = 0;
+        static ID id_read = 0;
+        BlockRead *read = (BlockRead *)arg;
+
+        if (id_seek == 0)
+                id_seek = rb_intern("seek");
+        if (id_read == 0)
+                id_read = rb_intern("read");
+
+        rb_funcall(read->io, id_seek, 1, OFFT2NUM(read->offset));
+
+        return rb_funcall(read->io, id_read, 1, INT2FIX(SOURCE_BLOCK_SIZE));
+}
+
+
+#ifdef HAVE_RB_THREAD_CRITICAL
+static VALUE
+restore_critical(VALUE critical)
+{
+        rb_thread_critical = (int)critical;
+
+        return Qnil;
+}
+#endif
+
+
+static VALUE
+read_block(Original *original, off_t offset)
+{
+        static ID id_pread = 0;
+
+        if (id_pread == 0)
+                id_pread = rb_intern("pread");
+
+        VALUE block;
+        if (rb_respond_to(original->io, id_pread)) {
+                block = rb_funcall(original->io, id_pread, 2,
+                                   INT2FIX(SOURCE_BLOCK_SIZE),
+                                   OFFT2NUM(offset));
+        } else {
+                BlockRead read = { original->io, offset };
+#ifdef HAVE_RB_THREAD_CRITICAL
+                VALUE critical = (VALUE)rb_thread_critical;
+                rb_thread_critical = 1;
+                block = rb_ensure(seek_and_read, (VALUE)&read,
+                                  restore_critical, critical);
+#else
+                block = seek_and_read((VALUE)&read);
+#endif
+        }
+        if (NIL_P(block))
+                rb_raise(rb_eIndexError,
+                         "piece extends beyond end of original file");
+        StringValue(block);
+
+        original->block = block;
+        original->block_offset = offset;
+
+        return block;
+}
+
+
+/*¶ Now, reading the contents of the original file is a matter of handing out
+a pointer into the mapping, if we have one, or going through the blocks that
+the span falls within otherwise.  Blocks begin at multiples of their size, so
+that spans that are close to each other end up using the same block: */
+
+HIDDEN void
+original_read(Original *original, off_t offset, off_t len, SourceFunc func,
+              void *closure)
+{
+        if (offset < 0 || len < 0 || offset + len > original->size)
+                rb_raise(rb_eIndexError,
+                         "piece extends beyond end of original file");
+
+        if (original->map != NULL) {
+                func(original->map + offset, len, closure);
+                return;
+        }
+
+        while (len > 0) {
+                off_t base = offset - offset % SOURCE_BLOCK_SIZE;
+                VALUE block = original->block;
+                if (NIL_P(block) || original->block_offset != base)
+                        block = read_block(original, base);
+
+                off_t skip = offset - base;
+                off_t n = RSTRING(block)->len - skip;
+                if (n <= 0)
+                        rb_raise(rb_eIndexError,
+                                 "piece extends beyond end of original file");
+                if (n > len)
+                        n = len;
+
+                if (!func(RSTRING(block)->ptr + skip, n, closure))
+                        return;
+
+                offset += n;
+                len -= n;
+        }
+}
+
+/*¶ A mapping is handed out all at once, however long the span is.  There’s no
+reason to split it up, as it’s all there already, and the functions that we
+hand it to don’t care. */
+
+
+/*¶ Writing a tree to a file, see \insection[piecetree:writing], wants to know
+a bit more about the original file, as it can let the kernel copy spans of it
+straight from its file descriptor, and as spans of a mapping stay put, unlike
+the blocks that we read through Ruby: */
+
+HIDDEN off_t
+original_size(Original const *original)
+{
+        return original->size;
+}
+
+
+HIDDEN bool
+original_mapped(Original const *original)
+{
+        return original->map != NULL;
+}
+
+
+HIDDEN int
+original_fd(Original const *original)
+{
+        return regular_fd(original->io);
+}
+
+
+/*¶ We also provide the interface that the piece||tree used to require of
+original files, so that the buffer may extract parts of the file itself: */
+
+static bool
+append_block(char const *p, size_t len, void *closure)
+{
+        rb_str_cat(*(VALUE *)closure, p, len);
+
+        return true;
+}
+
+
+/*
+ * call-seq:
+ *      original[pos, len = 1] → string
+ *
+ * Returns the _len_ bytes beginning at offset _pos_ of _original_.  If _len_
+ * reaches beyond the end of _original_, the String will be shorter than
+ * _len_.
+ *
+ * Raises an IndexError if _pos_ is outside of _original_.
+ *
+ *      original[0, 5]          ⇒ "abcde"
+ */
+static VALUE
+original_aref(int argc, VALUE *argv, VALUE self)
+{
+        Original *original;
+        VALUE rbpos, rblen;
+
+        VALUE2ORIGINAL(self, original);
+
+        off_t len = 1;
+        if (rb_scan_args(argc, argv, "11", &rbpos, &rblen) == 2)
+                len = NUM2OFFT(rblen);
+
+        off_t pos = NUM2OFFT(rbpos);
+        if (pos < 0 || pos > original->size)
+                rb_raise(rb_eIndexError, "offset %jd outside of original file",
+                         (intmax_t)pos);
+        if (len < 0)
+                rb_raise(rb_eArgError, "negative length %jd", (intmax_t)len);
+        if (len > original->size - pos)
+                len = original->size - pos;
+
+        if (original->map != NULL)
+                return rb_str_new(original->map + pos, len);
+
+        VALUE ret = rb_str_buf_new(len);
+        original_read(original, pos, len, append_block, &ret);
+
+        return ret;
+}
+
+
+/*
+ * call-seq:
+ *      original.size → bignum
+ *
+ * Returns the size of _original_ in bytes.
+ *
+ *      original.size           ⇒ 12345678
+ */
+static VALUE
+original_get_size(VALUE self)
+{
+        Original *original;
+
+        VALUE2ORIGINAL(self, original);
+
+        return OFFT2NUM(original->size);
+}
+
+
+/*
+ * call-seq:
+ *      original.mapped? → bool
+ *
+ * Returns +true+ if _original_ has been mapped into memory.
+ *
+ *      original.mapped?        ⇒ true
+ */
+static VALUE
+original_mapped_p(VALUE self)
+{
+        Original *original;
+
+        VALUE2ORIGINAL(self, original);
+
+        return BOOL2VALUE(original->map != NULL);
+}
+
+
+/*
+ * call-seq:
+ *      original.inspect → string
+ *
+ * Returns a textual representation of _original_.  This method is generally
+ * called by the Kernel::p method and is used mainly for debugging purposes.
+ *
+ *      original.inspect        ⇒ "<PieceTree::Original:0xdeadbeef …>"
+ */
+static VALUE
+original_inspect(VALUE self)
+{
+        Original *original;
+
+        VALUE2ORIGINAL(self, original);
+
+        char buf[INSPECT_BUFFER_SIZE];
+        int len = snprintf(buf, INSPECT_BUFFER_SIZE,
+                           "#<PieceTree::Original:%p size=%jd mapped=%s>",
+                           original,
+                           (intmax_t)original->size,
+                           (original->map != NULL) ? "true" : "false");
+        return rb_str_new(buf, len);
+}
+
+
+/*
+ * Document-class: PieceTree::Original
+ *
+ * A PieceTree::Original is the original file of a PieceTree, i.e., the file
+ * that its :original pieces point into.
+ */
+void HIDDEN
+Init_Original(void)
+{
+        g_cOriginal = rb_define_class_under(g_cPieceTree, "Original", rb_cData);
+        rb_define_alloc_func(g_cOriginal, original_s_allocate);
+        rb_define_private_method(g_cOriginal, "initialize",
+                                 original_initialize, 1);
+
+        rb_define_method(g_cOriginal, "[]", original_aref, -1);
+        rb_define_method(g_cOriginal, "size", original_get_size, 0);
+        rb_define_method(g_cOriginal, "mapped?", original_mapped_p, 0);
+        rb_define_method(g_cOriginal, "inspect", original_inspect, 0);
+}
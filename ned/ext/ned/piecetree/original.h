@@ -0,0 +1,36 @@
+/*
+ * contents: PieceTree::Original class.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:original]{Reading the original file.}
+
+The original file of a buffer may be very large and is read in no particular
+order, as the user jumps from one part of it to another.  Rather than reading
+it through Ruby and keeping a cache of its contents around, we let the
+operating system do the caching for us by mapping the file into memory.  The
+contents of a piece are then simply a pointer into the mapping and a length,
+and reading them costs nothing beyond what it takes to page them in.  Not
+everything can be mapped, e.g., pipes and StringIO objects, so for those we
+fall back to reading blocks through Ruby. */
+
+typedef struct _Original Original;
+
+extern VALUE g_cOriginal;
+
+#define VALUE2ORIGINAL(value, original) \
+        Data_Get_Struct((value), Original, (original))
+
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+void original_read(Original *original, off_t offset, off_t len,
+                   SourceFunc func, void *closure);
+off_t original_size(Original const *original);
+bool original_mapped(Original const *original);
+int original_fd(Original const *original);
+void Init_Original(void);
@@ -24,13 +24,20 @@ static ID s_id_added;
 HIDDEN VALUE g_cPiece;
 
 
-static PieceOrigin
-symbol_to_origin(VALUE symbol)
+HIDDEN PieceOrigin
+piece_value_to_origin(VALUE value)
 {
-        if (!SYMBOL_P(symbol))
-                rb_raise(rb_eTypeError, "not a symbol");
+        if (FIXNUM_P(value)) {
+                long index = FIX2LONG(value);
+                if (index < 0)
+                        rb_raise(rb_eArgError, "negative source index");
+                return (PieceOrigin)index;
+        }
+
+        if (!SYMBOL_P(value))
+                rb_raise(rb_eTypeError, "not a symbol or an integer");
 
-        ID id = SYM2ID(symbol);
+        ID id = SYM2ID(value);
         if (id == s_id_original)
                 return ORIGINAL;
         else if (id == s_id_added)
@@ -39,20 +46,20 @@ symbol_to_origin(VALUE symbol)
                 rb_raise(rb_eArgError, "unknown symbol");
 }
 
-/*¶ This function turns a symbol into a piece||origin as appropriate; the next
-does the exact opposite: */
+/*¶ This function turns a symbol, or the index of a source, into a
+piece||origin as appropriate; the next does the exact opposite.  They’re also
+used by the piece||tree, so they aren’t static: */
 
-static VALUE
-origin_to_id(PieceOrigin origin)
+HIDDEN VALUE
+piece_origin_to_value(PieceOrigin origin)
 {
         switch (origin) {
         case ORIGINAL:
-                return s_id_original;
+                return ID2SYM(s_id_original);
         case ADDED:
-                return s_id_added;
+                return ID2SYM(s_id_added);
         default:
-                assert(false);
-                return Qnil;
+                return UINT2NUM(origin);
         }
 }
 
@@ -68,8 +75,14 @@ piece_s_allocate(UNUSED(VALUE class))
         piece->offset = 0;
         piece->size = 0;
         piece->size_left = 0;
-
-        return PIECE2VALUE(piece);
+        piece->lines = 0;
+        piece->lines_left = 0;
+        piece->chars = 0;
+        piece->chars_left = 0;
+        piece->ascii = 0;
+        piece->ascii_left = 0;
+
+        return OWNEDPIECE2VALUE(piece);
 }
 
 /*¶ Yes, that’s right, all it does is allocate and sets up a new piece. */
@@ -82,7 +95,9 @@ few arguments and sets up a more interesting piece: */
  * call-seq:
  *      Piece.new(origin, offset, size, size_left) → piece
  *
- * Create a new piece.
+ * Create a new piece.  The _origin_ is :original, :added, or the index of
+ * another source of the PieceTree that the piece is going to be inserted into,
+ * see PieceTree#add_source.
  *
  *      Piece.new(:original, 0, 1, 0)
  *                              ⇒ <PieceTree::Piece:0xdeadbeef …>
@@ -98,7 +113,7 @@ piece_initialize(VALUE self, VALUE rborigin, VALUE rboffset, VALUE rbsize,
 
         VALUE2PIECE(self, piece);
 
-        piece->origin = symbol_to_origin(rborigin);
+        piece->origin = piece_value_to_origin(rborigin);
         piece->offset = NUM2OFFT(rboffset);
         piece->size = NUM2OFFT(rbsize);
         piece->size_left = NUM2OFFT(rbsize_left);
@@ -112,11 +127,12 @@ data structure and will not be discussed in any detail. */
 
 /*
  * call-seq:
- *      piece.origin → { :original, :added }
+ *      piece.origin → { :original, :added, integer }
  *
  * Retrieve the origin of _piece_.  The origin is either :original, for a piece
- * pointing into the original file, or :added, for a piece pointing into the
- * add-file.
+ * pointing into the original file, :added, for a piece pointing into the
+ * add-file, or the index of some other source of the PieceTree that _piece_
+ * belongs to.
  *
  *      piece.origin            ⇒ :original
  */
@@ -127,7 +143,7 @@ piece_get_origin(VALUE self)
 
         VALUE2PIECE(self, piece);
 
-        return ID2SYM(origin_to_id(piece->origin));
+        return piece_origin_to_value(piece->origin);
 }
 
 
@@ -260,6 +276,130 @@ piece_set_size_left(VALUE self, VALUE size_left)
 }
 
 
+/*¶ The number of lines and characters of a piece are derived from its
+contents, so they can only be read from the Ruby side.  They are calculated
+when the piece is inserted into a tree. */
+
+/*
+ * call-seq:
+ *      piece.lines → bignum
+ *
+ * Retrieve the number of newlines in _piece_.  This is only known for pieces
+ * that have been inserted into a PieceTree.
+ *
+ *      piece.lines             ⇒ 1
+ */
+static VALUE
+piece_get_lines(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->lines);
+}
+
+
+/*
+ * call-seq:
+ *      piece.lines_left → bignum
+ *
+ * Retrieve the number of newlines in the pieces that precede _piece_ in the
+ * sub-tree that it is the root of.
+ *
+ *      piece.lines_left        ⇒ 0
+ */
+static VALUE
+piece_get_lines_left(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->lines_left);
+}
+
+
+/*
+ * call-seq:
+ *      piece.chars → bignum
+ *
+ * Retrieve the number of characters in _piece_.  This is only known for
+ * pieces that have been inserted into a PieceTree.
+ *
+ *      piece.chars             ⇒ 12
+ */
+static VALUE
+piece_get_chars(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->chars);
+}
+
+
+/*
+ * call-seq:
+ *      piece.chars_left → bignum
+ *
+ * Retrieve the number of characters in the pieces that precede _piece_ in the
+ * sub-tree that it is the root of.
+ *
+ *      piece.chars_left        ⇒ 0
+ */
+static VALUE
+piece_get_chars_left(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->chars_left);
+}
+
+
+/*
+ * call-seq:
+ *      piece.ascii → bignum
+ *
+ * Retrieve the number of ASCII characters in _piece_.  This is only known for
+ * pieces that have been inserted into a PieceTree.
+ *
+ *      piece.ascii             ⇒ 12
+ */
+static VALUE
+piece_get_ascii(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->ascii);
+}
+
+
+/*
+ * call-seq:
+ *      piece.ascii_left → bignum
+ *
+ * Retrieve the number of ASCII characters in the pieces that precede _piece_
+ * in the sub-tree that it is the root of.
+ *
+ *      piece.ascii_left        ⇒ 0
+ */
+static VALUE
+piece_get_ascii_left(VALUE self)
+{
+        Piece *piece;
+
+        VALUE2PIECE(self, piece);
+
+        return OFFT2NUM(piece->ascii_left);
+}
+
+
 /*¶ As with all data structures accessible from Ruby, we define a function to
 inspect the contents of such a structure: */
 
@@ -279,15 +419,24 @@ piece_inspect(VALUE self)
 
         VALUE2PIECE(self, piece);
 
+        VALUE origin = rb_inspect(piece_origin_to_value(piece->origin));
         char buf[INSPECT_BUFFER_SIZE];
         int len = snprintf(buf, INSPECT_BUFFER_SIZE,
-                           "#<PieceTree::Piece:%p origin=:%s offset=%jd "
-                           "size=%jd size_left=%jd>",
+                           "#<PieceTree::Piece:%p origin=%s offset=%jd "
+                           "size=%jd size_left=%jd lines=%jd lines_left=%jd "
+                           "chars=%jd chars_left=%jd ascii=%jd "
+                           "ascii_left=%jd>",
                            piece,
-                           rb_id2name(origin_to_id(piece->origin)),
+                           RSTRING(origin)->ptr,
                            (intmax_t)piece->offset,
                            (intmax_t)piece->size,
-                           (intmax_t)piece->size_left);
+                           (intmax_t)piece->size_left,
+                           (intmax_t)piece->lines,
+                           (intmax_t)piece->lines_left,
+                           (intmax_t)piece->chars,
+                           (intmax_t)piece->chars_left,
+                           (intmax_t)piece->ascii,
+                           (intmax_t)piece->ascii_left);
         return rb_str_new(buf, len);
 }
 
@@ -321,5 +470,11 @@ Init_Piece(VALUE g_cPieceTree)
         rb_define_method(g_cPiece, "size=", piece_set_size, 1);
         rb_define_method(g_cPiece, "size_left", piece_get_size_left, 0);
         rb_define_method(g_cPiece, "size_left=", piece_set_size_left, 1);
+        rb_define_method(g_cPiece, "lines", piece_get_lines, 0);
+        rb_define_method(g_cPiece, "lines_left", piece_get_lines_left, 0);
+        rb_define_method(g_cPiece, "chars", piece_get_chars, 0);
+        rb_define_method(g_cPiece, "chars_left", piece_get_chars_left, 0);
+        rb_define_method(g_cPiece, "ascii", piece_get_ascii, 0);
+        rb_define_method(g_cPiece, "ascii_left", piece_get_ascii_left, 0);
         rb_define_method(g_cPiece, "inspect", piece_inspect, 0);
 }
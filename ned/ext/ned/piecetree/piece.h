@@ -19,10 +19,12 @@ with a red||black tree maintaining the pieces.
 Appropriate to such a horrible section||title, the data structure that
 represents pieces in our piece table is also rather dull: */
 
-typedef enum {
+typedef unsigned int PieceOrigin;
+
+enum {
         ORIGINAL,
         ADDED
-} PieceOrigin;
+};
 
 typedef struct _Piece Piece;
 
@@ -31,15 +33,32 @@ struct _Piece {
         off_t offset;
         off_t size;
         off_t size_left;
+        off_t lines;
+        off_t lines_left;
+        off_t chars;
+        off_t chars_left;
+        off_t ascii;
+        off_t ascii_left;
 };
 
-/*¶ The \C{origin} defines in what location this piece resides.  The \C{offset}
+/*¶ The \C{origin} defines in what location this piece resides.  It is an
+index into the table of sources of the tree that the piece belongs to, see
+\insection[piecetree:sources], the first two of which are always the original
+file and the add||file, so those two get names of their own.  The \C{offset}
 is the offset within the \C{origin} at which this piece begins and the \C{size}
 says how long this piece is within the \C{origin}.  The last field,
 \C{size_left}, is a bit special and is a derived value used by the red||black
 tree to keep track of how large the left sub||tree of a node owning this
 piece is.  This will be instrumental in making sure that the operations on the
-piece||tree remain $\Ordo{\lg n}$. */
+piece||tree remain $\Ordo{\lg n}$.  The \C{lines} and \C{lines_left} fields
+do the same thing for the number of newlines within the piece and the left
+sub||tree, so that we can find the beginning of a given line, or the line of
+a given offset, just as quickly as we can find a given offset.  Finally,
+\C{chars} and \C{chars_left} count characters, so that we can translate
+between the character offsets that the pattern||matcher deals in and the byte
+offsets that everything else deals in, and \C{ascii} and \C{ascii_left}
+count the bytes that are \ASCII\ characters, so that we can tell when the
+pattern||matcher doesn’t have to decode them. */
 
 
 /*¶ Pieces are accessible from Ruby|<|actually, they will be created on the
@@ -52,14 +71,23 @@ extern VALUE g_cPiece;
 #define PIECE2VALUE(piece)                              \
         Data_Wrap_Struct(g_cPiece, NULL, NULL, (piece))
 
+#define OWNEDPIECE2VALUE(piece)                         \
+        Data_Wrap_Struct(g_cPiece, NULL, free, (piece))
+
 #define VALUE2PIECE(value, piece)       \
         Data_Get_Struct((value), Piece, (piece))
 
 /*¶ Nothing that we haven’t already seen in the pattern||matcher
-code\dots. */
+code\dots, except perhaps that there are two ways of wrapping a piece.  The
+pieces of a tree are stored inside its nodes, so a Ruby object that wraps such
+a piece mustn’t free it.  A piece that has been created on the Ruby side,
+however, belongs to the object that wraps it; inserting it into a tree copies
+it into a node. */
 
 
 /*¶ ————————————————————————————————— EOD —————————————————————————————————— */
 
 
+PieceOrigin piece_value_to_origin(VALUE value);
+VALUE piece_origin_to_value(PieceOrigin origin);
 void Init_Piece(VALUE g_cPieceTree);
@@ -13,27 +13,44 @@
 
 #include "piece.h"
 #include "node.h"
+#include "mark.h"
 #include "piecetree.h"
 #include "iterator.h"
+#include "source.h"
+#include "original.h"
+#include "added.h"
+#include "write.h"
+#include "hash.h"
 #include "private.h"
 
 
 /*¶ And here’s some more boilerplate code: */
 
-#define PIECETREE2VALUE(piecetree)              \
-        Data_Wrap_Struct(g_cPieceTree, NULL, piece_tree_free, (piecetree))
+#define PIECETREE2VALUE(piecetree)                                      \
+        Data_Wrap_Struct(g_cPieceTree, piece_tree_mark, piece_tree_free, \
+                         (piecetree))
 
 
 HIDDEN VALUE g_cPieceTree;
 
 
 /*¶ As with everything else related to the Ruby interface, we need a way to
-allocate and free piece trees: */
+allocate and free piece trees.  As a tree holds on to the files that its
+pieces point into, we need to mark them as well: */
+
+HIDDEN void
+piece_tree_mark(PieceTree *tree)
+{
+        rb_gc_mark(tree->sources);
+}
+
 
 HIDDEN void
 piece_tree_free(PieceTree *tree)
 {
-        node_free(tree->root, true);
+        node_unref(tree->pool, tree->root);
+        node_pool_unref(tree->pool);
+        mark_table_unref(tree->marks);
         free(tree);
 }
 
@@ -45,6 +62,21 @@ piece_tree_s_allocate(UNUSED(VALUE class))
 
         tree->root = pt_null;
         tree->size = 0;
+        tree->lines = 0;
+        tree->chars = 0;
+        tree->ascii = 0;
+        tree->pool = node_pool_new();
+        tree->sources = Qnil;
+        tree->generation = 0;
+        tree->restored = 0;
+        tree->snapshot = false;
+        tree->modifications = 0;
+        tree->finger = NULL;
+        tree->finger_pos = 0;
+        tree->finger_modifications = 0;
+        tree->marks = mark_table_new();
+        tree->fragments = 0;
+        tree->compacted = 0;
 
         return PIECETREE2VALUE(tree);
 }
@@ -52,18 +84,210 @@ piece_tree_s_allocate(UNUSED(VALUE class))
 
 /*
  * call-seq:
- *      PieceTree.new → tree
+ *      PieceTree.new(original, added) → tree
+ *
+ * Create a new PieceTree whose pieces point into _original_ and _added_.  The
+ * contents of :original pieces are read directly from _original_ if it is a
+ * PieceTree::Original and retrieved by calling <tt>original[offset, len]</tt>
+ * otherwise.  The contents of :added pieces are read directly from _added_,
+ * which is either a PieceTree::Added or a String, and which may grow as new
+ * pieces are added.
+ * These are the first two sources of the tree, see #add_source.
+ *
+ *      PieceTree.new(original, added)
+ *                              ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_initialize(VALUE self, VALUE original, VALUE added)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        if (!RTEST(rb_obj_is_kind_of(added, g_cAdded)))
+                StringValue(added);
+
+        tree->sources = rb_ary_new3(2, original, added);
+
+        return self;
+}
+
+
+/*¶ A tree is usually filled by inserting pieces into it through iterators,
+one at a time, which takes $\Ordo{\lg n}$ time for each of them, as the tree
+must be searched and rebalanced after each insertion.  When we already have all
+the pieces at hand, in order, such as when restoring a saved session, we can
+instead build a balanced tree out of them all at once in linear time, see
+\C{node_build}, just as \C{apply_edits} and \C{compact} do.  Counting the
+newlines, characters, and \ASCII\ characters of the pieces means reading all
+of them, though, which is what a session is supposed to save us from, so the
+caller may hand us the counts that it already knows instead: */
+
+/*
+ * call-seq:
+ *      PieceTree.from_pieces(original, added, pieces, counts = nil) → tree
+ *
+ * Create a new PieceTree, as PieceTree.new does, containing the given _pieces_
+ * in order, in O(_n_) time.  The tree stores copies of the _pieces_.  If
+ * _counts_ is given, it must be an Array of three integers for each piece, the
+ * number of newlines, characters, and ASCII characters in it, in order, and
+ * the pieces aren’t read at all.  Otherwise, the tree counts these itself.
  *
- * Create a new PieceTree.
+ * Raises a TypeError if one of the _pieces_ isn’t a PieceTree::Piece, an
+ * ArgumentError if one of them has a negative offset or size, if _counts_
+ * doesn’t have three entries for each piece, or if a count is negative or
+ * larger than the size of its piece, and an IndexError if one of the pieces
+ * has an origin that isn’t a source of the tree or reaches beyond the end of
+ * the add-file or of a PieceTree::Original.
  *
- *      PieceTree.new           ⇒ <PieceTree:0xdeadbeef …>
+ *      PieceTree.from_pieces(original, added, [piece, …])
+ *                              ⇒ <PieceTree:0xdeadbeef …>
+ *      PieceTree.from_pieces(original, added, [piece, …], [1, 10, 10, …])
+ *                              ⇒ <PieceTree:0xdeadbeef …>
  */
 static VALUE
-piece_tree_initialize(VALUE self)
+piece_tree_s_from_pieces(int argc, VALUE *argv, VALUE class)
 {
+        VALUE original, added, rbpieces, rbcounts;
+
+        rb_scan_args(argc, argv, "31", &original, &added, &rbpieces,
+                     &rbcounts);
+        Check_Type(rbpieces, T_ARRAY);
+        long n = RARRAY(rbpieces)->len;
+        if (!NIL_P(rbcounts)) {
+                Check_Type(rbcounts, T_ARRAY);
+                if (RARRAY(rbcounts)->len != 3 * n)
+                        rb_raise(rb_eArgError,
+                                 "expected three counts for each piece");
+        }
+
+        VALUE args[2] = { original, added };
+        VALUE self = rb_class_new_instance(2, args, class);
+        PieceTree *tree;
+        VALUE2PIECETREE(self, tree);
+
+        volatile VALUE pieces_buf = rb_str_new(NULL, n * sizeof(Piece));
+        Piece *pieces = (Piece *)RSTRING(pieces_buf)->ptr;
+        for (long i = 0; i < n; i++) {
+                VALUE rbpiece = rb_ary_entry(rbpieces, i);
+                if (!RTEST(rb_obj_is_kind_of(rbpiece, g_cPiece)))
+                        rb_raise(rb_eTypeError, "not a PieceTree::Piece");
+
+                Piece *piece;
+                VALUE2PIECE(rbpiece, piece);
+                if (piece->offset < 0 || piece->size < 0)
+                        rb_raise(rb_eArgError, "negative offset or size");
+                source_check(tree, piece);
+
+                pieces[i] = *piece;
+                Measure measure;
+                if (NIL_P(rbcounts)) {
+                        source_measure(tree, &pieces[i], 0, pieces[i].size,
+                                       &measure);
+                } else {
+                        measure.lines = NUM2OFFT(rb_ary_entry(rbcounts,
+                                                              3 * i));
+                        measure.chars = NUM2OFFT(rb_ary_entry(rbcounts,
+                                                              3 * i + 1));
+                        measure.ascii = NUM2OFFT(rb_ary_entry(rbcounts,
+                                                              3 * i + 2));
+                        if (measure.lines < 0 || measure.chars < 0 ||
+                            measure.ascii < 0 ||
+                            measure.lines > pieces[i].size ||
+                            measure.chars > pieces[i].size ||
+                            measure.ascii > measure.chars)
+                                rb_raise(rb_eArgError,
+                                         "count out of range for piece");
+                }
+                pieces[i].lines = measure.lines;
+                pieces[i].chars = measure.chars;
+                pieces[i].ascii = measure.ascii;
+        }
+        Piece sum;
+        tree->root = node_build(tree->pool, pieces, n, tree->generation, &sum);
+        tree->size = sum.size;
+        tree->lines = sum.lines;
+        tree->chars = sum.chars;
+        tree->ascii = sum.ascii;
+        tree->compacted = n;
+
         return self;
 }
 
+/*¶ The pieces are checked and measured before any nodes are allocated, so if
+reading the original file fails, or a piece or a count is out of range, the
+garbage collector takes care of the scratch array and the empty tree.  Counts
+that are within range but wrong can’t be caught without reading the pieces, so
+they are only as good as whoever hands them to us.  We read the array one entry at a time, as
+measuring a piece may call back into Ruby, which is free to change it in the
+meantime. */
+
+/*¶ Snapshots, see \insection[piecetree:snapshots], share their nodes with
+the tree that they were taken of, so they mustn’t be modified: */
+
+static void
+check_mutable(PieceTree const * const tree)
+{
+        if (tree->snapshot)
+                rb_raise(rb_eTypeError, "can't modify a snapshot");
+}
+
+
+/*¶ Further sources are appended to the table as they are needed.  They are
+never removed, as snapshots and saved pieces may still refer to them, so a
+tree only ever holds on to more of them.  A snapshot shares the table of the
+tree that it was taken of, which is fine, as it only contains pieces that
+refer to sources that were there when it was taken. */
+
+/*
+ * call-seq:
+ *      tree.add_source(source) → integer
+ *
+ * Adds _source_ to the sources that the pieces of _tree_ may point into and
+ * returns its origin, which is to be used for pieces that point into it.  The
+ * contents of such pieces are read from _source_ just as they are read from
+ * the original file, see PieceTree.new.
+ *
+ *      tree.add_source(PieceTree::Original.new(io))
+ *                              ⇒ 2
+ */
+static VALUE
+piece_tree_add_source(VALUE self, VALUE source)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        long origin = RARRAY(tree->sources)->len;
+        rb_ary_push(tree->sources, source);
+
+        return LONG2NUM(origin);
+}
+
+
+/*
+ * call-seq:
+ *      tree.source(origin) → source
+ *
+ * Returns the source that pieces of _origin_ point into, where _origin_ is
+ * either an integer, as returned by #add_source, or one of the symbols
+ * :original and :added.
+ *
+ * Raises an IndexError if _tree_ has no such source.
+ *
+ *      tree.source(:added)     ⇒ <PieceTree::Added:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_source(VALUE self, VALUE origin)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return source_get(tree, piece_value_to_origin(origin));
+}
+
+
 /*¶ Pretty dull reading, eh?  The next two functions that provide accessor
 methods for the \C{size} field aren’t much more entertaining.  The function
 following them, however, is, so, please, do read on\footnote{Five commas in a
@@ -110,6 +334,7 @@ piece_tree_set_size(VALUE self, VALUE rbsize)
         PieceTree *tree;
 
         VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
 
         tree->size = size;
 
@@ -117,12 +342,203 @@ piece_tree_set_size(VALUE self, VALUE rbsize)
 }
 
 
+/*
+ * call-seq:
+ *      tree.lines → bignum
+ *
+ * Returns the number of newlines in _tree_.
+ *
+ *      tree.lines              ⇒ 0
+ */
+static VALUE
+piece_tree_get_lines(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return OFFT2NUM(tree->lines);
+}
+
+
+/*
+ * call-seq:
+ *      tree.chars → bignum
+ *
+ * Returns the number of characters in _tree_.
+ *
+ *      tree.chars              ⇒ 0
+ */
+static VALUE
+piece_tree_get_chars(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return OFFT2NUM(tree->chars);
+}
+
+
 /*¶ The most important method of a piece tree object is to create a new
 iterator.  As has already been pointed out, all access to the actual tree goes
 through the use of an iterator, so this is the only way of modifying the tree.
 Anyway, what we do is find the node that contains a given offset and return a
-new iterator that points to this node.  It’s rather straightforward actually:
-*/
+new iterator that points to this node.  As we will need to find nodes by offset
+in more than one place, the search itself lives in a function of its own: */
+
+static Node *
+find_node(PieceTree const * const tree, off_t *pos, NodePath *path)
+{
+        Node *x = tree->root;
+
+        if (path != NULL)
+                path->depth = 0;
+
+        while (x != pt_null) {
+                if (path != NULL)
+                        path->nodes[path->depth++] = x;
+
+                if (x->piece.size_left > *pos) {
+                        x = x->left;
+                } else if (x->piece.size_left + x->piece.size > *pos) {
+                        *pos -= x->piece.size_left;
+                        return x;
+                } else {
+                        *pos -= x->piece.size_left + x->piece.size;
+                        x = x->right;
+                }
+        }
+
+        return NULL;
+}
+
+/*¶ The algorithm for finding the given offset is simple.  If the current
+node’s left child’s size is greater than the current {\em position}, i.e., the
+initial offset minus the sizes of any pieces we have already traversed, then
+the piece we’re looking for is in the left sub||tree.  If it isn’t but the size
+of the left sub||tree plus the size of the current piece is, then we have found
+or node and we return it.  If neither of the previous two conditions hold, it
+must be in the right sub||tree.  We must decrement the size of the left
+sub||tree and the current node from the current position and then delve into
+the right sub||tree to find our node.  When we return, \C{pos} has been turned
+into an offset within the piece of the node that we found and, if our caller
+asked for it, \C{path} contains the nodes from the root down to it. */
+
+
+/*¶ We also need to check the offsets that our users pass us: */
+
+static off_t
+check_pos(PieceTree const * const tree, VALUE rbpos)
+{
+        off_t pos = NUM2OFFT(rbpos);
+        if (pos < 0)
+                pos += tree->size + 1;
+        if (pos < 0 || pos > tree->size)
+                rb_raise(rb_eRangeError, "position %jd beyond end of buffer",
+                         (intmax_t)NUM2OFFT(rbpos));
+
+        return pos;
+}
+
+/*¶ Note how we allow users to specify a negative offset.  Such an offset will
+be calculated from the “end” of the buffer. */
+
+
+/*¶ Ranges of offsets are checked in much the same way, except that an end
+beyond the end of the buffer is simply taken to be the end of the buffer.  We
+only ask a range for its beginning and end, as the end of a range is never
+part of it, no matter how the range was written: */
+
+static void
+range_to_pos(PieceTree const * const tree, VALUE range, off_t *begin,
+             off_t *end)
+{
+        static ID id_begin = 0;
+        static ID id_end = 0;
+
+        if (id_begin == 0)
+                id_begin = rb_intern("begin");
+        if (id_end == 0)
+                id_end = rb_intern("end");
+
+        *begin = check_pos(tree, rb_funcall(range, id_begin, 0));
+        *end = NUM2OFFT(rb_funcall(range, id_end, 0));
+        if (*end < 0)
+                *end += tree->size + 1;
+        if (*end > tree->size)
+                *end = tree->size;
+}
+
+
+/*¶ Most lookups by offset come in sequence, with the scanner reading the
+buffer chunk by chunk and commands walking it from the point onwards, so the
+node that we are asked for next is usually the one that we found last, or one
+right next to it.  We thus keep a finger on the last node that we found and,
+as long as the tree hasn’t been modified since, look for the offset by
+stepping from it along the parent pointers before we fall back to descending
+from the root.  We only take a few steps, as a walk across the tree costs
+more than a descent through it: */
+
+#define FINGER_REACH 4
+
+static Node *
+find_node_near(PieceTree *tree, off_t *pos)
+{
+        Node *x = NULL;
+        off_t start = 0;
+
+        if (tree->finger != NULL &&
+            tree->finger_modifications == tree->modifications) {
+                x = tree->finger;
+                start = tree->finger_pos;
+                for (int i = 0; i < FINGER_REACH && x != NULL; i++) {
+                        if (*pos < start) {
+                                x = node_prev(x);
+                                if (x != NULL)
+                                        start -= x->piece.size;
+                        } else if (*pos >= start + x->piece.size) {
+                                start += x->piece.size;
+                                x = node_next(x);
+                        } else {
+                                break;
+                        }
+                }
+                if (x != NULL &&
+                    (*pos < start || *pos >= start + x->piece.size))
+                        x = NULL;
+        }
+
+        if (x == NULL) {
+                off_t offset = *pos;
+                if ((x = find_node(tree, &offset, NULL)) == NULL)
+                        return NULL;
+                start = *pos - offset;
+        }
+
+        tree->finger = x;
+        tree->finger_pos = start;
+        tree->finger_modifications = tree->modifications;
+
+        *pos -= start;
+
+        return x;
+}
+
+/*¶ Stepping forward skips pieces of size zero, just like \C{find_node} does,
+and stepping backward can never stop on one, as the piece after it begins
+where it does, so both ways find the same node.  The finger is only ever
+followed for a tree that isn’t a snapshot, as snapshots have no parent
+pointers to follow.  Any change that may free or move a node also bumps
+\C{modifications}, and taking a snapshot, after which any change will copy
+the nodes that it touches, drops the finger, so we never follow it into a
+node that isn’t part of the tree anymore. */
+
+
+/*¶ Creating an iterator is now rather straightforward.  Iterators make use of
+parent pointers, so we can’t create them for snapshots.  As we find out where
+the node that we give the iterator begins along the way, we tell it, so that it
+doesn’t have to figure it out again: */
 
 /*
  * call-seq:
@@ -134,82 +550,1963 @@ new iterator that points to this node.  It’s rather straightforward actually:
  *
  *      tree.new_iter(0)        ⇒ <PieceTree::Iterator:0xdeadbeef …>
  */
-static VALUE
+HIDDEN VALUE
 piece_tree_new_iter(VALUE self, VALUE rbpos)
 {
         PieceTree *tree;
 
         VALUE2PIECETREE(self, tree);
 
-        Node *x = tree->root;
+        if (tree->snapshot)
+                rb_raise(rb_eTypeError, "can't iterate over a snapshot");
 
-        off_t pos = NUM2OFFT(rbpos);
-        if (pos < 0)
-                pos += tree->size + 1;
-        else if (pos > tree->size)
-                rb_raise(rb_eRangeError, "position %d beyond end of buffer",
-                         pos);
+        off_t pos = check_pos(tree, rbpos);
+        off_t offset = pos;
+        Node *node = find_node_near(tree, &offset);
 
-        while (x != pt_null) {
-                if (x->piece->size_left > pos) {
-                        x = x->left;
-                } else if (x->piece->size_left + x->piece->size > pos) {
-                        return ITERATOR2VALUE(iterator_new(self, x));
-                } else {
-                        pos -= x->piece->size_left + x->piece->size;
-                        x = x->right;
-                }
+        return ITERATOR2VALUE(iterator_new(self, node,
+                                           (node != NULL) ? pos - offset : -1));
+}
+
+
+/*¶ Extracting a range of the sequence that a piece tree represents could be
+done through an iterator, but that means one trip from Ruby into our code, and
+one new string, for every piece that the range spans.  We can do a lot better
+than that by finding the first node once and then walking the tree ourselves,
+copying the contents of each piece straight into a string that we allocate up
+front: */
+
+static bool
+copy_block(char const *p, size_t len, void *closure)
+{
+        char **dest = closure;
+
+        MEMCPY(*dest, p, char, len);
+        *dest += len;
+
+        return true;
+}
+
+
+/*¶ Ruby’s threads are green threads: they all run on the one thread that
+the process has, and Ruby only switches between them when we call back into
+it.  Copying blocks out of a mapped file or an add||file never does, so a long
+extract keeps the other threads waiting until it’s done, but reading blocks of
+a file that isn’t mapped does, which lets another thread run in between two
+blocks.  A thread that is searching a snapshot, see
+\insection[piecetree:snapshots], may thus have the thread that is editing the
+tree run in the middle of an extract.  That’s safe not because the two never
+interleave, but because a snapshot never changes: */
+
+static VALUE
+extract(PieceTree *tree, off_t pos, off_t len)
+{
+        VALUE ret = rb_str_new(NULL, len);
+        char *p = RSTRING(ret)->ptr;
+
+        NodePath path;
+        off_t offset = pos;
+        Node *x = tree->snapshot ?
+                find_node(tree, &offset, &path) :
+                find_node_near(tree, &offset);
+        off_t start = pos - offset;
+        while (x != NULL && len > 0) {
+                off_t n = x->piece.size - offset;
+                if (n > len)
+                        n = len;
+
+                source_read(tree, &x->piece, offset, n, copy_block, &p);
+                if ((len -= n) == 0)
+                        break;
+
+                start += x->piece.size;
+                offset = 0;
+                x = tree->snapshot ? node_path_next(&path) : node_next(x);
+        }
+
+        if (x != NULL && !tree->snapshot) {
+                tree->finger = x;
+                tree->finger_pos = start;
         }
 
-        return ITERATOR2VALUE(iterator_new(self, NULL));
+        return ret;
 }
 
-/*¶ Note how we allow users to specify a negative offset.  Such an offset will
-be calculated from the “end” of the buffer.  The algorithm for finding the
-given offset is simple.  If the current node’s left child’s size is greater than
-the current {\em position}, i.e., the initial offset minus the sizes of any
-pieces we have already traversed, then the piece we’re looking for is in the
-left sub||tree.  If it isn’t but the size of the left sub||tree plus the size of
-the current piece is, then we have found or node and we return it.  If neither
-of the previous two conditions hold, it must be in the right sub||tree.  We
-must decrement the size of the left sub||tree and the current node from the
-current position and then delve into the right sub||tree to find our node. */
 
+/*
+ * call-seq:
+ *      tree.extract(pos, len) → string
+ *
+ * Extract the _len_ symbols beginning at offset _pos_ in _tree_ as a String.
+ * If _len_ reaches beyond the end of _tree_, the String will be shorter than
+ * _len_.
+ *
+ * Raises a RangeError if _pos_ is outside of _tree_.
+ *
+ *      tree.extract(0, 5)      ⇒ "abcde"
+ */
+static VALUE
+piece_tree_extract(VALUE self, VALUE rbpos, VALUE rblen)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
 
-/*¶ A Ruby idiom is to always provide an \C{each} method that iterates over a
-compound data structure, such as an array or a hash table.  As the piece tree
-is such a data structure, we’ll provide an \C{each} method for it. */
+        off_t pos = check_pos(tree, rbpos);
+        off_t len = NUM2OFFT(rblen);
+        if (len < 0)
+                rb_raise(rb_eArgError, "negative length %jd", (intmax_t)len);
+        if (len > tree->size - pos)
+                len = tree->size - pos;
 
-static void
-_piece_tree_each(Node *node)
+        return extract(tree, pos, len);
+}
+
+/*¶ Pieces of size zero simply contribute nothing to the result, so we don’t
+need to skip them explicitly.  A snapshot has no parent pointers, so we walk it
+along a \C{NodePath}.  For the tree itself we instead start from our finger
+and leave it on the last piece that we read from, so that the next read, which
+usually begins right where this one ended, finds its piece in a step or two. */
+
+
+/*¶ Searches read the tree a chunk at a time, see \Ruby{Buffer::Scanner}.  A
+chunk of a fixed size rarely ends where a piece does, so the chunk after it
+begins in the middle of a piece, and a chunk that spans a lot of short pieces
+is no cheaper to read than one that spans a single long one.  Chunks instead
+follow the pieces: a chunk runs to the end of the piece that it begins in, and
+to the ends of as many pieces after it as it takes for it to be at least
+\C{min} symbols long, but it never grows longer than \C{max} symbols, so a
+long piece is read a slice at a time: */
+
+/*
+ * call-seq:
+ *      tree.chunk(pos, min, max) → string or nil
+ *
+ * Extract the symbols from offset _pos_ in _tree_ up to the end of the piece
+ * that contains _pos_, or of the first piece after it at which there are at
+ * least _min_ of them, but at most _max_ of them, as a String.  Returns +nil+
+ * if _pos_ is the end of _tree_.
+ *
+ * Raises a RangeError if _pos_ is outside of _tree_ and an ArgumentError if
+ * _max_ isn’t positive.
+ *
+ *      tree.chunk(0, 4096, 65536)
+ *                              ⇒ "abcde…"
+ */
+static VALUE
+piece_tree_chunk(VALUE self, VALUE rbpos, VALUE rbmin, VALUE rbmax)
 {
-        if (node == pt_null)
-                return;
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t pos = check_pos(tree, rbpos);
+        off_t min = NUM2OFFT(rbmin);
+        off_t max = NUM2OFFT(rbmax);
+        if (max <= 0)
+                rb_raise(rb_eArgError, "non-positive maximum chunk size %jd",
+                         (intmax_t)max);
+        if (pos == tree->size)
+                return Qnil;
+
+        NodePath path;
+        off_t offset = pos;
+        Node *x = tree->snapshot ?
+                find_node(tree, &offset, &path) :
+                find_node_near(tree, &offset);
+        off_t len = 0;
+        while (x != NULL && len < min && len < max) {
+                len += x->piece.size - offset;
+                offset = 0;
+                x = tree->snapshot ? node_path_next(&path) : node_next(x);
+        }
+        if (len > max)
+                len = max;
 
-        _piece_tree_each(node->left);
-        rb_yield(PIECE2VALUE(node->piece));
-/* TODO: remove tail-call */
-        _piece_tree_each(node->right);
+        return extract(tree, pos, len);
 }
 
+/*¶ The string is copied straight out of the sources of the pieces, once, see
+\C{extract}.  We’d rather hand out the contents of the sources themselves, but
+a Ruby string can’t point into a mapped file or into the blocks of an
+add||file. */
+
+
+/*¶ As each node knows how many newlines there are in its left sub||tree, we
+can find the beginning of a line in much the same way as we find a given
+offset.  We’re looking for the offset right after the $n$th newline of the
+tree, so we descend towards the piece that contains it, keeping track of the
+offset at which the current node begins.  Once we have found the piece, we only
+have to look through its contents to find out where in it the line begins: */
 
 /*
  * call-seq:
- *      tree.each{ |piece| … } → self
+ *      tree.line_offset(n) → bignum
  *
- * Iterate over the Piece's in _tree_.
+ * Returns the offset at which line _n_ of _tree_ begins.  Lines are counted
+ * from zero, so line zero always begins at offset zero.
  *
- *      tree.each{ |piece| p piece}
- *                              ⇒ <PieceTree:0xdeadbeef …>
+ * Raises a RangeError if _tree_ contains less than _n_ newlines.
+ *
+ *      tree.line_offset(5)     ⇒ 123
  */
 static VALUE
-piece_tree_each(VALUE self)
+piece_tree_line_offset(VALUE self, VALUE rbn)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t n = NUM2OFFT(rbn);
+        if (n < 0)
+                rb_raise(rb_eArgError, "line numbers must be non-negative");
+        if (n > tree->lines)
+                rb_raise(rb_eRangeError, "line %jd beyond end of buffer",
+                         (intmax_t)n);
+
+        if (n == 0)
+                return OFFT2NUM(0);
+
+        off_t pos = 0;
+        Node *x = tree->root;
+        while (x != pt_null) {
+                if (x->piece.lines_left >= n) {
+                        x = x->left;
+                } else if (x->piece.lines_left + x->piece.lines >= n) {
+                        n -= x->piece.lines_left;
+                        pos += x->piece.size_left;
+                        return OFFT2NUM(pos + source_find_line(tree, &x->piece,
+                                                               n));
+                } else {
+                        n -= x->piece.lines_left + x->piece.lines;
+                        pos += x->piece.size_left + x->piece.size;
+                        x = x->right;
+                }
+        }
+
+        rb_raise(rb_eScriptError, "line counts of tree are inconsistent");
+}
+
+
+/*¶ Going in the other direction, from an offset to the line that it is on, is
+just as simple.  We find the node containing the offset, counting the newlines
+of the pieces that we pass to the left of us, and then count the newlines in
+the part of the found piece that lies before the offset: */
+
+/*
+ * call-seq:
+ *      tree.line_at(pos) → bignum
+ *
+ * Returns the zero-based number of the line that offset _pos_ in _tree_ is
+ * on, i.e., the number of newlines that precede _pos_.
+ *
+ * Raises a RangeError if _pos_ is outside of _tree_.
+ *
+ *      tree.line_at(123)       ⇒ 5
+ */
+static VALUE
+piece_tree_line_at(VALUE self, VALUE rbpos)
 {
         PieceTree *tree;
 
         VALUE2PIECETREE(self, tree);
 
-        _piece_tree_each(tree->root);
+        off_t pos = check_pos(tree, rbpos);
+        if (pos == tree->size)
+                return OFFT2NUM(tree->lines);
+
+        off_t lines = 0;
+        Node *x = tree->root;
+        while (x != pt_null) {
+                if (x->piece.size_left > pos) {
+                        x = x->left;
+                } else if (x->piece.size_left + x->piece.size > pos) {
+                        pos -= x->piece.size_left;
+                        Measure measure;
+                        source_measure(tree, &x->piece, 0, pos, &measure);
+                        return OFFT2NUM(lines + x->piece.lines_left +
+                                        measure.lines);
+                } else {
+                        pos -= x->piece.size_left + x->piece.size;
+                        lines += x->piece.lines_left + x->piece.lines;
+                        x = x->right;
+                }
+        }
+
+        rb_raise(rb_eScriptError, "sizes of tree are inconsistent");
+}
+
+
+/*¶ The pattern||matcher counts in characters, not bytes, so when it reports
+where a match begins and ends we need to translate those character offsets to
+byte offsets, and the other way around when we give it somewhere to begin.
+Both translations follow the same pattern as the line lookups above, this time
+using the \C{chars_left} fields to guide us: */
+
+/*
+ * call-seq:
+ *      tree.char_to_byte(n) → bignum
+ *
+ * Returns the byte offset at which character _n_ of _tree_ begins.  Characters
+ * are counted from zero and _n_ may equal #chars, in which case #size is
+ * returned.
+ *
+ * Raises a RangeError if _tree_ contains less than _n_ characters.
+ *
+ *      tree.char_to_byte(5)    ⇒ 7
+ */
+static VALUE
+piece_tree_char_to_byte(VALUE self, VALUE rbn)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t n = NUM2OFFT(rbn);
+        if (n < 0)
+                rb_raise(rb_eArgError,
+                         "character offsets must be non-negative");
+        if (n > tree->chars)
+                rb_raise(rb_eRangeError, "character %jd beyond end of buffer",
+                         (intmax_t)n);
+
+        if (n == tree->chars)
+                return OFFT2NUM(tree->size);
+
+        off_t pos = 0;
+        Node *x = tree->root;
+        while (x != pt_null) {
+                if (x->piece.chars_left > n) {
+                        x = x->left;
+                } else if (x->piece.chars_left + x->piece.chars > n) {
+                        n -= x->piece.chars_left;
+                        pos += x->piece.size_left;
+                        return OFFT2NUM(pos + source_find_char(tree, &x->piece,
+                                                               n));
+                } else {
+                        n -= x->piece.chars_left + x->piece.chars;
+                        pos += x->piece.size_left + x->piece.size;
+                        x = x->right;
+                }
+        }
+
+        rb_raise(rb_eScriptError, "character counts of tree are inconsistent");
+}
+
+
+/*
+ * call-seq:
+ *      tree.byte_to_char(pos) → bignum
+ *
+ * Returns the number of characters that begin before byte offset _pos_ in
+ * _tree_.  If _pos_ is the offset of the first byte of a character, this is
+ * the zero-based index of that character.
+ *
+ * Raises a RangeError if _pos_ is outside of _tree_.
+ *
+ *      tree.byte_to_char(7)    ⇒ 5
+ */
+static VALUE
+piece_tree_byte_to_char(VALUE self, VALUE rbpos)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t pos = check_pos(tree, rbpos);
+        if (pos == tree->size)
+                return OFFT2NUM(tree->chars);
+
+        off_t chars = 0;
+        Node *x = tree->root;
+        while (x != pt_null) {
+                if (x->piece.size_left > pos) {
+                        x = x->left;
+                } else if (x->piece.size_left + x->piece.size > pos) {
+                        pos -= x->piece.size_left;
+                        Measure measure;
+                        source_measure(tree, &x->piece, 0, pos, &measure);
+                        return OFFT2NUM(chars + x->piece.chars_left +
+                                        measure.chars);
+                } else {
+                        pos -= x->piece.size_left + x->piece.size;
+                        chars += x->piece.chars_left + x->piece.chars;
+                        x = x->right;
+                }
+        }
+
+        rb_raise(rb_eScriptError, "sizes of tree are inconsistent");
+}
+
+/*¶ Note that the character that begins in a piece may well continue into the
+pieces that follow it, which is why we only ever look for the byte that begins
+a character and never try to decode it. */
+
+
+/*¶ The counts of \ASCII\ characters tell us one more thing.  A piece whose
+\C{ascii} equals its \C{size} contains nothing but \ASCII\ characters, so
+every one of its bytes is a character of its own, and the same goes for a left
+sub||tree whose \C{ascii_left} equals its \C{size_left}.  It’s not enough
+for a piece to have as many characters as bytes, as a byte that begins a
+longer character is counted as a character even if the bytes that should
+continue it are missing, and the pattern||matcher decodes such a byte
+differently than it would take it on its own.  As no piece has more \ASCII\
+characters than bytes, a run of pieces is made up of them only if it, as a
+whole, has as many of them as it has bytes.  We thus only need to find the
+pieces that begin and end a range, along with the number of bytes and \ASCII\
+characters that precede them, to tell whether the pattern||matcher may skip
+decoding it: */
+
+static Node *
+find_node_ascii(PieceTree const * const tree, off_t pos, off_t *begin,
+                off_t *ascii)
+{
+        *begin = 0;
+        *ascii = 0;
+
+        Node *x = tree->root;
+        while (x != pt_null) {
+                if (x->piece.size_left > pos) {
+                        x = x->left;
+                } else if (x->piece.size_left + x->piece.size > pos) {
+                        *begin += x->piece.size_left;
+                        *ascii += x->piece.ascii_left;
+                        return x;
+                } else {
+                        pos -= x->piece.size_left + x->piece.size;
+                        *begin += x->piece.size_left + x->piece.size;
+                        *ascii += x->piece.ascii_left + x->piece.ascii;
+                        x = x->right;
+                }
+        }
+
+        rb_raise(rb_eScriptError, "sizes of tree are inconsistent");
+}
+
+
+/*
+ * call-seq:
+ *      tree.ascii?(pos, len) → bool
+ *
+ * Returns +true+ if every byte of the _len_ bytes beginning at _pos_ in _tree_
+ * is an ASCII character, so that each of them may be taken as a character of
+ * its own.  The answer is made up of the pieces that the range touches, so a
+ * range within a piece that also contains other characters gives +false+.  A
+ * _len_ that goes beyond the end of _tree_ is cut short.
+ *
+ * Raises a RangeError if _pos_ is outside of _tree_.
+ *
+ *      tree.ascii?(0, 4096)    ⇒ true
+ */
+static VALUE
+piece_tree_ascii_p(VALUE self, VALUE rbpos, VALUE rblen)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t pos = check_pos(tree, rbpos);
+        off_t len = NUM2OFFT(rblen);
+        if (len < 0)
+                rb_raise(rb_eArgError, "negative length %jd", (intmax_t)len);
+        if (len > tree->size - pos)
+                len = tree->size - pos;
+        if (len == 0)
+                return Qtrue;
+
+        off_t begin, ascii, last_begin, last_ascii;
+        find_node_ascii(tree, pos, &begin, &ascii);
+        Node *last = find_node_ascii(tree, pos + len - 1, &last_begin,
+                                     &last_ascii);
+
+        return BOOL2VALUE(last_begin + last->piece.size - begin ==
+                          last_ascii + last->piece.ascii - ascii);
+}
+
+
+/*¶ Taking a snapshot of a tree is a matter of creating a new tree that shares
+its root and moving the tree on to a new generation, so that the nodes that it
+now shares will be copied before they are modified: */
+
+/*
+ * call-seq:
+ *      tree.snapshot → snapshot
+ *
+ * Returns an immutable copy of _tree_ in O(1) time.  The snapshot is itself a
+ * PieceTree that may be read from, but not modified or iterated over with
+ * PieceTree::Iterator’s.  Pass it to #restore to roll _tree_ back to the
+ * state that it was in when the snapshot was taken.
+ *
+ *      tree.snapshot           ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_snapshot(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        if (tree->snapshot)
+                return self;
+
+        PieceTree *snapshot = ALLOC(PieceTree);
+
+        *snapshot = *tree;
+        snapshot->root = node_ref(tree->root);
+        snapshot->pool = node_pool_ref(tree->pool);
+        snapshot->snapshot = true;
+        snapshot->finger = NULL;
+        snapshot->marks = NULL;
+
+        tree->finger = NULL;
+        tree->generation++;
+
+        return PIECETREE2VALUE(snapshot);
+}
+
+
+/*
+ * call-seq:
+ *      tree.snapshot? → bool
+ *
+ * Returns +true+ if _tree_ is a snapshot of some other PieceTree.
+ *
+ *      tree.snapshot.snapshot? ⇒ true
+ */
+static VALUE
+piece_tree_snapshot_p(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return BOOL2VALUE(tree->snapshot);
+}
+
+
+/*¶ A thread that searches a snapshot while another edits the tree needs to
+know whether what it found still applies to the tree once it’s done.  Every
+change to the contents of a tree increments \C{modifications}, and a snapshot
+keeps the value that it had when the snapshot was taken, so it’s a fine
+version number: */
+
+/*
+ * call-seq:
+ *      tree.version → integer
+ *
+ * Returns the version of the contents of _tree_.  The version changes
+ * whenever the contents of _tree_ may have changed, and a snapshot of _tree_
+ * has the version that _tree_ had when the snapshot was taken, so anything
+ * found in a snapshot still applies to _tree_ if their versions are equal.
+ *
+ *      tree.snapshot.version == tree.version
+ *                              ⇒ true
+ */
+static VALUE
+piece_tree_version(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return UINT2NUM(tree->modifications);
+}
+
+
+/*¶ Restoring a tree from a snapshot is just as simple, except that the parent
+pointers of the snapshot’s nodes describe their place in the tree that we are
+throwing away, or even in some other snapshot that the tree has been restored
+from in the meantime.  We thus have to set them up anew.  This is linear in
+the number of pieces in the snapshot, but it is only pointer||chasing, so it’s
+still a lot cheaper than reading the file all over again: */
+
+static void
+fix_parents(Node *node, Node *parent)
+{
+        node->parent = parent;
+
+        if (node->left != pt_null)
+                fix_parents(node->left, node);
+        if (node->right != pt_null)
+                fix_parents(node->right, node);
+}
+
+
+/*
+ * call-seq:
+ *      tree.restore(snapshot) → self
+ *
+ * Roll _tree_ back to the state that it was in when _snapshot_ was taken.
+ * Any PieceTree::Iterator’s into _tree_ are invalidated.
+ *
+ * Raises an ArgumentError if _snapshot_ isn’t a snapshot of _tree_.
+ *
+ *      tree.restore(snapshot)  ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_restore(VALUE self, VALUE rbsnapshot)
+{
+        PieceTree *tree, *snapshot;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        if (!RTEST(rb_obj_is_kind_of(rbsnapshot, g_cPieceTree)))
+                rb_raise(rb_eTypeError, "not a PieceTree");
+        VALUE2PIECETREE(rbsnapshot, snapshot);
+        if (!snapshot->snapshot || snapshot->pool != tree->pool)
+                rb_raise(rb_eArgError, "not a snapshot of this tree");
+
+        Node *root = tree->root;
+        tree->root = node_ref(snapshot->root);
+        node_unref(tree->pool, root);
+
+        tree->size = snapshot->size;
+        tree->lines = snapshot->lines;
+        tree->chars = snapshot->chars;
+        tree->ascii = snapshot->ascii;
+        tree->restored = ++tree->generation;
+        tree->modifications++;
+
+        if (tree->root != pt_null)
+                fix_parents(tree->root, NULL);
+        marks_clamp(tree->marks, tree->size);
+
+        return self;
+}
+
+/*¶ Moving on to a new generation makes sure that the nodes of the snapshot
+remain shared.  It also tells iterators created before the restore that they
+are no longer valid, and tells everyone that any \C{forward} pointers set up
+before the restore lead into the edits that we discarded.  Marks are simply
+kept within the restored tree, as there’s no telling where they should go. */
+
+
+/*¶ Scripts often make a whole batch of edits at once, such as replacing every
+match of a regular expression.  Making them one at a time through iterators
+means splitting pieces, inserting nodes, and rebalancing the tree for every
+single one of them.  If we are given all of them at once, sorted by position,
+we can instead walk the pieces of the tree once, in order, cutting out what is
+deleted and putting new pieces in between as we go, and then build a new,
+balanced tree out of the result.  An edit is described by the offset at which
+it takes place, the number of symbols to delete from there, and the offset and
+size of the text in the add||file that is to be inserted in their place: */
+
+typedef struct _Edit Edit;
+
+struct _Edit {
+        off_t pos;
+        off_t deleted;
+        off_t offset;
+        off_t added;
+};
+
+
+static void
+parse_edit(VALUE rbedit, Edit *edit)
+{
+        Check_Type(rbedit, T_ARRAY);
+        if (RARRAY(rbedit)->len != 4)
+                rb_raise(rb_eArgError,
+                         "edits must be [pos, del_len, add_offset, add_len]");
+
+        VALUE *p = RARRAY(rbedit)->ptr;
+        edit->pos = NUM2OFFT(p[0]);
+        edit->deleted = NUM2OFFT(p[1]);
+        edit->offset = NUM2OFFT(p[2]);
+        edit->added = NUM2OFFT(p[3]);
+}
+
+
+/*¶ Most of the pieces of the tree are copied as||is, but the ones that an
+edit falls within must be cut into slices.  We need to know the number of
+newlines, characters, and \ASCII\ characters in each slice, and, as when
+splitting a piece with an iterator, we look through whichever is smaller of the
+slice and the rest of the piece to find out.  This way, we never look through
+more symbols than there are in the piece, no matter how many edits fall within
+it: */
+
+static void
+slice_piece(PieceTree const * const tree, Piece const *piece, off_t from,
+            off_t to, Piece *slice)
+{
+        *slice = *piece;
+        slice->offset += from;
+        slice->size = to - from;
+
+        if (from == 0 && to == piece->size)
+                return;
+
+        Measure measure;
+        if (2 * slice->size <= piece->size) {
+                source_measure(tree, piece, from, slice->size, &measure);
+        } else {
+                Measure before, after;
+                source_measure(tree, piece, 0, from, &before);
+                source_measure(tree, piece, to, piece->size - to, &after);
+                measure.lines = piece->lines - before.lines - after.lines;
+                measure.chars = piece->chars - before.chars - after.chars;
+                measure.ascii = piece->ascii - before.ascii - after.ascii;
+        }
+
+        slice->lines = measure.lines;
+        slice->chars = measure.chars;
+        slice->ascii = measure.ascii;
+}
+
+
+/*¶ The inserted text is turned into a piece of its own, unless it is
+empty: */
+
+static size_t
+added_piece(PieceTree const * const tree, Edit const *edit, Piece *piece)
+{
+        if (edit->added == 0)
+                return 0;
+
+        *piece = (Piece){
+                .origin = ADDED,
+                .offset = edit->offset,
+                .size = edit->added
+        };
+
+        Measure measure;
+        source_measure(tree, piece, 0, piece->size, &measure);
+        piece->lines = measure.lines;
+        piece->chars = measure.chars;
+        piece->ascii = measure.ascii;
+
+        return 1;
+}
+
+
+/*¶ Pieces are added to the new tree one at a time.  A piece that continues
+right where the previous one ends in the same file is merged into it and an
+empty piece is dropped altogether, so that the new tree contains no more pieces
+than it has to: */
+
+static inline bool
+pieces_adjoin(Piece const *a, Piece const *b)
+{
+        return a->origin == b->origin && a->offset + a->size == b->offset;
+}
+
+
+static void
+push_piece(Piece *pieces, size_t *n, Piece const *piece)
+{
+        if (piece->size == 0)
+                return;
+
+        if (*n > 0 && pieces_adjoin(&pieces[*n - 1], piece)) {
+                Piece *last = &pieces[*n - 1];
+
+                last->size += piece->size;
+                last->lines += piece->lines;
+                last->chars += piece->chars;
+                last->ascii += piece->ascii;
+                return;
+        }
+
+        pieces[(*n)++] = *piece;
+}
+
+
+/*
+ * call-seq:
+ *      tree.apply_edits(edits) → self
+ *
+ * Apply a batch of _edits_ to _tree_ in one pass over its pieces.  Each edit
+ * is an Array <tt>[pos, del_len, add_offset, add_len]</tt> that deletes the
+ * _del_len_ symbols at offset _pos_ and inserts the _add_len_ symbols at
+ * offset _add_offset_ in the add-file in their place.  All offsets refer to
+ * _tree_ as it is before any of the _edits_ are made, so the _edits_ must be
+ * sorted by position and mustn’t overlap.  Any PieceTree::Iterator’s into
+ * _tree_ are invalidated.
+ *
+ * Raises an ArgumentError if the _edits_ aren’t sorted or overlap, a
+ * RangeError if one of them reaches beyond the end of _tree_, and an
+ * IndexError if one of them reaches beyond the end of the add-file.
+ *
+ *      tree.apply_edits([[0, 2, 10, 3], [5, 0, 13, 1]])
+ *                              ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_apply_edits(VALUE self, VALUE rbedits)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+        Check_Type(rbedits, T_ARRAY);
+
+        long n_edits = RARRAY(rbedits)->len;
+        volatile VALUE edits_buf = rb_str_new(NULL, n_edits * sizeof(Edit));
+        Edit *edits = (Edit *)RSTRING(edits_buf)->ptr;
+
+        off_t end = 0;
+        off_t added_size = source_added_size(tree);
+        for (long i = 0; i < n_edits; i++) {
+                Edit *edit = &edits[i];
+
+                parse_edit(RARRAY(rbedits)->ptr[i], edit);
+                if (edit->deleted < 0 || edit->offset < 0 || edit->added < 0)
+                        rb_raise(rb_eArgError, "negative length or offset");
+                if (edit->pos < end)
+                        rb_raise(rb_eArgError,
+                                 "edits must be sorted and mustn't overlap");
+                if (edit->pos + edit->deleted > tree->size)
+                        rb_raise(rb_eRangeError,
+                                 "edit at %jd beyond end of buffer",
+                                 (intmax_t)edit->pos);
+                if (edit->offset + edit->added > added_size)
+                        rb_raise(rb_eIndexError,
+                                 "edit extends beyond end of add-file");
+                end = edit->pos + edit->deleted;
+        }
+
+        NodePath path;
+        size_t n_nodes = 0;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path))
+                n_nodes++;
+
+        volatile VALUE pieces_buf =
+                rb_str_new(NULL, (n_nodes + 2 * n_edits) * sizeof(Piece));
+        Piece *pieces = (Piece *)RSTRING(pieces_buf)->ptr;
+        size_t n = 0;
+
+        long e = 0;
+        off_t at = 0;
+        off_t deleted_to = 0;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path)) {
+                Piece const *piece = &x->piece;
+                Piece slice;
+
+                if (piece->size == 0)
+                        continue;
+
+                off_t from = 0;
+                for ( ; e < n_edits && edits[e].pos < at + piece->size; e++) {
+                        if (deleted_to - at > from)
+                                from = deleted_to - at;
+
+                        off_t to = edits[e].pos - at;
+                        if (to > from) {
+                                slice_piece(tree, piece, from, to, &slice);
+                                push_piece(pieces, &n, &slice);
+                        }
+                        if (added_piece(tree, &edits[e], &slice))
+                                push_piece(pieces, &n, &slice);
+
+                        from = to;
+                        deleted_to = edits[e].pos + edits[e].deleted;
+                }
+
+                if (deleted_to - at > from)
+                        from = deleted_to - at;
+                if (from < piece->size) {
+                        slice_piece(tree, piece, from, piece->size, &slice);
+                        push_piece(pieces, &n, &slice);
+                }
+
+                at += piece->size;
+        }
+
+        Piece added;
+        for ( ; e < n_edits; e++)
+                if (added_piece(tree, &edits[e], &added))
+                        push_piece(pieces, &n, &added);
+
+        Piece sum;
+        Node *root = tree->root;
+        tree->restored = ++tree->generation;
+        tree->modifications++;
+        tree->root = node_build(tree->pool, pieces, n, tree->generation, &sum);
+        node_unref(tree->pool, root);
+
+        tree->size = sum.size;
+        tree->lines = sum.lines;
+        tree->chars = sum.chars;
+        tree->ascii = sum.ascii;
+        tree->fragments = 0;
+        tree->compacted = n;
+
+        for (long i = n_edits - 1; i >= 0; i--)
+                marks_replace(tree->marks, edits[i].pos, edits[i].deleted,
+                              edits[i].added);
+
+        return self;
+}
+
+/*¶ Nothing is changed until all the new pieces have been set up, so if reading
+the original file fails halfway through, the tree is left as it was.  The
+scratch arrays are kept in strings, so that the garbage collector cleans up
+after us in that case.  Each edit can add at most two pieces, one for the
+inserted text and one for splitting the piece that it falls within, which is
+why we count the nodes of the tree before we begin.  Pieces of size zero are
+dropped and pieces that adjoin are merged, so the new tree is as compact as
+\C{compact} would make it, see below.  As the new tree is made
+of new nodes, we move on to a new generation, just as \C{restore} does, so that
+iterators and \C{forward} pointers into the old tree are invalidated and any
+snapshots that share it are left alone.  Both the walk over the old tree and
+building the new one take linear time, so a batch of $m$ edits to a tree of $n$
+pieces costs $\Ordo{n + m}$ rather than $\Ordo{m \lg n}$.  That’s a win for
+the large batches that this method is meant for, but a handful of edits to a
+large tree is still better off being made through iterators.  The edits are
+applied to the marks of the tree last one first, so that the offsets of the
+ones that remain always refer to the marks as they are at that point. */
+
+
+/*¶ Every edit made in the middle of a piece splits it in two, and nothing
+that is done through iterators ever puts the halves back together again, even
+when the text that separated them is deleted.  Over time, a tree thus comes to
+contain a lot more pieces than it needs to, which costs memory and makes every
+search through it deeper.  Compacting the tree walks its pieces in order,
+merging those that adjoin and dropping empty ones, just as \C{apply_edits}
+does, and builds a new, balanced tree out of what remains.  If there’s nothing
+to merge or drop, the tree is left as it is, so that iterators into it remain
+valid: */
+
+static void
+compact(PieceTree *tree)
+{
+        NodePath path;
+        size_t n_nodes = 0;
+        size_t n_merged = 0;
+        Piece const *last = NULL;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path)) {
+                n_nodes++;
+                if (x->piece.size == 0)
+                        continue;
+                if (last == NULL || !pieces_adjoin(last, &x->piece))
+                        n_merged++;
+                last = &x->piece;
+        }
+
+        tree->fragments = 0;
+        tree->compacted = n_merged;
+        if (n_merged == n_nodes)
+                return;
+
+        volatile VALUE pieces_buf = rb_str_new(NULL, n_merged * sizeof(Piece));
+        Piece *pieces = (Piece *)RSTRING(pieces_buf)->ptr;
+        size_t n = 0;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path))
+                push_piece(pieces, &n, &x->piece);
+        assert(n == n_merged);
+
+        Piece sum;
+        Node *root = tree->root;
+        tree->restored = ++tree->generation;
+        tree->modifications++;
+        tree->root = node_build(tree->pool, pieces, n, tree->generation, &sum);
+        node_unref(tree->pool, root);
+}
+
+/*¶ The contents of the tree remain the same, so its size, newlines,
+characters, \ASCII\ characters, and marks are left alone. */
+
+
+/*¶ Compacting a tree takes time linear in the number of its pieces, so we
+don’t want to do it after every edit.  We instead keep a count in
+\C{fragments} of the edits that may have added a piece to the tree, or put
+two pieces that adjoin next to each other, since the last time that it was
+compacted, when \C{compacted} pieces remained.  Once there may be half again
+as many pieces in the tree as there were then, it’s time to compact it again.
+As that takes a number of edits proportional to the size of the tree, the cost
+of compacting it is constant per edit, amortized: */
+
+#define COMPACT_MIN_FRAGMENTS 64
+
+static bool
+fragmented(PieceTree const * const tree)
+{
+        return tree->fragments >= COMPACT_MIN_FRAGMENTS &&
+                2 * tree->fragments >= tree->compacted;
+}
+
+/*¶ Small trees are left alone, as compacting them would buy us very little.
+Compacting the tree invalidates iterators into it, so the methods that do so
+anyway, such as \C{delete}, compact the tree when it’s fragmented.  Everyone
+else must ask for it, see below. */
+
+
+/*
+ * call-seq:
+ *      tree.compact → self
+ *
+ * Merge the pieces of _tree_ that continue right where the piece before them
+ * ends in the same file and drop the empty ones, rebuilding _tree_ as a
+ * balanced tree in O(_n_) time.  Any PieceTree::Iterator’s into _tree_ are
+ * invalidated, unless there was nothing to merge or drop.
+ *
+ *      tree.compact            ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_compact(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        compact(tree);
+
+        return self;
+}
+
+
+/*
+ * call-seq:
+ *      tree.fragmented? → bool
+ *
+ * Returns +true+ if enough edits have been made to _tree_ since it was last
+ * compacted that it is worth compacting it again, see #compact.
+ *
+ *      tree.compact if tree.fragmented?
+ */
+static VALUE
+piece_tree_fragmented_p(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        return BOOL2VALUE(!tree->snapshot && fragmented(tree));
+}
+
+
+/*¶ Most edits are made by typing, one small insertion or deletion at a time.
+Making them through iterators means allocating an iterator, a copy of it to
+look at the piece before it, and a piece, and calling into our code half a
+dozen times, all of which costs a lot more than the $\Ordo{\lg n}$ work on the
+tree itself.  The following two methods instead make such an edit in one go,
+the way that a buffer wants it made.  An insertion at an offset in the middle
+of a piece splits it in two.  If the piece that then ends at the offset
+continues right where the new text begins in the same file, which it does for
+text that is typed at the end of what was typed last, we simply grow it.
+Otherwise, we insert a new piece after it, or first in the tree, if there’s no
+piece before the offset: */
+
+/*
+ * call-seq:
+ *      tree.insert(pos, origin, offset, size, *marks) → self
+ *
+ * Insert the _size_ symbols beginning at _offset_ in the file that _origin_
+ * refers to, see PieceTree::Piece.new, at offset _pos_ in _tree_.  Those of
+ * _marks_ that are right at _pos_ end up after the inserted symbols, whatever
+ * their gravity.  Any PieceTree::Iterator’s into _tree_ may be invalidated.
+ *
+ * Raises a TypeError if _tree_ is a snapshot or if _marks_ contains something
+ * other than PieceTree::Mark’s, a RangeError if _pos_ is outside of _tree_,
+ * and an ArgumentError if _offset_ or _size_ is negative.
+ *
+ *      tree.insert(10, :added, 0, 5)   ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_insert(int argc, VALUE *argv, VALUE self)
+{
+        PieceTree *tree;
+        VALUE rbpos, origin, offset, size, marks;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        rb_scan_args(argc, argv, "4*", &rbpos, &origin, &offset, &size, &marks);
+        for (long i = 0; i < RARRAY(marks)->len; i++)
+                if (!RTEST(rb_obj_is_kind_of(RARRAY(marks)->ptr[i], g_cMark)))
+                        rb_raise(rb_eTypeError, "not a mark");
+        off_t pos = check_pos(tree, rbpos);
+        Piece piece = {
+                .origin = piece_value_to_origin(origin),
+                .offset = NUM2OFFT(offset),
+                .size = NUM2OFFT(size)
+        };
+        if (piece.offset < 0 || piece.size < 0)
+                rb_raise(rb_eArgError, "negative offset or size");
+        if (piece.size == 0)
+                return self;
+
+        Node *prev;
+        Node *next = NULL;
+        off_t at = pos;
+        if (pos < tree->size) {
+                next = find_node_near(tree, &at);
+                if (at > 0) {
+                        prev = tree_split_node(tree, next, at);
+                        next = node_next(prev);
+                } else {
+                        prev = node_prev(next);
+                }
+        } else {
+                prev = (tree->root != pt_null) ? tree->root : NULL;
+                while (prev != NULL && prev->right != pt_null)
+                        prev = prev->right;
+        }
+
+        if (prev != NULL && prev->piece.origin == piece.origin &&
+            prev->piece.offset + prev->piece.size == piece.offset) {
+                tree_resize_node(tree, prev, prev->piece.offset,
+                                 prev->piece.size + piece.size);
+        } else {
+                Measure measure;
+                source_measure(tree, &piece, 0, piece.size, &measure);
+                piece.lines = measure.lines;
+                piece.chars = measure.chars;
+                piece.ascii = measure.ascii;
+                if (next != NULL)
+                        tree_insert_piece(tree, next, &piece, true);
+                else
+                        tree_insert_piece(tree, prev, &piece, false);
+        }
+
+        marks_replace(tree->marks, pos, 0, piece.size);
+        for (long i = 0; i < RARRAY(marks)->len; i++)
+                mark_push(RARRAY(marks)->ptr[i], self, pos, piece.size);
+
+        if (fragmented(tree))
+                compact(tree);
+
+        return self;
+}
+
+/*¶ Growing a piece only measures what is added to it, see
+\C{tree_resize_node}, and adds no piece to the tree, so, unlike splitting a
+piece and inserting one, it doesn’t count as a fragment.  As with \C{delete}
+below, we compact the tree once it has become fragmented enough.  A buffer
+passes the marks of point along with text that it inserts before point, so
+that all of point is pushed along by it, rather than moving them itself
+afterwards. */
+
+
+/*¶ Deleting a single symbol is done in much the same way.  We shrink the piece
+that contains it, at either end, deleting it altogether if it contains nothing
+else, and only split it in two if the symbol lies in its middle: */
+
+/*
+ * call-seq:
+ *      tree.delete_at(pos) → self
+ *
+ * Delete the symbol at offset _pos_ in _tree_.  Any PieceTree::Iterator’s into
+ * _tree_ may be invalidated.
+ *
+ * Raises a TypeError if _tree_ is a snapshot, a RangeError if _pos_ is outside
+ * of _tree_, and an IndexError if _pos_ is the end of _tree_.
+ *
+ *      tree.delete_at(10)      ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_delete_at(VALUE self, VALUE rbpos)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        off_t pos = check_pos(tree, rbpos);
+        if (pos == tree->size)
+                rb_raise(rb_eIndexError,
+                         "trying to delete beyond end of buffer");
+
+        off_t at = pos;
+        Node *node = find_node_near(tree, &at);
+        off_t offset = node->piece.offset;
+        off_t size = node->piece.size;
+        if (size == 1) {
+                tree_delete_node(tree, node);
+        } else if (at == 0) {
+                tree_resize_node(tree, node, offset + 1, size - 1);
+        } else if (at == size - 1) {
+                tree_resize_node(tree, node, offset, size - 1);
+        } else {
+                node = node_next(tree_split_node(tree, node, at));
+                tree_resize_node(tree, node, offset + at + 1, size - at - 1);
+        }
+        marks_replace(tree->marks, pos, 1, 0);
+
+        if (fragmented(tree))
+                compact(tree);
+
+        return self;
+}
+
+
+/*¶ Deleting a large range through iterators means deleting its pieces one at
+a time, rebalancing the tree after every single one of them, and rebuilding
+the whole tree, as \C{apply_edits} does, is no better for a tree that is a lot
+larger than the range.  Red||black trees can, however, be split in two at a
+given offset, and two of them can be joined, in $\Ordo{\lg n}$ time.  Deleting
+a range is then a matter of splitting the tree at both of its ends, letting go
+of the middle part all at once, and joining the other two parts together
+again.  Moving a range is done by splitting the tree at three places and
+joining the parts together in a different order, and copying a range by
+joining a tree built out of copies of its pieces into the tree.
+
+While a tree is being split and joined, we pass its parts around along with
+their black height, i.e., the number of black nodes on every path from their
+root down to a leaf, and their total size, newlines, characters, and \ASCII\
+characters, as that is what joining two trees depends on, and as we’d
+otherwise have to walk the trees to find out: */
+
+typedef struct _Subtree Subtree;
+
+struct _Subtree {
+        Node *root;
+        int height;
+        off_t size;
+        off_t lines;
+        off_t chars;
+        off_t ascii;
+};
+
+
+/*¶ The parts are taken apart and put together from the top down, so, as in
+\C{thaw}, we make each node that we are about to modify ours before we look at
+its children, copying it if it may be shared with a snapshot.  The reference
+that we hold to the node is handed over to the copy: */
+
+static Node *
+own_node(PieceTree *tree, Node *node)
+{
+        if (node == pt_null || node->generation == tree->generation)
+                return node;
+
+        if (node->refs == 1) {
+                node->generation = tree->generation;
+                return node;
+        }
+
+        Node *copy = node_new(tree->pool, node_ref(node->left),
+                              node_ref(node->right), NULL, node->color,
+                              &node->piece, tree->generation);
+        node_copy_hash(copy, node);
+        if (copy->left != pt_null)
+                copy->left->parent = copy;
+        if (copy->right != pt_null)
+                copy->right->parent = copy;
+        node_unref(tree->pool, node);
+
+        return copy;
+}
+
+/*¶ We don’t set up a \C{forward} pointer for the copy, as all of this takes
+place in a new generation that no iterator or \C{forward} pointer from before
+leads into, see \C{split_cuts} below. */
+
+
+/*¶ Taking the root of a part away from its children leaves us with two
+smaller parts: */
+
+static Node *
+take_node(PieceTree *tree, Subtree const *t, Subtree *left, Subtree *right)
+{
+        Node *x = own_node(tree, t->root);
+        int height = t->height - (x->color == BLACK);
+
+        *left = (Subtree){
+                x->left, height,
+                x->piece.size_left, x->piece.lines_left, x->piece.chars_left,
+                x->piece.ascii_left
+        };
+        *right = (Subtree){
+                x->right, height,
+                t->size - x->piece.size_left - x->piece.size,
+                t->lines - x->piece.lines_left - x->piece.lines,
+                t->chars - x->piece.chars_left - x->piece.chars,
+                t->ascii - x->piece.ascii_left - x->piece.ascii
+        };
+        x->left = x->right = pt_null;
+        x->hashed = false;
+
+        return x;
+}
+
+
+/*¶ Putting a node on top of two parts is just as easy: */
+
+static Node *
+make_node(Node *node, Subtree const *left, Subtree const *right,
+          NodeColor color)
+{
+        node->left = left->root;
+        node->right = right->root;
+        node->parent = NULL;
+        node->color = color;
+        node->hashed = false;
+        node->piece.size_left = left->size;
+        node->piece.lines_left = left->lines;
+        node->piece.chars_left = left->chars;
+        node->piece.ascii_left = left->ascii;
+
+        if (node->left != pt_null)
+                node->left->parent = node;
+        if (node->right != pt_null)
+                node->right->parent = node;
+
+        return node;
+}
+
+
+/*¶ Coloring the root of a part black never breaks any of the red||black
+properties, it only makes the part one level higher.  We do this to both parts
+that we join, so that we don’t have to worry about two red nodes meeting where
+they are joined: */
+
+static void
+blacken(PieceTree *tree, Subtree *t)
+{
+        if (t->root->color == BLACK)
+                return;
+
+        t->root = own_node(tree, t->root);
+        t->root->color = BLACK;
+        t->height++;
+}
+
+
+/*¶ Joining two parts with a node in between them is done by walking down the
+right spine of the left part, if it is the higher one, until we find a black
+node at the same black height as the right part.  That node is replaced by
+the node that we are joining with, colored red, with the black node as its
+left child and the right part as its right child.  This doesn’t change any
+black heights, but the new node may have a red parent, in which case we rotate
+its grand||parent to the left on our way back up, just as when inserting a
+node: */
+
+static Node *
+join_right(PieceTree *tree, Subtree const *l, Node *k, Subtree const *r)
+{
+        if (l->root->color == BLACK && l->height == r->height)
+                return make_node(k, l, r, RED);
+
+        Node *x = own_node(tree, l->root);
+        Subtree right = {
+                x->right, l->height - (x->color == BLACK),
+                l->size - x->piece.size_left - x->piece.size,
+                l->lines - x->piece.lines_left - x->piece.lines,
+                l->chars - x->piece.chars_left - x->piece.chars,
+                l->ascii - x->piece.ascii_left - x->piece.ascii
+        };
+
+        Node *y = x->right = join_right(tree, &right, k, r);
+        y->parent = x;
+        x->hashed = false;
+
+        if (x->color == RED || y->color == BLACK || y->right->color == BLACK)
+                return x;
+
+        y->right->color = BLACK;
+        y->hashed = false;
+        y->piece.size_left += x->piece.size_left + x->piece.size;
+        y->piece.lines_left += x->piece.lines_left + x->piece.lines;
+        y->piece.chars_left += x->piece.chars_left + x->piece.chars;
+        y->piece.ascii_left += x->piece.ascii_left + x->piece.ascii;
+        x->right = y->left;
+        if (x->right != pt_null)
+                x->right->parent = x;
+        y->left = x;
+        x->parent = y;
+        y->parent = NULL;
+
+        return y;
+}
+
+/*¶ All nodes on the path that we walk down are made ours, as is the node
+that we join with, and the nodes that we rotate are always ones that we
+returned from the level below, so we never modify anything that we don’t
+own.  If the right part is the higher one, we do the same thing in the other
+direction, except that the nodes that we pass now have a left sub||tree that
+grows: */
+
+static Node *
+join_left(PieceTree *tree, Subtree const *l, Node *k, Subtree const *r)
+{
+        if (r->root->color == BLACK && r->height == l->height)
+                return make_node(k, l, r, RED);
+
+        Node *x = own_node(tree, r->root);
+        Subtree left = {
+                x->left, r->height - (x->color == BLACK),
+                x->piece.size_left, x->piece.lines_left, x->piece.chars_left,
+                x->piece.ascii_left
+        };
+
+        Node *y = x->left = join_left(tree, l, k, &left);
+        y->parent = x;
+        x->hashed = false;
+        x->piece.size_left += l->size + k->piece.size;
+        x->piece.lines_left += l->lines + k->piece.lines;
+        x->piece.chars_left += l->chars + k->piece.chars;
+        x->piece.ascii_left += l->ascii + k->piece.ascii;
+
+        if (x->color == RED || y->color == BLACK || y->left->color == BLACK)
+                return x;
+
+        y->left->color = BLACK;
+        y->hashed = false;
+        x->piece.size_left -= y->piece.size_left + y->piece.size;
+        x->piece.lines_left -= y->piece.lines_left + y->piece.lines;
+        x->piece.chars_left -= y->piece.chars_left + y->piece.chars;
+        x->piece.ascii_left -= y->piece.ascii_left + y->piece.ascii;
+        x->left = y->right;
+        if (x->left != pt_null)
+                x->left->parent = x;
+        y->right = x;
+        x->parent = y;
+        y->parent = NULL;
+
+        return y;
+}
+
+
+static void
+join(PieceTree *tree, Subtree const *left, Node *k, Subtree const *right,
+     Subtree *t)
+{
+        Subtree l = *left;
+        Subtree r = *right;
+        blacken(tree, &l);
+        blacken(tree, &r);
+
+        *t = (Subtree){
+                NULL, (l.height > r.height) ? l.height : r.height,
+                l.size + k->piece.size + r.size,
+                l.lines + k->piece.lines + r.lines,
+                l.chars + k->piece.chars + r.chars,
+                l.ascii + k->piece.ascii + r.ascii
+        };
+        if (l.height > r.height)
+                t->root = join_right(tree, &l, k, &r);
+        else if (l.height < r.height)
+                t->root = join_left(tree, &l, k, &r);
+        else
+                t->root = make_node(k, &l, &r, RED);
+        t->root->parent = NULL;
+}
+
+/*¶ As the root of the higher part is black, any rotation that is needed takes
+place below it, so the black height of the joined part is that of the higher
+one.  If they are equally high, the node simply becomes the root. */
+
+
+/*¶ Joining two parts without a node in between them is done by splitting off
+the last node of the left part, which leaves us with a node to join them
+with: */
+
+static Node *
+split_last(PieceTree *tree, Subtree const *t, Subtree *rest)
+{
+        Subtree left, right;
+        Node *x = take_node(tree, t, &left, &right);
+        if (right.root == pt_null) {
+                *rest = left;
+                return x;
+        }
+
+        Subtree m;
+        Node *k = split_last(tree, &right, &m);
+        join(tree, &left, x, &m, rest);
+
+        return k;
+}
+
+
+static void
+concat(PieceTree *tree, Subtree const *l, Subtree const *r, Subtree *t)
+{
+        if (l->root == pt_null) {
+                *t = *r;
+                return;
+        }
+        if (r->root == pt_null) {
+                *t = *l;
+                return;
+        }
+
+        Subtree rest;
+        Subtree right = *r;
+        Node *k = split_last(tree, l, &rest);
+        join(tree, &rest, k, &right, t);
+}
+
+
+/*¶ Splitting a part at a given offset is done by walking down towards the
+offset, joining the nodes that we pass, along with their sub||trees on the
+other side of the offset, to the parts that we have gathered so far.  The black
+heights of these parts only grow as we walk back up, so all the joins along
+the way take $\Ordo{\lg n}$ time altogether.  A piece that the offset falls
+within is cut in two, the first half going to the left part and the second
+half, in a new node, to the right one.  Pieces of size zero at the offset go
+to the left part: */
+
+static void
+split(PieceTree *tree, Subtree const *t, off_t pos, Piece const *first,
+      Subtree *l, Subtree *r)
+{
+        if (t->root == pt_null) {
+                *l = *t;
+                *r = *t;
+                return;
+        }
+
+        Subtree left, right, m;
+        Node *x = take_node(tree, t, &left, &right);
+        off_t begin = left.size;
+        off_t end = begin + x->piece.size;
+        if (end <= pos) {
+                split(tree, &right, pos - end, first, &m, r);
+                join(tree, &left, x, &m, l);
+        } else if (begin >= pos) {
+                split(tree, &left, pos, first, l, &m);
+                join(tree, &m, x, &right, r);
+        } else {
+                assert(first != NULL && first->size == pos - begin);
+
+                Piece rest = x->piece;
+                rest.offset = first->offset + first->size;
+                rest.size -= first->size;
+                rest.lines -= first->lines;
+                rest.chars -= first->chars;
+                rest.ascii -= first->ascii;
+                x->piece = *first;
+                Node *y = node_new(tree->pool, pt_null, pt_null, NULL, RED,
+                                   &rest, tree->generation);
+                node_share_piece_hash(y, x);
+
+                Subtree empty = { pt_null, 0, 0, 0, 0, 0 };
+                join(tree, &left, x, &empty, l);
+                join(tree, &empty, y, &right, r);
+        }
+}
+
+
+/*¶ Measuring the first half of a piece that we cut reads the files that the
+tree points into, and that may fail.  We therefore measure the halves of all
+the pieces that we are going to cut before we take the tree apart, so that a
+failure leaves it as it was.  A cut at an offset is described by the offset
+and by the first half of the piece that it falls within, if any: */
+
+typedef struct _Cut Cut;
+
+struct _Cut {
+        off_t pos;
+        bool within;
+        Piece first;
+};
+
+
+static void
+measure_cuts(PieceTree const * const tree, Cut *cuts, int n)
+{
+        off_t from = 0;
+        for (int i = 0; i < n; i++) {
+                off_t offset = cuts[i].pos;
+                Node *x = find_node(tree, &offset, NULL);
+
+                cuts[i].within = (x != NULL && offset > 0);
+                if (cuts[i].within) {
+                        off_t begin = cuts[i].pos - offset;
+                        slice_piece(tree, &x->piece,
+                                    (from > begin) ? from - begin : 0,
+                                    offset, &cuts[i].first);
+                }
+
+                from = cuts[i].pos;
+        }
+}
+
+/*¶ The cuts must be sorted by offset.  By the time that we make a cut, the
+piece that it falls within has already been cut at any earlier offsets that
+fall within it as well, so the first half begins at the latest of them. */
+
+
+/*¶ Taking the tree apart at a number of cuts moves it on to a new generation,
+just as \C{apply_edits} does, as the nodes that we pass are moved around and
+the nodes in between the cuts may leave the tree altogether.  Iterators into
+the tree are thus invalidated: */
+
+static int
+black_height(Node const *node)
+{
+        int height = 0;
+        for ( ; node != pt_null; node = node->left)
+                if (node->color == BLACK)
+                        height++;
+
+        return height;
+}
+
+
+static void
+split_cuts(PieceTree *tree, Cut const *cuts, int n, Subtree *parts)
+{
+        tree->restored = ++tree->generation;
+        tree->modifications++;
+
+        Subtree rest = {
+                tree->root, black_height(tree->root),
+                tree->size, tree->lines, tree->chars, tree->ascii
+        };
+        tree->root = pt_null;
+
+        off_t at = 0;
+        for (int i = 0; i < n; i++) {
+                Subtree whole = rest;
+                split(tree, &whole, cuts[i].pos - at,
+                      cuts[i].within ? &cuts[i].first : NULL, &parts[i], &rest);
+                at = cuts[i].pos;
+        }
+        parts[n] = rest;
+}
+
+
+static void
+set_root(PieceTree *tree, Subtree const *whole)
+{
+        Subtree t = *whole;
+        blacken(tree, &t);
+        if (t.root != pt_null)
+                t.root->parent = NULL;
+
+        tree->root = t.root;
+        tree->size = t.size;
+        tree->lines = t.lines;
+        tree->chars = t.chars;
+        tree->ascii = t.ascii;
+}
+
+
+/*
+ * call-seq:
+ *      tree.delete(range) → self
+ *
+ * Delete the symbols from <tt>range.begin</tt> up to, but not including,
+ * <tt>range.end</tt> from _tree_ in O(lg _n_) time, no matter how many pieces
+ * they span.  Pieces that the ends of _range_ fall within are cut in two.  An
+ * end beyond the end of _tree_ is taken to be the end of _tree_.  Any
+ * PieceTree::Iterator’s into _tree_ are invalidated.
+ *
+ * Raises a RangeError if <tt>range.begin</tt> is outside of _tree_.
+ *
+ *      tree.delete(10...20)    ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_delete(VALUE self, VALUE range)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        Cut cuts[2];
+        range_to_pos(tree, range, &cuts[0].pos, &cuts[1].pos);
+        if (cuts[1].pos <= cuts[0].pos)
+                return self;
+
+        measure_cuts(tree, cuts, 2);
+
+        Subtree parts[3];
+        split_cuts(tree, cuts, 2, parts);
+        node_unref(tree->pool, parts[1].root);
+        Subtree rest;
+        concat(tree, &parts[0], &parts[2], &rest);
+        set_root(tree, &rest);
+        marks_replace(tree->marks, cuts[0].pos, cuts[1].pos - cuts[0].pos, 0);
+
+        tree->fragments++;
+        if (fragmented(tree))
+                compact(tree);
+
+        return self;
+}
+
+/*¶ Pieces of size zero at the beginning of the range are kept and those at
+its end are deleted, as they go with what comes before them. */
+
+
+/*¶ Moving a range to another offset is done by cutting the tree at the ends of
+the range and at the offset, and swapping the two parts in the middle: */
+
+/*
+ * call-seq:
+ *      tree.move(range, pos) → self
+ *
+ * Move the symbols from <tt>range.begin</tt> up to, but not including,
+ * <tt>range.end</tt> so that they begin at offset _pos_ in _tree_ as it is
+ * before the move, in O(lg _n_) time, no matter how many pieces they span.
+ * Any PieceTree::Iterator’s into _tree_ are invalidated.
+ *
+ * Raises a RangeError if <tt>range.begin</tt> or _pos_ is outside of _tree_
+ * and an ArgumentError if _pos_ lies within _range_.
+ *
+ *      tree.move(10...20, 0)   ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_move(VALUE self, VALUE range, VALUE rbpos)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        off_t begin, end;
+        range_to_pos(tree, range, &begin, &end);
+        off_t pos = check_pos(tree, rbpos);
+        if (end <= begin || pos == begin || pos == end)
+                return self;
+        if (pos > begin && pos < end)
+                rb_raise(rb_eArgError, "can't move a range into itself");
+
+        Cut cuts[3];
+        cuts[0].pos = (pos < begin) ? pos : begin;
+        cuts[1].pos = (pos < begin) ? begin : end;
+        cuts[2].pos = (pos < begin) ? end : pos;
+        measure_cuts(tree, cuts, 3);
+
+        Subtree parts[4];
+        split_cuts(tree, cuts, 3, parts);
+        Subtree t;
+        concat(tree, &parts[0], &parts[2], &t);
+        concat(tree, &t, &parts[1], &t);
+        concat(tree, &t, &parts[3], &t);
+        set_root(tree, &t);
+        marks_move(tree->marks, begin, end, pos);
+
+        tree->fragments += 3;
+        if (fragmented(tree))
+                compact(tree);
+
+        return self;
+}
+
+
+/*¶ Copying a range copies the pieces that it spans, not their contents.  We
+first gather copies of them, cutting the ones at the ends of the range down to
+size: */
+
+static size_t
+copy_pieces(PieceTree const * const tree, off_t begin, off_t end,
+            Piece *pieces)
+{
+        NodePath path;
+        off_t offset = begin;
+        Node *x = find_node(tree, &offset, &path);
+        size_t n = 0;
+        for (off_t at = begin - offset; x != NULL && at < end;
+             at += x->piece.size, x = node_path_next(&path)) {
+                if (x->piece.size == 0)
+                        continue;
+
+                if (pieces != NULL)
+                        slice_piece(tree, &x->piece,
+                                    (begin > at) ? begin - at : 0,
+                                    (end < at + x->piece.size) ?
+                                    end - at : x->piece.size,
+                                    &pieces[n]);
+                n++;
+        }
+
+        return n;
+}
+
+/*¶ Passing \C{NULL} for \C{pieces} simply counts them, so that we know how
+much room to make for them. */
+
+
+/*¶ The copies are then built into a balanced tree of their own, see
+\C{node_build}, which is joined into the tree at the given offset.  This takes
+time linear in the number of pieces copied, rather than in the size of the
+tree: */
+
+/*
+ * call-seq:
+ *      tree.copy(range, pos) → self
+ *
+ * Insert a copy of the symbols from <tt>range.begin</tt> up to, but not
+ * including, <tt>range.end</tt> at offset _pos_ in _tree_ as it is before the
+ * copy.  Only the pieces that _range_ spans are copied, not their contents.
+ * Any PieceTree::Iterator’s into _tree_ are invalidated.
+ *
+ * Raises a RangeError if <tt>range.begin</tt> or _pos_ is outside of _tree_.
+ *
+ *      tree.copy(10...20, 0)   ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_copy(VALUE self, VALUE range, VALUE rbpos)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        off_t begin, end;
+        range_to_pos(tree, range, &begin, &end);
+        Cut cut = { .pos = check_pos(tree, rbpos) };
+        if (end <= begin)
+                return self;
+
+        size_t n = copy_pieces(tree, begin, end, NULL);
+        volatile VALUE pieces_buf = rb_str_new(NULL, n * sizeof(Piece));
+        Piece *pieces = (Piece *)RSTRING(pieces_buf)->ptr;
+        copy_pieces(tree, begin, end, pieces);
+        measure_cuts(tree, &cut, 1);
+
+        Subtree parts[2];
+        split_cuts(tree, &cut, 1, parts);
+
+        Piece sum;
+        Node *root = node_build(tree->pool, pieces, n, tree->generation, &sum);
+        Subtree copy = {
+                root, black_height(root), sum.size, sum.lines, sum.chars,
+                sum.ascii
+        };
+        Subtree t;
+        concat(tree, &parts[0], &copy, &t);
+        concat(tree, &t, &parts[1], &t);
+        set_root(tree, &t);
+        marks_replace(tree->marks, cut.pos, 0, copy.size);
+
+        tree->fragments += n + 2;
+        if (fragmented(tree))
+                compact(tree);
+
+        return self;
+}
+
+
+/*¶ Marks are created at a given offset in the tree.  As snapshots never
+change, there’s no point in marking them: */
+
+/*
+ * call-seq:
+ *      tree.mark(bignum, gravity = :left) → mark
+ *
+ * Create a new PieceTree::Mark at offset _bignum_ in _tree_ that follows along
+ * with the edits made to _tree_.  Something that is inserted right at the mark
+ * ends up after it if _gravity_ is :left and before it if it is :right.
+ *
+ * Raises a TypeError if _tree_ is a snapshot and a RangeError if _bignum_ is
+ * outside of _tree_.
+ *
+ *      tree.mark(10)           ⇒ <PieceTree::Mark:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_new_mark(int argc, VALUE *argv, VALUE self)
+{
+        PieceTree *tree;
+        VALUE rbpos, gravity;
+
+        VALUE2PIECETREE(self, tree);
+        check_mutable(tree);
+
+        if (rb_scan_args(argc, argv, "11", &rbpos, &gravity) == 1)
+                gravity = ID2SYM(rb_intern("left"));
+
+        return mark_new(self, check_pos(tree, rbpos), gravity);
+}
+
+
+/*¶ A Ruby idiom is to always provide an \C{each} method that iterates over a
+compound data structure, such as an array or a hash table.  As the piece tree
+is such a data structure, we’ll provide an \C{each} method for it.  We walk
+the tree along a \C{NodePath}, just as \C{extract} does, so that this works for
+snapshots as well.  The block that we yield to may modify the tree, which would
+leave our path pointing at nodes that may no longer be part of it, so we check
+that it hasn’t after every yield: */
+
+static void
+check_unmodified(PieceTree const * const tree, unsigned int modifications)
+{
+        if (tree->modifications != modifications)
+                rb_raise(rb_eRuntimeError, "tree modified during iteration");
+}
+
+
+/*
+ * call-seq:
+ *      tree.each{ |piece| … } → self
+ *
+ * Iterate over the Piece's in _tree_.
+ *
+ * Raises a RuntimeError if the block modifies _tree_.
+ *
+ *      tree.each{ |piece| p piece}
+ *                              ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_each(VALUE self)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        unsigned int modifications = tree->modifications;
+        NodePath path;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path)) {
+                rb_yield(PIECE2VALUE(&x->piece));
+                check_unmodified(tree, modifications);
+        }
+
+        return self;
+}
+
+
+/*¶ Most of the time, we’re only interested in the pieces that make up some
+part of the sequence, such as the contents of point.  Walking the whole tree to
+find them would be a waste, so we begin with the node that contains the
+beginning of the range, as \C{extract} does, and stop once we have passed its
+end.  We also don’t wrap each piece in a Ruby object of its own, as our callers
+only want to know where its contents are to be found and where it is in the
+sequence, and all that can be passed as plain numbers. */
+
+/*
+ * call-seq:
+ *      tree.each_in(range){ |origin, offset, size, pos| … } → self
+ *
+ * Iterate over the pieces in _tree_ that overlap the symbols from
+ * <tt>range.begin</tt> up to, but not including, <tt>range.end</tt>.  For each
+ * piece, its _origin_, _offset_, and _size_ are yielded, along with the
+ * position _pos_ in _tree_ at which it begins.  Pieces of size zero don’t
+ * overlap anything, so they are skipped.  An end beyond the end of _tree_
+ * is taken to be the end of _tree_.
+ *
+ * Raises a RangeError if <tt>range.begin</tt> is outside of _tree_ and a
+ * RuntimeError if the block modifies _tree_.
+ *
+ *      tree.each_in(10..20){ |origin, offset, size, pos| … }
+ *                              ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_each_in(VALUE self, VALUE range)
+{
+        PieceTree *tree;
+
+        VALUE2PIECETREE(self, tree);
+
+        off_t begin, end;
+        range_to_pos(tree, range, &begin, &end);
+
+        unsigned int modifications = tree->modifications;
+        NodePath path;
+        off_t offset = begin;
+        Node *x = find_node(tree, &offset, &path);
+        for (off_t pos = begin - offset; x != NULL && pos < end;
+             pos += x->piece.size, x = node_path_next(&path)) {
+                if (x->piece.size == 0)
+                        continue;
+
+                rb_yield_values(4,
+                                piece_origin_to_value(x->piece.origin),
+                                OFFT2NUM(x->piece.offset),
+                                OFFT2NUM(x->piece.size),
+                                OFFT2NUM(pos));
+                check_unmodified(tree, modifications);
+        }
 
         return self;
 }
@@ -238,9 +2535,11 @@ piece_tree_inspect(VALUE self)
 
         char buf[INSPECT_BUFFER_SIZE];
         int len = snprintf(buf, INSPECT_BUFFER_SIZE,
-                           "#<PieceTree:%p size=%jd>",
+                           "#<PieceTree:%p size=%jd lines=%jd chars=%jd>",
                            tree,
-                           (intmax_t)tree->size);
+                           (intmax_t)tree->size,
+                           (intmax_t)tree->lines,
+                           (intmax_t)tree->chars);
         return rb_str_new(buf, len);
 }
 
@@ -259,17 +2558,55 @@ Init_piecetree(void)
         g_cPieceTree = rb_define_class("PieceTree", rb_cData);
         rb_define_alloc_func(g_cPieceTree, piece_tree_s_allocate);
         rb_define_private_method(g_cPieceTree, "initialize",
-                                 piece_tree_initialize, 0);
+                                 piece_tree_initialize, 2);
+        rb_define_singleton_method(g_cPieceTree, "from_pieces",
+                                   piece_tree_s_from_pieces, -1);
 
         rb_include_module(g_cPieceTree, rb_mEnumerable);
 
+        rb_define_method(g_cPieceTree, "add_source", piece_tree_add_source,
+                         1);
+        rb_define_method(g_cPieceTree, "source", piece_tree_source, 1);
         rb_define_method(g_cPieceTree, "new_iter", piece_tree_new_iter, 1);
         rb_define_method(g_cPieceTree, "[]", piece_tree_new_iter, 1);
         rb_define_method(g_cPieceTree, "size", piece_tree_get_size, 0);
         rb_define_method(g_cPieceTree, "size=", piece_tree_set_size, 1);
+        rb_define_method(g_cPieceTree, "lines", piece_tree_get_lines, 0);
+        rb_define_method(g_cPieceTree, "chars", piece_tree_get_chars, 0);
+        rb_define_method(g_cPieceTree, "extract", piece_tree_extract, 2);
+        rb_define_method(g_cPieceTree, "chunk", piece_tree_chunk, 3);
+        rb_define_method(g_cPieceTree, "line_offset", piece_tree_line_offset,
+                         1);
+        rb_define_method(g_cPieceTree, "line_at", piece_tree_line_at, 1);
+        rb_define_method(g_cPieceTree, "char_to_byte",
+                         piece_tree_char_to_byte, 1);
+        rb_define_method(g_cPieceTree, "byte_to_char",
+                         piece_tree_byte_to_char, 1);
+        rb_define_method(g_cPieceTree, "ascii?", piece_tree_ascii_p, 2);
+        rb_define_method(g_cPieceTree, "snapshot", piece_tree_snapshot, 0);
+        rb_define_method(g_cPieceTree, "snapshot?", piece_tree_snapshot_p, 0);
+        rb_define_method(g_cPieceTree, "version", piece_tree_version, 0);
+        rb_define_method(g_cPieceTree, "restore", piece_tree_restore, 1);
+        rb_define_method(g_cPieceTree, "apply_edits", piece_tree_apply_edits,
+                         1);
+        rb_define_method(g_cPieceTree, "insert", piece_tree_insert, -1);
+        rb_define_method(g_cPieceTree, "delete_at", piece_tree_delete_at, 1);
+        rb_define_method(g_cPieceTree, "delete", piece_tree_delete, 1);
+        rb_define_method(g_cPieceTree, "move", piece_tree_move, 2);
+        rb_define_method(g_cPieceTree, "copy", piece_tree_copy, 2);
+        rb_define_method(g_cPieceTree, "compact", piece_tree_compact, 0);
+        rb_define_method(g_cPieceTree, "fragmented?", piece_tree_fragmented_p,
+                         0);
+        rb_define_method(g_cPieceTree, "mark", piece_tree_new_mark, -1);
         rb_define_method(g_cPieceTree, "each", piece_tree_each, 0);
+        rb_define_method(g_cPieceTree, "each_in", piece_tree_each_in, 1);
         rb_define_method(g_cPieceTree, "inspect", piece_tree_inspect, 0);
 
         Init_Piece(g_cPieceTree);
         Init_Iterator();
+        Init_Original();
+        Init_Added();
+        Init_Write();
+        Init_Hash();
+        Init_Mark();
 }
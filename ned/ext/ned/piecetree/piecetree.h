@@ -20,10 +20,41 @@ typedef struct _PieceTree PieceTree;
 struct _PieceTree {
         Node *root;
         off_t size;
+        off_t lines;
+        off_t chars;
+        off_t ascii;
+        NodePool *pool;
+        VALUE sources;
+        unsigned int generation;
+        unsigned int restored;
+        bool snapshot;
+        unsigned int modifications;
+        Node *finger;
+        off_t finger_pos;
+        unsigned int finger_modifications;
+        MarkTable *marks;
+        size_t fragments;
+        size_t compacted;
 };
 
 /*¶ The \C{size} is simply the sum of all the sizes of the pieces in the
-tree. */
+tree, \C{lines} is the sum of all their newlines, \C{chars} is the sum of
+all their characters, and \C{ascii} is the sum of all their \ASCII\
+characters.  The \C{pool} is where the nodes of the tree are allocated from.
+The \C{sources} are the files that the pieces of the tree point into, see
+\insection[piecetree:sources].  The next three fields deal with snapshots.
+The \C{generation} is the one that new nodes are created in, \C{restored} is
+the generation in which the tree was last restored from a snapshot, and
+\C{snapshot} is true if this tree is itself a snapshot.  The
+\C{modifications} field counts the changes that have been made to the tree
+that may have moved its pieces around, so that iterators can tell if the
+position that they last calculated is still correct.  The next three fields
+make up our finger: the node that we last found by offset, the offset at which
+it begins, and the value of \C{modifications} at the time, so that we know
+when we can no longer trust it.  Then, \C{marks} is the table of marks that
+the tree keeps up to date, see \insection[piecetree:marks].  Finally,
+\C{fragments} and \C{compacted} tell us when it’s time to merge the pieces of
+the tree, see \C{compact}. */
 
 
 extern VALUE g_cPieceTree;
@@ -31,4 +62,6 @@ extern VALUE g_cPieceTree;
 /*¶ ————————————————————————————————— EOD —————————————————————————————————— */
 
 
+void piece_tree_mark(PieceTree *tree);
 void piece_tree_free(PieceTree *tree);
+VALUE piece_tree_new_iter(VALUE self, VALUE rbpos);
@@ -0,0 +1,289 @@
+/*
+ * contents: Reading the contents of pieces.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#include <ruby.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "source.h"
+#include "original.h"
+#include "added.h"
+#include "private.h"
+
+
+/*¶ The add||file is usually a \C{PieceTree::Added}, see
+\insection[piecetree:added], and otherwise a string, so reading from it is
+simple.  In the same manner, the original file, and any other file that has
+been added to the sources of the tree, is usually a \C{PieceTree::Original},
+see \insection[piecetree:original], which reads itself.  Anything else is
+only required to respond to \C{[]}, so we have to ask it for the blocks that
+we want: */
+
+static void
+source_read_file(VALUE original, off_t offset, off_t len, SourceFunc func,
+                 void *closure)
+{
+        static ID id_aref = 0;
+
+        if (RTEST(rb_obj_is_kind_of(original, g_cOriginal))) {
+                Original *o;
+
+                VALUE2ORIGINAL(original, o);
+                original_read(o, offset, len, func, closure);
+                return;
+        }
+
+        if (id_aref == 0)
+                id_aref = rb_intern("[]");
+
+        while (len > 0) {
+                off_t n = (len > SOURCE_BLOCK_SIZE) ? SOURCE_BLOCK_SIZE : len;
+
+                VALUE str = rb_funcall(original, id_aref, 2,
+                                       OFFT2NUM(offset), OFFT2NUM(n));
+                StringValue(str);
+                if (RSTRING(str)->len < n)
+                        rb_raise(rb_eIndexError,
+                                 "piece extends beyond end of original file");
+
+                if (!func(RSTRING(str)->ptr, n, closure))
+                        return;
+
+                offset += n;
+                len -= n;
+        }
+}
+
+
+static void
+source_read_added(VALUE added, off_t offset, off_t len, SourceFunc func,
+                  void *closure)
+{
+        if (RTEST(rb_obj_is_kind_of(added, g_cAdded))) {
+                Added *a;
+
+                VALUE2ADDED(added, a);
+                added_read(a, offset, len, func, closure);
+                return;
+        }
+
+        StringValue(added);
+        if (offset + len > RSTRING(added)->len)
+                rb_raise(rb_eIndexError,
+                         "piece extends beyond end of add-file");
+
+        func(RSTRING(added)->ptr + offset, len, closure);
+}
+
+
+/*¶ The origin of a piece is an index into the sources of its tree, see
+\insection[piecetree:sources], which our users may get wrong: */
+
+HIDDEN VALUE
+source_get(PieceTree const *tree, PieceOrigin origin)
+{
+        if (origin >= (PieceOrigin)RARRAY(tree->sources)->len)
+                rb_raise(rb_eIndexError, "no source %u in piece tree", origin);
+
+        return RARRAY(tree->sources)->ptr[origin];
+}
+
+
+/*¶ Reading the contents of a piece is then a matter of dispatching on its
+origin.  The \C{offset} is relative to the beginning of the piece: */
+
+HIDDEN void
+source_read(PieceTree const *tree, Piece const *piece, off_t offset,
+            off_t len, SourceFunc func, void *closure)
+{
+        assert(offset >= 0 && offset + len <= piece->size);
+
+        VALUE source = source_get(tree, piece->origin);
+        if (len == 0)
+                return;
+
+        if (piece->origin == ADDED)
+                source_read_added(source, piece->offset + offset, len, func,
+                                  closure);
+        else
+                source_read_file(source, piece->offset + offset, len, func,
+                                 closure);
+}
+
+/*¶ The origin is checked even if there’s nothing to read, so that a piece
+with a bad origin never makes it into a tree. */
+
+
+/*¶ We also need to know how large the add||file is, so that we can check
+pieces that are about to point into it: */
+
+HIDDEN off_t
+source_added_size(PieceTree const *tree)
+{
+        VALUE source = source_get(tree, ADDED);
+
+        if (RTEST(rb_obj_is_kind_of(source, g_cAdded))) {
+                Added *added;
+
+                VALUE2ADDED(source, added);
+                return added_size(added);
+        }
+
+        return RSTRING(source)->len;
+}
+
+
+/*¶ A piece that is handed to us along with its counts is never read, so
+nothing else makes sure that it points into one of our sources.  We check its
+origin, and its extent against any source whose size we know without reading
+it: */
+
+HIDDEN void
+source_check(PieceTree const *tree, Piece const *piece)
+{
+        VALUE source = source_get(tree, piece->origin);
+        off_t end = piece->offset + piece->size;
+
+        if (piece->origin == ADDED) {
+                if (end > source_added_size(tree))
+                        rb_raise(rb_eIndexError,
+                                 "piece extends beyond end of add-file");
+        } else if (RTEST(rb_obj_is_kind_of(source, g_cOriginal))) {
+                Original *original;
+
+                VALUE2ORIGINAL(source, original);
+                if (end > original_size(original))
+                        rb_raise(rb_eIndexError,
+                                 "piece extends beyond end of original file");
+        }
+}
+
+
+/*¶ The first use that we have for reading pieces is measuring them: */
+
+#define is_char_start(c)        (((unsigned char)(c) & 0xc0) != 0x80)
+#define is_ascii(c)             (((unsigned char)(c) & 0x80) == 0)
+
+
+static bool
+measure_block(char const *p, size_t len, void *closure)
+{
+        Measure *measure = closure;
+        char const *end = p + len;
+
+        for (char const *q = p; (q = memchr(q, '\n', end - q)) != NULL; q++)
+                measure->lines++;
+
+        for ( ; p < end; p++) {
+                if (is_char_start(*p))
+                        measure->chars++;
+                if (is_ascii(*p))
+                        measure->ascii++;
+        }
+
+        return true;
+}
+
+
+HIDDEN void
+source_measure(PieceTree const *tree, Piece const *piece, off_t offset,
+               off_t len, Measure *measure)
+{
+        measure->lines = 0;
+        measure->chars = 0;
+        measure->ascii = 0;
+
+        source_read(tree, piece, offset, len, measure_block, measure);
+}
+
+
+/*¶ The second is finding the offset within a piece at which its $n$th line
+begins, i.e., the offset right after its $n$th newline: */
+
+typedef struct _FindClosure FindClosure;
+
+struct _FindClosure {
+        off_t n;
+        off_t offset;
+};
+
+
+static bool
+find_line(char const *p, size_t len, void *closure)
+{
+        FindClosure *c = closure;
+        char const *begin = p;
+        char const *end = p + len;
+
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+                p++;
+                if (--c->n == 0) {
+                        c->offset += p - begin;
+                        return false;
+                }
+        }
+
+        c->offset += len;
+
+        return true;
+}
+
+
+HIDDEN off_t
+source_find_line(PieceTree const *tree, Piece const *piece, off_t n)
+{
+        assert(n > 0 && n <= piece->lines);
+
+        FindClosure closure = { n, 0 };
+
+        source_read(tree, piece, 0, piece->size, find_line, &closure);
+
+        assert(closure.n == 0);
+
+        return closure.offset;
+}
+
+
+/*¶ The third is finding the offset within a piece at which its $n$th
+character begins, counting from zero: */
+
+static bool
+find_char(char const *p, size_t len, void *closure)
+{
+        FindClosure *c = closure;
+
+        for (size_t i = 0; i < len; i++)
+                if (is_char_start(p[i]) && c->n-- == 0) {
+                        c->offset += i;
+                        return false;
+                }
+
+        c->offset += len;
+
+        return true;
+}
+
+
+HIDDEN off_t
+source_find_char(PieceTree const *tree, Piece const *piece, off_t n)
+{
+        assert(n >= 0 && n < piece->chars);
+
+        FindClosure closure = { n, 0 };
+
+        source_read(tree, piece, 0, piece->size, find_char, &closure);
+
+        assert(closure.n < 0);
+
+        return closure.offset;
+}
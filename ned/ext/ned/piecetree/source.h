@@ -0,0 +1,67 @@
+/*
+ * contents: Reading the contents of pieces.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:sources]{Getting at the contents of pieces.}
+
+A piece is only a descriptor of a span within one of the files that a piece
+tree is made up of.  Most of the time the tree doesn’t care about what that
+span contains, but some information, like the number of lines within a piece,
+must be derived from it.  We thus need a way of reading the contents of a
+piece.  As a piece may be very large|<|think of the initial piece of a
+multi||gigabyte file|>|we don’t want to read it all at once, so instead we
+read it one block at a time, handing each block to a function: */
+
+typedef bool (*SourceFunc)(char const *p, size_t len, void *closure);
+
+/*¶ The function may return \C{false} to stop reading, which is useful when
+we’re looking for something within a piece and have found it.  Blocks read
+from the original file are at most this many bytes long: */
+
+#define SOURCE_BLOCK_SIZE       (1 << 16)
+
+/*¶ What we mostly read pieces for is to measure them, i.e., to count the
+number of newlines, the number of characters, and the number of \ASCII\
+characters that they contain: */
+
+typedef struct _Measure Measure;
+
+struct _Measure {
+        off_t lines;
+        off_t chars;
+        off_t ascii;
+};
+
+/*¶ Text is assumed to be encoded in UTF||8, and a character is counted for
+each byte that begins a UTF||8 sequence, i.e., each byte that isn’t a
+continuation byte.  For valid UTF||8 this is the same thing as counting code
+points, but unlike decoding the text, it gives the same result no matter where
+we split it.  That’s important, as pieces are split at byte offsets and may
+thus very well be split in the middle of a character. */
+
+
+/*¶ A tree reads the contents of its pieces from a table of sources.  The first
+one is always the original file and the second one is always the add||file,
+but any number of other files may follow them, e.g., when the contents of
+another file are inserted into a buffer.  Rather than copying such a file into
+the add||file, we read it just like the original file, mapping it into memory
+if we can, see \insection[piecetree:original], so inserting it only takes a
+single piece that covers all of it.  The origin of a piece is simply its index
+into the table. */
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+VALUE source_get(PieceTree const *tree, PieceOrigin origin);
+void source_read(PieceTree const *tree, Piece const *piece, off_t offset,
+                 off_t len, SourceFunc func, void *closure);
+void source_measure(PieceTree const *tree, Piece const *piece, off_t offset,
+                    off_t len, Measure *measure);
+off_t source_added_size(PieceTree const *tree);
+void source_check(PieceTree const *tree, Piece const *piece);
+off_t source_find_line(PieceTree const *tree, Piece const *piece, off_t n);
+off_t source_find_char(PieceTree const *tree, Piece const *piece, off_t n);
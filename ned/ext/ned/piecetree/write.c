@@ -0,0 +1,708 @@
+/*
+ * contents: Writing the contents of a PieceTree to a file.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE 1
+#endif
+
+#include <ruby.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_UIO_H
+#  include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
+
+#include "piece.h"
+#include "node.h"
+#include "mark.h"
+#include "piecetree.h"
+#include "source.h"
+#include "original.h"
+#include "write.h"
+#include "hash.h"
+#include "private.h"
+
+
+/*¶ A writer knows the tree that it writes and where it writes it to, either a
+file descriptor or, if there is none, an IO object that we have to call upon to
+do the writing for us.  It also knows the file descriptor of the original file
+of the tree, if it has one, whether that file is mapped, and how large it is,
+as we need to know these things about it more often than about the other
+sources of the tree, see \insection[piecetree:sources].  Spans that stay put
+are gathered up until there are \C{WRITER_SPANS} of them, and the first error
+that we run into is kept in \C{error}: */
+
+#define WRITER_SPANS            64
+
+typedef struct _Span Span;
+
+struct _Span {
+        char const *p;
+        size_t len;
+};
+
+typedef struct _Writer Writer;
+
+struct _Writer {
+        PieceTree const *tree;
+        int fd;
+        VALUE io;
+        int original_fd;
+        bool mapped;
+        off_t original_size;
+        Span spans[WRITER_SPANS];
+        int n_spans;
+        int error;
+};
+
+
+static void
+writer_init(Writer *writer, PieceTree const *tree)
+{
+        writer->tree = tree;
+        writer->fd = -1;
+        writer->io = Qnil;
+        writer->original_fd = -1;
+        writer->mapped = false;
+        writer->original_size = 0;
+        writer->n_spans = 0;
+        writer->error = 0;
+
+        VALUE source = source_get(tree, ORIGINAL);
+        if (RTEST(rb_obj_is_kind_of(source, g_cOriginal))) {
+                Original *original;
+
+                VALUE2ORIGINAL(source, original);
+                writer->original_fd = original_fd(original);
+                writer->mapped = original_mapped(original);
+                writer->original_size = original_size(original);
+        }
+}
+
+
+/*¶ Any other source that is a \C{PieceTree::Original} may also have a file
+descriptor that we can copy spans of it from.  This function finds it and tells
+us whether the file is mapped, returning $-1$ if there is no such descriptor: */
+
+static int
+writer_source_fd(Writer const *writer, PieceOrigin origin, bool *mapped)
+{
+        if (origin == ORIGINAL) {
+                *mapped = writer->mapped;
+                return writer->original_fd;
+        }
+
+        *mapped = true;
+        if (origin == ADDED)
+                return -1;
+
+        VALUE source = source_get(writer->tree, origin);
+        if (!RTEST(rb_obj_is_kind_of(source, g_cOriginal))) {
+                *mapped = false;
+                return -1;
+        }
+
+        Original *original;
+        VALUE2ORIGINAL(source, original);
+        *mapped = original_mapped(original);
+
+        return original_fd(original);
+}
+
+/*¶ The add||file counts as mapped here, as its contents stay put while we
+write them.  Anything that isn’t an original file, on the other hand, is read
+through Ruby, so it doesn’t. */
+
+
+/*¶ Writing may be interrupted before everything has been written, in which
+case we simply go on from where it stopped.  The file descriptor may also be
+non||blocking, e.g., for a pipe, in which case we let other threads run until
+it’s ready for more: */
+
+static bool
+writer_retry(Writer *writer)
+{
+        if (errno == EINTR)
+                return true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                rb_thread_fd_writable(writer->fd);
+                return true;
+        }
+
+        writer->error = errno;
+        return false;
+}
+
+
+static bool
+write_all(Writer *writer, char const *p, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(writer->fd, p, len);
+                if (n == -1) {
+                        if (writer_retry(writer))
+                                continue;
+                        return false;
+                }
+
+                p += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+
+/*¶ The spans that we have gathered are written with a single call to
+\C{writev}, if we have it: */
+
+static bool
+writer_flush(Writer *writer)
+{
+        int n_spans = writer->n_spans;
+
+        writer->n_spans = 0;
+#ifdef HAVE_SYS_UIO_H
+        struct iovec iov[WRITER_SPANS];
+        for (int i = 0; i < n_spans; i++) {
+                iov[i].iov_base = (void *)writer->spans[i].p;
+                iov[i].iov_len = writer->spans[i].len;
+        }
+
+        int first = 0;
+        while (first < n_spans) {
+                ssize_t n = writev(writer->fd, iov + first, n_spans - first);
+                if (n == -1) {
+                        if (writer_retry(writer))
+                                continue;
+                        return false;
+                }
+
+                while (first < n_spans && (size_t)n >= iov[first].iov_len)
+                        n -= iov[first++].iov_len;
+                if (first < n_spans) {
+                        iov[first].iov_base = (char *)iov[first].iov_base + n;
+                        iov[first].iov_len -= n;
+                }
+        }
+#else
+        for (int i = 0; i < n_spans; i++)
+                if (!write_all(writer, writer->spans[i].p,
+                               writer->spans[i].len))
+                        return false;
+#endif
+
+        return true;
+}
+
+
+/*¶ Spans are handed to us by \C{source_read}.  If we have no file descriptor
+to write to, we let the IO object write them right away: */
+
+static bool
+gather(char const *p, size_t len, void *closure)
+{
+        static ID id_write = 0;
+        Writer *writer = (Writer *)closure;
+
+        if (writer->fd == -1) {
+                if (id_write == 0)
+                        id_write = rb_intern("write");
+                rb_funcall(writer->io, id_write, 1, rb_str_new(p, len));
+                return true;
+        }
+
+        if (len == 0)
+                return true;
+        if (writer->n_spans == WRITER_SPANS && !writer_flush(writer))
+                return false;
+        writer->spans[writer->n_spans++] = (Span){ p, len };
+
+        return true;
+}
+
+
+/*¶ Blocks of a file that isn’t mapped are read through Ruby, and
+each one may be thrown away as soon as we ask for the next, so those are
+written as soon as we get them: */
+
+static bool
+gather_now(char const *p, size_t len, void *closure)
+{
+        return gather(p, len, closure) && writer_flush((Writer *)closure);
+}
+
+
+/*¶ Spans of a file that we have a file descriptor for can be copied by the
+kernel, without ever passing through our hands, using \C{copy_file_range} or
+\C{sendfile}.  Neither works for every pair of files, so if one of them fails,
+we try the next, and if all else fails, we read the span with \C{pread} and
+write it ourselves.  Any part of the span that one of them managed to copy
+before failing is skipped by the next: */
+
+static bool
+copy_span(Writer *writer, int fd, off_t offset, off_t len)
+{
+        if (!writer_flush(writer))
+                return false;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        while (len > 0) {
+                loff_t in = offset;
+                ssize_t n = copy_file_range(fd, &in, writer->fd, NULL, len,
+                                            0);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+
+                offset += n;
+                len -= n;
+        }
+#endif
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+        while (len > 0) {
+                off_t in = offset;
+                ssize_t n = sendfile(writer->fd, fd, &in, len);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+
+                offset += n;
+                len -= n;
+        }
+#endif
+
+        char buf[SOURCE_BLOCK_SIZE];
+        while (len > 0) {
+                size_t want = (len > SOURCE_BLOCK_SIZE) ?
+                        SOURCE_BLOCK_SIZE : len;
+                ssize_t n = pread(fd, buf, want, offset);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        writer->error = errno;
+                        return false;
+                }
+                if (n == 0) {
+                        writer->error = EIO;
+                        return false;
+                }
+                if (!write_all(writer, buf, n))
+                        return false;
+
+                offset += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+/*¶ Reaching the end of the file before the end of the span means
+that someone has truncated it behind our backs, which is as much of an I/O
+error as any. */
+
+
+/*¶ Now, each piece is written in the way that suits it best.  Copying a span
+with the kernel costs a system call of its own, so short spans of a mapped
+file are better off being gathered with the rest: */
+
+#define WRITER_COPY_MIN         (1 << 16)
+
+static bool
+write_piece(Writer *writer, Piece const *piece)
+{
+        bool mapped;
+        int fd = writer_source_fd(writer, piece->origin, &mapped);
+
+        if (writer->fd != -1 && fd != -1 &&
+            (!mapped || piece->size >= WRITER_COPY_MIN))
+                return copy_span(writer, fd, piece->offset, piece->size);
+
+        source_read(writer->tree, piece, 0, piece->size,
+                    mapped ? gather : gather_now, writer);
+
+        return writer->error == 0;
+}
+
+
+/*¶ The pieces are written in order, skipping those before \C{from}, which is
+always at the beginning of a piece: */
+
+static void
+write_pieces(Writer *writer, off_t from)
+{
+        NodePath path;
+        off_t at = 0;
+        for (Node *x = node_path_first(&path, writer->tree->root); x != NULL;
+             x = node_path_next(&path)) {
+                if (at >= from && !write_piece(writer, &x->piece))
+                        return;
+                at += x->piece.size;
+        }
+
+        writer_flush(writer);
+}
+
+
+/*¶ If the tree begins with the whole of its original file, in order, then
+everything that has been done to it has been done after the end of the file.
+This function tells us how much of the original file the tree begins with: */
+
+static off_t
+unchanged_prefix(PieceTree const * const tree)
+{
+        NodePath path;
+        off_t at = 0;
+        for (Node *x = node_path_first(&path, tree->root); x != NULL;
+             x = node_path_next(&path)) {
+                if (x->piece.size == 0)
+                        continue;
+                if (x->piece.origin != ORIGINAL || x->piece.offset != at)
+                        break;
+                at += x->piece.size;
+        }
+
+        return at;
+}
+
+
+static bool
+same_file(struct stat const *st, int fd)
+{
+        struct stat other;
+
+        return fd != -1 && fstat(fd, &other) == 0 &&
+                st->st_dev == other.st_dev && st->st_ino == other.st_ino;
+}
+
+
+/*¶ Every file that the tree reads from must be kept from harm, not just the
+original one: */
+
+static bool
+is_source_file(Writer const *writer, struct stat const *st)
+{
+        long n = RARRAY(writer->tree->sources)->len;
+        for (long origin = 0; origin < n; origin++) {
+                bool mapped;
+                if (same_file(st, writer_source_fd(writer, origin, &mapped)))
+                        return true;
+        }
+
+        return false;
+}
+
+
+/*¶ A tree may also have the same contents as its original file even though
+its pieces say otherwise, e.g., after a script has replaced some text with
+the very same text.  Hashing the tree, see \insection[piecetree:hashing], and
+the original file tells us when that isn’t so, but two hashes that agree are
+only very likely to stem from the same contents, and not writing a file that
+has changed would lose what was changed.  We thus also compare the bytes of
+the tree with those of the original file before we decide not to write it.
+Pieces that point to where they are in the original file are the same by
+definition, so only what has been edited is actually read.  We only do this
+for a mapped original file, which we may compare against in place: */
+
+typedef struct _Comparison Comparison;
+
+struct _Comparison {
+        char const *p;
+        bool same;
+};
+
+
+static bool
+compare_block(char const *p, size_t len, void *closure)
+{
+        Comparison *comparison = closure;
+
+        if (memcmp(p, comparison->p, len) != 0) {
+                comparison->same = false;
+                return false;
+        }
+        comparison->p += len;
+
+        return true;
+}
+
+
+static bool
+find_map(char const *p, UNUSED(size_t len), void *closure)
+{
+        *(char const **)closure = p;
+
+        return false;
+}
+
+
+static bool
+same_bytes_as_original(Writer const *writer)
+{
+        PieceTree const *tree = writer->tree;
+        Piece original = { .origin = ORIGINAL, .size = writer->original_size };
+        char const *map = NULL;
+
+        source_read(tree, &original, 0, original.size, find_map, &map);
+
+        NodePath path;
+        off_t pos = 0;
+        for (Node *node = node_path_first(&path, tree->root); node != NULL;
+             node = node_path_next(&path)) {
+                Piece const *piece = &node->piece;
+                if (piece->origin != ORIGINAL || piece->offset != pos) {
+                        Comparison comparison = { map + pos, true };
+                        source_read(tree, piece, 0, piece->size,
+                                    compare_block, &comparison);
+                        if (!comparison.same)
+                                return false;
+                }
+                pos += piece->size;
+        }
+
+        return true;
+}
+
+
+static bool
+same_as_original(Writer const *writer)
+{
+        PieceTree const *tree = writer->tree;
+        Piece original = { .origin = ORIGINAL, .size = writer->original_size };
+
+        if (tree->size != writer->original_size || !writer->mapped)
+                return false;
+
+        Hash a, b;
+        hash_node(tree, tree->root, &a);
+        hash_span(tree, &original, &b);
+
+        return hash_equal(&a, &b) && same_bytes_as_original(writer);
+}
+
+
+/*¶ Writing to a path is the more interesting case.  A file that isn’t one of
+our sources is simply truncated and written anew.  Our sources, however, are
+where the pieces of the tree point, so we mustn’t write over them.  If all
+that has happened to the original file is that something has been added to its
+end, and nobody else has changed its size since we opened it, we append what
+was added to it.  If it has the same contents as the tree, we don’t write
+anything at all.  Otherwise, we write a new file next to it and rename it over
+the original, which keeps the old contents around for as long as we have them
+open.  Either way, the file is closed, and a new file that we didn’t get to
+finish is removed, even if reading the tree raises an exception.
+
+Renaming replaces whatever the path names, so we first resolve any symbolic
+links in it, as otherwise it’s the link that would be replaced by a file of its
+own, leaving the file that it points to as it was.  The new file gets the
+owner and group of the old one, where we are allowed to set them, and its
+permissions, less any set||user||ID and set||group||ID bits if the new file
+ended up being ours.  A hard link, on the other hand, can’t be followed, and
+renaming a file over one of its names would split it into two files, only one
+of which has our changes.  Nor can we write over the file in place, as our
+pieces still point into it.  We thus refuse to replace a source that has more
+than one name and let our caller write it somewhere else: */
+
+typedef struct _Target Target;
+
+struct _Target {
+        Writer *writer;
+        char const *path;
+        char *tmp;
+        off_t from;
+        bool done;
+};
+
+
+static VALUE
+target_write(VALUE arg)
+{
+        Target *target = (Target *)arg;
+
+        write_pieces(target->writer, target->from);
+        target->done = true;
+
+        return Qnil;
+}
+
+
+static VALUE
+target_close(VALUE arg)
+{
+        Target *target = (Target *)arg;
+        Writer *writer = target->writer;
+
+        if (close(writer->fd) == -1 && writer->error == 0)
+                writer->error = errno;
+        writer->fd = -1;
+
+        if (target->tmp == NULL)
+                return Qnil;
+
+        if (target->done && writer->error == 0 &&
+            rename(target->tmp, target->path) == -1)
+                writer->error = errno;
+        if (!target->done || writer->error != 0)
+                unlink(target->tmp);
+
+        return Qnil;
+}
+
+
+static void
+write_to_path(Writer *writer, VALUE rbpath)
+{
+        StringValue(rbpath);
+        Target target = { writer, RSTRING(rbpath)->ptr, NULL, 0, false };
+        volatile VALUE tmp = Qnil;
+        char resolved[PATH_MAX];
+
+        struct stat st;
+        if (stat(target.path, &st) == -1 || !is_source_file(writer, &st)) {
+                writer->fd = open(target.path, O_WRONLY | O_CREAT | O_TRUNC,
+                                  0666);
+        } else if (same_file(&st, writer->original_fd) &&
+                   st.st_size == writer->original_size &&
+                   unchanged_prefix(writer->tree) == writer->original_size) {
+                writer->fd = open(target.path, O_WRONLY);
+                if (writer->fd != -1 &&
+                    lseek(writer->fd, writer->original_size, SEEK_SET) == -1) {
+                        close(writer->fd);
+                        writer->fd = -1;
+                }
+                target.from = writer->original_size;
+        } else if (same_file(&st, writer->original_fd) &&
+                   st.st_size == writer->original_size &&
+                   same_as_original(writer)) {
+                return;
+        } else {
+                if (st.st_nlink > 1)
+                        rb_raise(rb_eArgError,
+                                 "can't replace %s, as it has other hard links",
+                                 target.path);
+                if (realpath(target.path, resolved) == NULL)
+                        rb_sys_fail(target.path);
+                target.path = resolved;
+                tmp = rb_str_new2(resolved);
+                rb_str_cat2(tmp, ".XXXXXX");
+                target.tmp = RSTRING(tmp)->ptr;
+                writer->fd = mkstemp(target.tmp);
+                if (writer->fd != -1) {
+                        mode_t mode = st.st_mode & 07777;
+                        if (fchown(writer->fd, st.st_uid, st.st_gid) == -1)
+                                mode &= 0777;
+                        fchmod(writer->fd, mode);
+                }
+        }
+        if (writer->fd == -1)
+                rb_sys_fail(target.path);
+
+        rb_ensure(target_write, (VALUE)&target, target_close, (VALUE)&target);
+        if (writer->error != 0) {
+                errno = writer->error;
+                rb_sys_fail(target.path);
+        }
+}
+
+
+/*¶ Writing to an IO object is simpler.  If it has a file descriptor, we flush
+whatever it has buffered and write to the descriptor ourselves.  If that
+descriptor is open on one of our sources, however, it’s too late to save it,
+as the file has already been opened for writing behind our backs, so we
+refuse to make matters worse: */
+
+static void
+write_to_io(Writer *writer, VALUE io)
+{
+        static ID id_fileno = 0;
+        static ID id_flush = 0;
+
+        if (id_fileno == 0)
+                id_fileno = rb_intern("fileno");
+        if (id_flush == 0)
+                id_flush = rb_intern("flush");
+
+        writer->io = io;
+        if (rb_respond_to(io, id_fileno)) {
+                VALUE rbfd = rb_funcall(io, id_fileno, 0);
+                if (!NIL_P(rbfd)) {
+                        if (rb_respond_to(io, id_flush))
+                                rb_funcall(io, id_flush, 0);
+                        writer->fd = NUM2INT(rbfd);
+                }
+        }
+
+        struct stat st;
+        if (writer->fd != -1 && fstat(writer->fd, &st) == 0 &&
+            is_source_file(writer, &st))
+                rb_raise(rb_eArgError,
+                         "can't write over a source file through an IO");
+
+        write_pieces(writer, 0);
+        if (writer->error != 0) {
+                errno = writer->error;
+                rb_sys_fail(NULL);
+        }
+}
+
+
+/*
+ * call-seq:
+ *      tree.write_to(io_or_path) → self
+ *
+ * Write the contents of _tree_ to _io_or_path_, which is either an IO object
+ * or the path of a file to create or replace.  Pieces are written one at a
+ * time, and spans of the original file are copied by the kernel where
+ * possible, so the contents of _tree_ never have to fit in memory all at
+ * once.  If _io_or_path_ is the path of the original file of _tree_ and all
+ * that has been done to it is to add to its end, only that is written, and if
+ * _tree_ has the same contents as it, nothing is.  Otherwise, a source of
+ * _tree_ is replaced by a new file, following any symbolic links to it.
+ *
+ * Raises an ArgumentError if _io_or_path_ is an IO object open on the original
+ * file, or any other source, of _tree_, or the path of a source that has more
+ * than one hard link, and a SystemCallError if writing fails.
+ *
+ *      tree.write_to('README') ⇒ <PieceTree:0xdeadbeef …>
+ */
+static VALUE
+piece_tree_write_to(VALUE self, VALUE dest)
+{
+        PieceTree *tree;
+        Writer writer;
+
+        VALUE2PIECETREE(self, tree);
+        writer_init(&writer, tree);
+
+        if (TYPE(dest) == T_STRING)
+                write_to_path(&writer, dest);
+        else
+                write_to_io(&writer, dest);
+
+        return self;
+}
+
+
+HIDDEN void
+Init_Write(void)
+{
+        rb_define_method(g_cPieceTree, "write_to", piece_tree_write_to, 1);
+}
@@ -0,0 +1,26 @@
+/*
+ * contents: Writing the contents of a PieceTree to a file.
+ *
+ * Copyright © 2005 Nikolai Weibull <work@rawuncut.elitemail.org>
+ */
+
+
+
+/*¶ \subsection[piecetree:writing]{Writing a tree to a file.}
+
+Saving a buffer used to mean extracting all of it into one string and writing
+that, which needs as much memory as the file is large, even if only a few
+bytes of it have been changed.  A tree knows where all of its contents are,
+though, so we can write it piece by piece instead.  The contents of the
+add||file and of a mapped original file stay where they are while we write
+them, so we gather them up and write many of them at once.  Long spans of the
+original file don’t even have to pass through our hands, as the kernel can copy
+them from one file to another by itself.  Finally, if all we have done is to
+add something to the end of a file, there’s no need to write anything but
+that. */
+
+
+/*¶ ————————————————————————————————— EOD —————————————————————————————————— */
+
+
+void Init_Write(void);
@@ -7,6 +7,7 @@
 # ¶ Before we begin with our buffer class, we need to load our piece||tree
 # library.
 
+require 'digest/md5'
 require 'ned/piecetree'
 
 
@@ -25,19 +26,36 @@ require 'ned/piecetree'
 class Ned::Buffer::Buffer
 
   # ¶ We begin with an initializer.  We will need a source of input to
-  # represent our original file.  We create an initial piece that points to
-  # this file and set point to point to the beginning of the buffer.
+  # represent our original file.  The piece||tree library provides one that
+  # maps the file into memory when it can, see
+  # \insection[piecetree:original], and an add||file that never moves what
+  # has been appended to it, see \insection[piecetree:added].  We create an
+  # initial piece that points to the original file and set point to point to
+  # the beginning of the buffer.  The piece||tree is told about our two files,
+  # so that it may read the contents of the pieces that it contains.  We also
+  # remember what file we were opened on, see \Ruby{save_session} below.
+  #
+  # Note that opening a buffer is no longer an $\Ordo{1}$ operation.  Inserting
+  # the initial piece makes the piece||tree count the newlines and characters
+  # of the whole original file, see \insection[piecetree:sources], so that
+  # line and character lookups may later be done in $\Ordo{\lg n}$ time.  This
+  # is a single sequential pass over the file, but it’s proportional to its
+  # size all the same.  A buffer restored from a session, see
+  # \Ruby{load_session}, gets its counts from the session file and avoids
+  # this pass.
   def initialize(io = nil)
-    @pieces = PieceTree.new
-    @original = Original.new(io)
-    @added = ''
-
     raise NotImplementedError if io.nil?
 
-    io.seek(0, IO::SEEK_END)
-    @pieces[0].insert(PieceTree::Piece.new(:original, 0, io.pos, 0), :after)
-    iter = @pieces[0]
-    @point = Point.new((0..0), iter, iter)
+    @original = PieceTree::Original.new(io)
+    @identity = identify(io)
+    @added = PieceTree::Added.new
+    @pieces = PieceTree.new(@original, @added)
+
+    unless @original.size.zero?
+      @pieces[0].insert(PieceTree::Piece.new(:original, 0, @original.size, 0),
+                        :after)
+    end
+    @point = Point.new(@pieces.mark(0), @pieces.mark(0))
   end
 
   # ¶ The following two methods deal with updating and retrieving the value of
@@ -51,93 +69,69 @@ class Ned::Buffer::Buffer
   # addresses in our command||language.
   def point=(range)
     case range
-    when Range:   @point.range = range
-    when Integer: @point.range = (range..range)
-    else          @point.range = range.to_point(self)
+    when Range:   r = range
+    when Integer: r = (range..range)
+    else          r = range.to_point(self)
     end
-    @point.first = @point.last = nil
+    @point.first.pos = r.begin
+    @point.last.pos = r.end
     return range
   end
 
-  # ¶ Retrieving the value of point is actually a bit more complicated than one
-  # might guess.  The reason is that we need to make sure that all the
-  # components of point are valid.  As you may have spotted in the getter
-  # above, point consists of three fields, \Ruby{range}, \Ruby{first}, and
-  # \Ruby{last}.  The two last\footnote{Again with the unintentional
-  # repetition\dots.} fields will be made to point to iterators as soon as an
-  # edit takes place at either of the two ends of point.  This is so because an
-  # iterator always points to a node in the piece tree and a node always points
-  # to a piece and a piece always points to a span in one of the two files.
-  # This means that we can make sure that point easily follows along with edits
-  # that take place before it without worrying about updating the range, as we
-  # can simply invalidate it and create it anew from the position of the two
-  # iterators when necessary.  Thus, edits will have to take place at the
-  # boundaries of pieces---creating them first if necessary.  We don’t want to
-  # create new pieces whenever point is moved, though, so this is delayed for
-  # as long as possible.
+  # ¶ Retrieving the value of point is a lot simpler than it used to be.  Point
+  # consists of two marks in the piece||tree, see \insection[piecetree:marks],
+  # \Ruby{first} and \Ruby{last}, one for each end of it.  The tree moves them
+  # along with any edits that take place before them, so we never have to
+  # update them ourselves, and as a mark is nothing but an offset, moving point
+  # around never splits any pieces.  Pieces are only split once an edit
+  # actually takes place in the middle of one of them, see \Ruby{insert}
+  # below.
   def point
-    if @point.range.nil?
-      update_point :first
-      update_point :last
-      @point.range = (@point.first.pos..@point.last.pos)
-    end
-    @point.range
+    (@point.first.pos..@point.last.pos)
   end
 
   # ¶ Our next method extracts a subsequence of our buffer and returns it as a
-  # String object.  This is, a bit surprisingly, a rather complicated
-  # procedure, as we, depending on the parameters that we’re given, need to
-  # first extract a subsequence of the piece that contains the position that we
-  # wish to begin extracting at, then iterate through the tree, appending the
-  # contents of the pieces that we pass to the subsequence, until we don’t want
-  # to retrieve more, in which case we only want to read a subsequence of that
-  # last piece.  We also need to set up an initial state in which to work that
-  # depends heavily on the arguments that we were passed.
+  # String object.  All the hard work of finding the piece that contains the
+  # position that we wish to begin extracting at and then iterating through the
+  # tree, appending the contents of the pieces that we pass to the subsequence,
+  # is done by the piece||tree itself, see \C{PieceTree#extract}.  All we need
+  # to do is to set up the position and length to extract, which depend on the
+  # arguments that we were passed.
   def [](pos, len = nil)
     if pos.is_a? PieceTree::Iterator
-      iter = pos
-      pos = iter.pos
-      len = iter.piece.size if len.nil?
+      len = pos.piece.size if len.nil?
+      pos = pos.pos
     elsif pos.respond_to? :begin and pos.respond_to? :end
-      iter = @pieces[pos.begin]
       len = pos.end - pos.begin
       pos = pos.begin
     else
-      iter = @pieces[pos]
-      while iter.valid? && iter.has_next? && iter.piece.size == 0
-        iter.next
-      end
-      raise Error, "fuck!" unless iter.valid?
       len = 1 if len.nil?
     end
 
-    actual_pos = iter.piece.offset + pos - iter.pos
-    plen = [iter.piece.size - (actual_pos - iter.piece.offset), len].min
-    ret = origin2file(iter.piece.origin)[actual_pos, plen]
-
-    len -= plen
-    while len > 0 and iter.has_next?
-      iter.next
-      plen = [iter.piece.size, len].min
-      ret << origin2file(iter.piece.origin)[iter.piece.offset, plen]
-      len -= plen
-    end
-
-    ret
+    @pieces.extract(pos, len)
   end
 
-  def origin2file(origin)
-    instance_variable_get("@#{origin}")
+  # ¶ Extracting a large part of the buffer into a single string isn’t always
+  # what we want, e.g., when all we are going to do with it is write it
+  # somewhere.  The following method instead yields the contents of point, or
+  # of some other range, one piece at a time.  The piece||tree tells us what
+  # pieces overlap the range and where they are, so all we have to do is cut
+  # off any parts of the first and last pieces that lie outside of it and ask
+  # the source that they point into for the rest.
+  def each_chunk(range = self.point)
+    @pieces.each_in(range) do |origin, offset, size, pos|
+      b = [range.begin - pos, 0].max
+      e = [range.end - pos, size].min
+      yield @pieces.source(origin)[offset + b, e - b]
+    end
+    self
   end
 
-  private :origin2file
-
   # ¶ In the future, it will be possible for zero||sized pieces to appear
   # within the buffer|<|in fact, such pieces will probably not have a size
   # field and there will be some sort of abstraction||layer in place so that we
-  # don’t have to worry about this|>|and we must thus make sure that we find a
-  # piece that actually contains something.  That’s what the first while loop
-  # is for in the previous method.
+  # don’t have to worry about this|>|but as they contribute nothing to the
+  # extracted string, the tree simply walks past them.
   
   # ¶ Now we’ll write a method for inserting a string to the left (before) or
   # right (after) of point.  This is done by adding the contents of the given
@@ -148,123 +142,94 @@ class Ned::Buffer::Buffer
   # lets give them again here, in the context of our implementation.
   #
   # There are, as already stated, two cases to deal with.  Either we insert the
-  # new piece before or after point.  When inserting before point, if the piece
-  # right before the first one in point fulfills the following conditions, we
+  # new piece before or after point, i.e., at its beginning or at its end.
+  # Either way, if the piece that ends at that position, splitting the piece
+  # that it falls within if necessary, fulfills the following conditions, we
   # simply extend the length of it to include the newly added string:
   #
   # \startenumerate
-  #   \item There must be a piece laying before the first one in point
-  #   \item This piece must originate in the add||file
-  #   \item The piece must extend to the end of the add||file, as it was before
-  #     the addition of the contents of the new string
+  #   \item There must be a piece laying before the position
+  #   \item This piece must originate in the same file as the new one, i.e.,
+  #     the add||file
+  #   \item The piece must end where the new one begins, i.e., at the end of
+  #     the add||file, as it was before the addition of the contents of the new
+  #     string
   # \stopenumerate
   #
-  # Complicated, but perhaps it’s easier to see it expressed in code.
+  # Otherwise, we insert a new piece after it or, at the beginning of the
+  # buffer, where there is no such piece, before all the others.
+  #
+  # All this splitting of pieces leaves the tree with more of them than it
+  # needs, so once in a while, when it has become fragmented enough, it merges
+  # them, see \C{PieceTree#compact}.  We hold on to no iterators between
+  # edits, so it is free to do so.
   #
-  # When adding text after point, things get a lot more complicated.  We have
-  # more or less the same rules available to us as for inserting before point,
-  # {\em if} point extends to the end of the buffer.  Otherwise, all we can do
-  # is extend the last piece in point, if it is of length zero.  This happens
-  # very seldom and is perhaps of little merit.
+  # The marks of point stay put when something is inserted right at them, so
+  # text inserted after point stays out of it.  Text inserted before point
+  # should push all of point along, though.
   #
-  # Actually, the first case|<|at the end of the buffer|>|could be seen as a
-  # special case of inserting before a sentinel piece in the piece table,
-  # representing the end of the buffer.  In a future revision, when we will
-  # have many different kinds of pieces in the piece table, for denoting marks
-  # and so on, we can add such a sentinel piece and simplify this code a lot.
+  # Doing all this through iterators took half a dozen calls into the
+  # piece||tree and a couple of iterators, pieces, and ranges for every
+  # insertion, which cost a lot more than the edit itself, so the piece||tree
+  # does it for us in a single call, see \C{PieceTree#insert}.
   def insert(str, where = :before)
+    pos = insertion_point(where)
     @added << str
-
-    case where
-    when :before
-      update_point(:first)
-      prev = @point.first.has_prev? ? @point.first.dup.prev : nil
-      if prev and prev.valid? and prev.piece.origin == :added and
-         prev.piece.offset + prev.piece.size == @added.size - str.size
-        extend_piece(iter, str.size)
-      else
-        add_piece(@point.first.dup, str.size, :before)
-      end
-
-      @point.range = ((@point.range.begin+str.size)..(@point.range.end+str.size))
-    when :after
-      if @point.range.end == @pieces.size
-        iter = @pieces[@pieces.size - 1]
-        if iter and iter.valid? and iter.piece.origin == :added and
-           iter.piece.offset + iter.piece.size == @added.size - str.size
-          extend_piece(iter, str.size)
-        else
-          add_piece(@pieces[@pieces.size - 1], str.size, :after)
-        end
-      else
-        update_point(:last)
-        if @point.first == @point.last and
-           @point.last.piece.origin == :added and @point.last.piece.size == 0
-          extend_piece(@point.last, str.size)
-        else
-          add_piece(@point.last.dup, str.size, :before)
-        end
-      end
-    else
-      raise ArgumentError, "unknown insertion point ‘#{where}’"
-    end
-
-    return self
+    @pieces.insert(pos, :added, @added.size - str.size, str.size,
+                   *pushed_marks(where))
+    self
   end
 
-  # ¶ We need a method that will extend a given iterator’s piece to include the
-  # added string contents:
-  def extend_piece(iter, size)
-    iter.piece.size += size
-    @pieces.size += size
-    iter.fix_size
+  # ¶ Inserting the contents of another file works the same way, but rather
+  # than copying it into the add||file, we add it to the sources of the
+  # piece||tree, see \insection[piecetree:sources], and insert a single piece
+  # that covers all of it.  The file is mapped into memory, just as our
+  # original file is, so inserting even a very large file takes constant time
+  # and memory.  The file must not be changed as long as the buffer is around,
+  # as the piece points right into it.
+  def insert_file(io, where = :before)
+    pos = insertion_point(where)
+    file = PieceTree::Original.new(io)
+    return self if file.size.zero?
+    @pieces.insert(pos, @pieces.add_source(file), 0, file.size,
+                   *pushed_marks(where))
+    self
   end
 
-  # ¶ Inserting a new piece pointing at the add||file is rather straightforward:
-  def add_piece(iter, size, where)
-    iter.insert(PieceTree::Piece.new(:added, @added.size - size, size, 0), where)
+  # ¶ Both of them begin by figuring out where the insertion is to take place:
+  def insertion_point(where)
+    case where
+    when :before then @point.first.pos
+    when :after  then @point.last.pos
+    else raise ArgumentError, "unknown insertion point ‘#{where}’"
+    end
   end
 
-  private :extend_piece, :add_piece
+  # ¶ and which of the marks of point it should push along:
+  def pushed_marks(where)
+    (where == :before) ? [@point.first, @point.last] : []
+  end
 
-  # ¶ Deleting the contents of point is a rather straightforward procedure.  We
-  # must update the first and last fields of point and then decide, based on
-  # their position within the buffer, what to do.  If they are equal, i.e.,
-  # they are at the same position, we assume that our caller wanted to remove
-  # one symbol to the left of point.  Otherwise, we iterate through the pieces
-  # between first and last, deleting them as we go along.
+  private :insertion_point, :pushed_marks
+
+  # ¶ Deleting the contents of point is a rather straightforward procedure.
+  # If point covers a range of the buffer, we let the piece||tree delete it.
+  # It does so by splitting itself at both ends of the range and joining what
+  # remains, which takes $\Ordo{\lg n}$ time no matter how many pieces the
+  # range spans, rather than deleting them one at a time.  Otherwise, i.e., if
+  # point is empty, we assume that our caller wanted to remove the symbol
+  # right after it, so the piece||tree shrinks the piece that contains it, or
+  # deletes it altogether if that is all that it contains, see
+  # \C{PieceTree#delete_at}.  Either way, the tree moves the marks of point to
+  # where the deleted text began.
   def delete
-    update_point(:first)
-    update_point(:last)
-
-    if @point.first == @point.last
-      piece = @point.last.piece
-      if piece.size.zero?
-        raise IndexError, "trying to delete beyond end of buffer"
-      end
-      piece.offset += 1
-      piece.size -= 1
-      @pieces.size -= 1
-      if piece.size == 0
-        last = @point.last.dup
-        @point.last.prev
-        last.delete
-      else
-        @point.last.fix_size
-      end
+    first, last = @point.first.pos, @point.last.pos
+    if last > first
+      @pieces.delete(first...last)
     else
-      pos = @point.first.pos
-      until @point.last.pos == pos
-        prev = @point.first.dup
-        @point.first.next
-        prev.delete
-      end
+      @pieces.delete_at(first)
     end
-
-    # TODO: this can be delayed to actual access of the range
-    @point.range = (@point.first.pos...@point.last.pos)
-
-    return self
+    self
   end
  
   # ¶ There are still some things to decide about the semantics of this method.
@@ -273,12 +238,161 @@ class Ned::Buffer::Buffer
   # above, delete them when we come across them.  This will all depend on what
   # future work brings to the text editor and will be decided at that time.
   # Until then, we remove them, as this makes for a smaller and tidier table.
+  # The tree itself keeps those at the beginning of a deleted range and
+  # removes those at its end, and as we no longer split pieces just because
+  # point has moved, few of them are ever created.
+
+  # ¶ Scripts that perform a batch of edits want to be able to undo all of
+  # them if one of them fails.  The piece||tree can take a snapshot of itself
+  # in constant time and restore itself from it again, so all we have to do is
+  # remember where point was as well.  The add||file is only ever appended to,
+  # so the pieces of the snapshot remain valid.
+  def snapshot
+    Snapshot.new(@pieces.snapshot, point)
+  end
+
+  def restore(snapshot)
+    @pieces.restore(snapshot.pieces)
+    self.point = snapshot.point
+    self
+  end
+
+  # ¶ The following method wraps the two up, rolling back any edits made in
+  # the given block if it raises an exception.
+  def transaction
+    snapshot = self.snapshot
+    begin
+      yield self
+    rescue Exception
+      restore(snapshot)
+      raise
+    end
+  end
+
+  # ¶ Commands that replace every match of a regular expression with the same
+  # thing make a lot of edits at once.  Rather than making them one at a time,
+  # moving point around and splitting pieces for each and every one of them,
+  # we hand them all over to the piece||tree, which makes them all in one pass.
+  # The replacements are given as pairs of a range and the string to replace
+  # its contents with, sorted by position, with ranges that don’t overlap.  All
+  # ranges refer to the buffer as it was before any of the replacements were
+  # made.  Point is left at the text that replaced the first range, which is
+  # where it would be if the replacements had been made one at a time, last
+  # one first.
+  def replace_all(replacements)
+    return self if replacements.empty?
+
+    edits = replacements.map do |range, str|
+      offset = @added.size
+      @added << str
+      [range.begin, range.end - range.begin, offset, str.size]
+    end
+    @pieces.apply_edits(edits)
+
+    first, str = replacements.first
+    self.point = (first.begin..(first.begin + str.size))
+    self
+  end
+
+  # ¶ Reopening a file that we have made a lot of edits to shouldn’t mean
+  # making them all over again.  A session remembers everything that a buffer
+  # adds to its original file: the contents of the add||file, the pieces, and
+  # point.  The original file itself is already on disk, so we only save its
+  # identity, see \Ruby{identify} below, so that we can tell if it has
+  # changed since, in which case the pieces no longer make any sense.
+  # Everything is saved as 32||bit big||endian words, with 64||bit values
+  # split in two, so that sessions may be moved between machines.  The session
+  # is written to a temporary file that is then renamed, so that an old
+  # session is never left half||overwritten.
   #
-  # Another thing to note is that we can actually defer calculating the new
-  # range of point and can save some work in the deletion loop by storing the
-  # positions and keeping track of how much has been removed.  This way of
-  # doing it is a bit more clear and, until some profiling has been done, it
-  # stay the way it is.
+  # Files that have been inserted into the buffer, see \Ruby{insert_file},
+  # may well be gone by the time that the session is loaded, so pieces that
+  # point into them are saved as if they pointed into the add||file, with
+  # their contents saved, one piece at a time, right after those of the
+  # add||file itself.
+  def save_session(path)
+    words = []
+    inserted = []
+    inserted_size = 0
+    @pieces.each do |piece|
+      origin, offset = piece.origin, piece.offset
+      unless origin == :original or origin == :added
+        inserted << [origin, offset, piece.size]
+        origin, offset = :added, @added.size + inserted_size
+        inserted_size += piece.size
+      end
+      words << (origin == :added ? 1 : 0)
+      words.concat(split_words([offset, piece.size, piece.lines, piece.chars,
+                                piece.ascii]))
+    end
+    range = self.point
+    header = split_words(identity + [range.begin, range.end,
+                                      @added.size + inserted_size,
+                                      words.size / 11])
+
+    tmp = path + '.tmp'
+    File.open(tmp, 'wb') do |f|
+      f.write(SessionMagic)
+      f.write(header.pack('N*'))
+      f.write(@added[0, @added.size])
+      inserted.each do |origin, offset, size|
+        f.write(@pieces.source(origin)[offset, size])
+      end
+      f.write(words.pack('N*'))
+    end
+    File.rename(tmp, path)
+    self
+  end
+
+  # ¶ Loading a session is then a matter of opening the original file, making
+  # sure that it’s the same one as before, and filling a new add||file with
+  # what was saved.  The piece||tree is built from all the pieces at once,
+  # which takes linear time, see \C{PieceTree.from_pieces}, rather than
+  # inserting them one at a time.  Each piece is saved along with the number
+  # of newlines, characters, and \ASCII\ characters in it, which the tree
+  # would otherwise have to read the piece to count.  The original file is
+  # mapped into memory as usual, so nothing but the add||file and the pieces
+  # is actually read.
+  def self.load_session(path, io)
+    buffer = allocate
+    buffer.send(:load_session, path, io)
+  end
+
+  def load_session(path, io)
+    data = File.open(path, 'rb') { |f| f.read }
+    if data[0, SessionMagic.size] != SessionMagic
+      raise ArgumentError, "#{path} isn’t a session file"
+    end
+    header = SessionMagic.size + 7 * 8
+    raise ArgumentError, "#{path} is truncated" if data.size < header
+    size, mtime, ino, first, last, added_size, n =
+      join_words(data[SessionMagic.size...header].unpack('N*'))
+    if data.size != header + added_size + n * 44
+      raise ArgumentError, "#{path} is truncated"
+    end
+
+    @original = PieceTree::Original.new(io)
+    @identity = identify(io)
+    if identity != [size, mtime, ino]
+      raise ArgumentError, "original file has changed since #{path} was saved"
+    end
+    @added = PieceTree::Added.new
+    @added << data[header, added_size]
+
+    words = data[header + added_size, n * 44].unpack('N*')
+    counts = []
+    pieces = (0...n).map do |i|
+      offset, len, lines, chars, ascii = join_words(words[11 * i + 1, 10])
+      counts.push(lines, chars, ascii)
+      PieceTree::Piece.new(words[11 * i] == 1 ? :added : :original,
+                           offset, len, 0)
+    end
+    @pieces = PieceTree.from_pieces(@original, @added, pieces, counts)
+    @point = Point.new(@pieces.mark(first), @pieces.mark(last))
+    self
+  end
+
+  private :load_session
 
   # ¶ We now come to the utility functions.  We provide a way for our users to
   # request the size of the buffer through the methods \Ruby{size} and
@@ -301,88 +415,145 @@ class Ned::Buffer::Buffer
     self[0, self.size]
   end
 
+  # ¶ Writing the buffer somewhere is left to the piece||tree, which writes it
+  # one piece at a time, rather than all at once, as \Ruby{to_s} would, see
+  # \insection[piecetree:writing].  We may be given either an IO object or
+  # the path of a file to write to.
+  def write_to(io_or_path)
+    @pieces.write_to(io_or_path)
+    self
+  end
+
   # ¶ Being able to search our buffers is amongst the most important features
   # that we can provide our users.  The interface to the searching capabilities
   # is simple.  All the user has to do is request a scanner that should begin
   # scanning at a given position and, possibly, end at another position.  This
   # scanner can then be used to search the buffer within these parameters.
+  # The scanner reads straight from our piece||tree.
   def new_scanner(pos = self.point.end, end_pos = nil)
     if end_pos and pos > end_pos
       raise ArgumentError, "end_pos must be greater than or equal to pos"
     end
-    Scanner.new(self, pos, end_pos)
+    Scanner.new(@pieces, pos, end_pos)
   end
 
-  # ¶ We actually have a use for such a scanner in our buffer class in
-  # converting line offsets to true offsets.  The idea is that given a line
-  # number, say $5$, we figure out the position of the symbol that begins this
-  # line.  (Actually, the line offsets are zero||based, so it’ll be the symbol
-  # that begins the next line in this case.).  We use a regular expression that
-  # matches lines to do the work for us.  This isn’t going to scale well, but
-  # it is simple and straightforward, so we’ll use it for now.
+  # ¶ A long search over a large buffer shouldn’t keep us from editing it in
+  # the meantime.  The following method instead searches a snapshot of our
+  # piece||tree, which nothing that we do to the buffer can change, in a thread
+  # of its own, see \insection[piecetree:snapshots].  Ruby’s threads are
+  # green threads, so the search doesn’t run alongside our edits, but takes
+  # turns with them, every time that the scanner reads more of the snapshot.
+  # The thread’s value is a \Ruby{SearchResult} that contains the matches, if
+  # any, and the version of the buffer that they were found in, see
+  # \C{PieceTree#version}.  The matches only apply to the buffer if that is
+  # still its \Ruby{version} once the search is done.
+  def background_search(matcher, pos = self.point.end, end_pos = nil)
+    if end_pos and pos > end_pos
+      raise ArgumentError, "end_pos must be greater than or equal to pos"
+    end
+    pieces = @pieces.snapshot
+    Thread.new do
+      SearchResult.new(pieces.version,
+                       Scanner.new(pieces, pos, end_pos).search(matcher))
+    end
+  end
+
+  def version
+    @pieces.version
+  end
+
+  # ¶ We used to have a use for such a scanner in our buffer class in
+  # converting line offsets to true offsets, matching lines with a regular
+  # expression from the beginning of the buffer.  That didn’t scale very well,
+  # so now the piece||tree keeps track of the number of lines in its pieces
+  # instead.  The idea is that given a line number, say $5$, we figure out the
+  # position of the symbol that begins this line.  (Actually, the line offsets
+  # are zero||based, so it’ll be the symbol that begins the next line in this
+  # case.)  The tree can also tell us what line a given position is on.
   def line_offset(n)
     raise ArgumentError, "line numbers must be non-negative" if n < 0
-    s = new_scanner(0)
-    m = PatternMatcher.new("[.*?\\n]<#{n}>")
-    matches = s.search(m)
-    raise RangeError, "line %d beyond end of buffer" % n if matches.nil?
-    matches[0].end
+    @pieces.line_offset(n)
+  end
+
+  def line_at(pos)
+    @pieces.line_at(pos)
+  end
+
+  # ¶ In the same manner, the tree keeps track of the number of characters in
+  # its pieces, so that we can translate between the character offsets used by
+  # our pattern||matcher and the byte offsets used by everything else.
+  def char_to_byte(n)
+    @pieces.char_to_byte(n)
+  end
+
+  def byte_to_char(pos)
+    @pieces.byte_to_char(pos)
   end
 
 private
 
-  # ¶ Before we get to our Scanner class, let’s write that \Ruby{update_point}
-  # method that has been so heavily used in the methods defined above.  As
-  # already stated, the idea is to defer creating new pieces for point to point
-  # at until we perform an edit.  Once an edit is going to take place, however,
-  # we may have to set up new pieces in the piece tree for point to point at,
-  # so as to be able to perform the edit in question.  The procedure is
-  # somewhat complicated and depends on what end of point we are updating.
-  # After figuring out what position to use, we check if the piece at that
-  # position needs to be split, i.e., we aren’t at a piece boundary.  If so, we
-  # create a new piece, shrink the old one and insert the new one after it.
-  def update_point(p)
-    return unless @point[p].nil?
-    pos = (p == :first) ? @point.range.begin : @point.range.end
-    iter = @pieces[pos == $buffer.size ? pos - 1 : pos]
-    piece = iter.piece
-    doc_pos = iter.pos
-    if pos > doc_pos and pos <= doc_pos + piece.size
-      right = PieceTree::Piece.new(piece.origin, piece.offset + pos - doc_pos,
-                                   piece.size + doc_pos - pos, 0)
-      piece.size -= right.size
-      @pieces.size -= right.size
-      iter.dup.insert(right, :after)
-      iter.next
+  # ¶ The identity of our original file is made up of its size, modification
+  # time, and inode.  Something that isn’t a file, such as a StringIO, has
+  # neither of the latter two, so an MD5 digest of its contents takes their
+  # place.  Reading all of it just to open it would defeat the purpose of
+  # mapping files, so the digest isn’t computed until a session is actually
+  # saved or loaded.
+  def identify(io)
+    return nil unless io.respond_to? :stat
+    stat = io.stat
+    [@original.size, stat.mtime.to_i, stat.ino]
+  end
+
+  def identity
+    @identity ||= begin
+      contents = @original.size.zero? ? '' : @original[0, @original.size]
+      [@original.size] +
+        join_words(Digest::MD5.digest(contents).unpack('N*'))
     end
-    @point[p] = iter
+  end
+
+  # ¶ Sessions are made of 32||bit words, so we need a way of splitting values
+  # into words and joining them together again.
+  def split_words(values)
+    values.map { |v| [v >> 32, v & 0xffffffff] }.flatten
+  end
+
+  def join_words(words)
+    (0...words.size / 2).map { |i| (words[2 * i] << 32) | words[2 * i + 1] }
   end
 
   # ¶ The Scanner class will be responsible for managing a buffered read method
-  # of the buffer it’s associated with.  This read method will then be used by
-  # the our pattern||matcher library for fetching input to the automaton.
+  # of the piece||tree it’s associated with, either that of a buffer or a
+  # snapshot of it.  This read method will then be used by the our
+  # pattern||matcher library for fetching input to the automaton.
   class Scanner
 
     # ¶ Initialization isn’t all that interesting.  The \Ruby{@str} instance
-    # variable will act as a cache for reads.  \Ruby{@pos_used} and
-    # \Ruby{@base} are used in managing the buffer and keeping track of
-    # transforming offsets of matches.
-    def initialize(buffer, pos, end_pos)
-      @buffer, @pos, @end_pos = buffer, pos, end_pos
+    # variable will act as a cache for reads, \Ruby{@base} is the offset in
+    # the tree at which it begins, and \Ruby{@pos} is where the next read or
+    # search begins.
+    def initialize(pieces, pos, end_pos)
+      @pieces, @pos, @end_pos = pieces, pos, end_pos
       @str = nil
+      @ascii = false
       @base = @pos
     end
 
     # ¶ The search method itself is straightforward.  It simply invokes the
     # matcher on ourselves, checks for any matches, updates them to correspond
     # to the correct offsets within the editor buffer (as opposed to the cache
-    # used by read), and returns the resulting ranges, if any.
+    # used by read), and returns the resulting ranges, if any.  The matcher
+    # counts characters, not bytes, so we let the piece||tree translate its
+    # offsets for us.
     def search(matcher)
-      mbase = @pos
+      cbase = @pieces.byte_to_char(@pos)
       ms = matcher.match(self)
       return nil if ms.nil?
       ret = []
-      ms.each{ |m| ret << ((m.begin + mbase)..(m.end + mbase)) }
+      ms.each do |m|
+        ret << (@pieces.char_to_byte(cbase + m.begin)..
+                @pieces.char_to_byte(cbase + m.end))
+      end
       @pos = ret[0].end
       ret
     end
@@ -392,86 +563,63 @@ private
     #
     # \startenumerate
     #   \item If we have gone beyond the given limit of our search or the end
-    #     of the buffer, we terminate.
+    #     of the tree, we terminate.
     #
-    #   \item Otherwise, if any data remains in our cache, we will use it.
+    #   \item Otherwise, if a search has ended in the middle of our cache, the
+    #     next one continues with what remains of it.
     #
-    #   \item Given that neither of these cases hold, we fill the buffer with a
-    #     fixed amount of new data and advance our position pointer.
+    #   \item Given that neither of these cases hold, we fill the cache with
+    #     the next chunk of the tree and advance our position past it.
     # \stopenumerate
     #
-    # This algorithm can be improved by including minimum and maximum lengths
-    # of the cache, so that we may concatenate the contents of many short
-    # pieces together, while making sure that very long ones don’t get read in
-    # all at once into our cache.
+    # Chunks follow the pieces of the tree, see \C{PieceTree#chunk}, so that
+    # the contents of many short pieces are read together, while very long
+    # ones don’t get read in all at once.  What remains of the cache is a
+    # substring at its end, which Ruby shares with it rather than copying.
+    ChunkMin = 4096
+    ChunkMax = 65536
+
     def read
-      return nil if (@end_pos and @pos >= @end_pos) or @pos >= @buffer.size
+      return nil if (@end_pos and @pos >= @end_pos) or @pos >= @pieces.size
 
-      read_of_str = @pos - @base
-      if read_of_str > 0 and read_of_str < @str.length
-        @str = @str[read_of_str..-1]
+      if @str and @pos > @base and @pos < @base + @str.size
+        str = @str[(@pos - @base)..-1]
       else
-        len = @end_pos ? [4096, @end_pos - @pos].min : 4096
-        @str = @buffer[@pos, len]
-        @pos += 4096
+        max = @end_pos ? [ChunkMax, @end_pos - @pos].min : ChunkMax
+        @base = @pos
+        str = @str = @pieces.chunk(@pos, ChunkMin, max)
+        @ascii = @pieces.ascii?(@pos, @str.size)
       end
-      @base = @pos
+      @pos = @base + @str.size
 
-      @str
+      str
+    end
+
+    # ¶ Along with each string that we read, we find out if its characters
+    # are all \ASCII, which the tree can tell us without looking at them, so
+    # that the pattern||matcher doesn’t have to decode them.  What remains of
+    # a string after a search has used part of it is still such a string.
+    def ascii?
+      @ascii
     end
 
     attr :pos, true
   end
 
-  # ¶ Our point class is nothing but a structure with three fields, whose roles
+  # ¶ Our point class is nothing but a structure with two fields, whose roles
   # have already been explained.
-  Point = Struct.new(:range, :first, :last)
-
-  # ¶ The original file is represented by the following class.  It uses a
-  # somewhat complicated caching||scheme to speed up accesses.  The idea is to
-  # always keep a region before and after the last current access point (that
-  # didn’t hit the cache) so that future accesses may hit the cache with good
-  # probability.  We need to keep a region both before and after, as both
-  # access||patterns are likely to occur (think window||scrolling if that makes
-  # any sense to you).  The blocks that we read are $2^16$ in size, so we keep
-  # a rather large cache around.  Again, this value will be optimized in the
-  # future, when more data has been collected regarding its operation.
-  class Original
-    def initialize(io)
-      @io = io
-      @buffer = ''
-      @mapped_offset = 0
-    end
-
-    def [](pos, len = 1)
-      ret = ""
-      while len > 0
-        assure_buffer(pos)
-        b = (len > BLOCK_SIZE) ? BLOCK_SIZE : len
-        ret << @buffer[pos - @mapped_offset, b]
-        len -= b
-        pos += b
-      end
-      ret
-    end
+  Point = Struct.new(:first, :last)
 
-  private
+  # ¶ A snapshot of a buffer consists of a snapshot of its piece||tree and the
+  # range of point at the time that it was taken.
+  Snapshot = Struct.new(:pieces, :point)
 
-    BLOCK_SIZE = 2 << 16
+  # ¶ The result of a search in the background consists of the version of the
+  # buffer that was searched and the ranges that matched, or \Ruby{nil}.
+  SearchResult = Struct.new(:version, :matches)
 
-    def calculate_base(offset)
-      (offset < BLOCK_SIZE / 2) ?
-        0 :
-        ((offset + BLOCK_SIZE / 4) & ~(BLOCK_SIZE / 2 - 1)) - BLOCK_SIZE / 2
-    end
-
-    def assure_buffer(offset)
-      base = calculate_base(offset)
-      return unless @buffer.empty? or @mapped_offset != base
-
-      @mapped_offset = base
-      @io.seek(@mapped_offset)
-      @io.read(BLOCK_SIZE, @buffer)
-    end
-  end
+  # ¶ Session files begin with a magic word, so that we don’t mistake some
+  # other file for one.  The version at the end lets us change the format
+  # later on.
+  SessionMagic = "NedSess2"
 end
@@ -22,5 +22,11 @@ module Ned::CommandLine
       $buffer.insert(@text, :after)
       $buffer.point = ($buffer.point.begin..($buffer.point.end + @text.length))
     end
+
+    # ¶ When point is all that we’re given as an address, we simply replace it
+    # with our text, which lets the extract command batch us up:
+    def replacement
+      @text if @address.is_a? Parsers::Tokens::Command::PointAddress
+    end
   end
 end
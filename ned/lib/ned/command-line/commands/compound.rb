@@ -8,7 +8,9 @@
 #
 # It has already been suggested that we may create commands that consist of
 # other commands.  The following code implements a command that groups a set of
-# commands delimited by \type/{/\dots\type/}/ together as one command.
+# commands delimited by \type/{/\dots\type/}/ together as one command.  The
+# group is executed as a transaction, so if any of its commands fail, the
+# buffer is left as it was before the group was executed.
 module Ned::CommandLine
   module Commands
     class EndCompound < Command
@@ -23,8 +25,10 @@ module Ned::CommandLine
       end
 
       def execute
-        @commands.each do |command|
-          command.execute
+        $buffer.transaction do
+          @commands.each do |command|
+            command.execute
+          end
         end
       end
     end
@@ -21,5 +21,11 @@ module Ned::CommandLine
       $buffer.point = @address
       $buffer.delete
     end
+
+    # ¶ In the same manner as the change command, we tell the extract command
+    # that we replace point with nothing when it’s all we’re given:
+    def replacement
+      '' if @address.is_a? Parsers::Tokens::Command::PointAddress
+    end
   end
 end
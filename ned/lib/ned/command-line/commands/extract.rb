@@ -28,10 +28,27 @@ module Ned::CommandLine
         matches << m[0]
         s.pos += 1 if m[0].end - m[0].begin == 0
       end
-      matches.reverse_each do |match|
-        $buffer.point = (match.begin..match.end)
-        @command.execute
+      if (text = replacement(matches))
+        $buffer.replace_all(matches.map { |match| [match, text] })
+      else
+        matches.reverse_each do |match|
+          $buffer.point = (match.begin..match.end)
+          @command.execute
+        end
       end
     end
+
+    private
+
+    # ¶ If all our command does is replace point with some fixed text, we can
+    # let the buffer make all the replacements in one go.  The change and
+    # delete commands tell us what text that is through their
+    # \Ruby{replacement} methods.  Deleting an empty point removes the symbol
+    # after it, though, so we only do this if none of the matches are empty.
+    def replacement(matches)
+      return nil unless @command.respond_to? :replacement
+      return nil if matches.any? { |match| match.end == match.begin }
+      @command.replacement
+    end
   end
 end
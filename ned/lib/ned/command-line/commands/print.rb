@@ -18,7 +18,16 @@ module Ned::CommandLine
 
     def execute
       $buffer.point = @address
-      puts $buffer[$buffer.point]
+      last = nil
+      $buffer.each_chunk($buffer.point) do |chunk|
+        $stdout.write chunk
+        last = chunk
+      end
+      $stdout.write "\n" unless last and last[-1] == ?\n
     end
+
+    # ¶ We write point one piece at a time, rather than extracting all of it
+    # first, as point may well cover most of a large buffer.  Like
+    # \Ruby{puts}, we end with a newline, unless point already does.
   end
 end